@@ -71,13 +71,103 @@
  *   example, since Analog/NXT sensors cannot be auto-detected, you must use
  *   this attribute to load the correct driver. Returns -ENOSYS if setting a
  *   device is not supported.
+ * .
+ * ### Fast stop
+ * .
+ * Writing `brake` or `coast` to `/sys/class/lego-port/fast_stop` immediately
+ * stops every motor on every port that supports it. The outputs are driven
+ * directly from the writing context, bypassing ramping and any motor driver
+ * timers, and stay stopped until `release` is written. Reading returns the
+ * current state (`release`, `brake` or `coast`). Note: motor drivers that are
+ * still running when the stop is released will resume driving the outputs,
+ * so stop the motors first.
+ * .
+ * The stop can also be triggered by a GPIO (for example, an emergency stop
+ * button) by setting the `fast_stop_gpio` module parameter. The stop is
+ * triggered on the falling edge. Other drivers can trigger it by calling
+ * `lego_port_fast_stop()`.
+ * .
+ * The time taken by the last and the slowest stop, measured from the trigger
+ * until the last output has been stopped, can be found in
+ * `/sys/kernel/debug/lego-port/`.
  */
 
+#include <linux/atomic.h>
 #include <linux/err.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/gpio.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
+#include <linux/spinlock.h>
 
 #include <lego_port_class.h>
+#include <dc_motor_class.h>
+
+static int fast_stop_gpio = -1;
+module_param(fast_stop_gpio, int, 0444);
+MODULE_PARM_DESC(fast_stop_gpio, "GPIO that triggers a fast stop (brake) of "
+	"all motors on its falling edge or -1 to disable.");
+
+static LIST_HEAD(lego_port_fast_stop_list);
+static DEFINE_SPINLOCK(lego_port_fast_stop_lock);
+static enum dc_motor_command lego_port_fast_stop_state = DC_MOTOR_COMMAND_RUN;
+static u64 lego_port_fast_stop_last_ns;
+static u64 lego_port_fast_stop_max_ns;
+static u32 lego_port_fast_stop_count;
+static struct dentry *lego_port_debugfs;
+
+static void lego_port_do_fast_stop(enum dc_motor_command command,
+				   ktime_t start)
+{
+	struct lego_port_device *port;
+	unsigned long flags;
+	u64 elapsed;
+
+	spin_lock_irqsave(&lego_port_fast_stop_lock, flags);
+	list_for_each_entry(port, &lego_port_fast_stop_list, fast_stop_entry)
+		port->motor_ops->set_fast_stop(port->context, command);
+	lego_port_fast_stop_state = command;
+	if (command != DC_MOTOR_COMMAND_RUN) {
+		elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+		lego_port_fast_stop_last_ns = elapsed;
+		if (elapsed > lego_port_fast_stop_max_ns)
+			lego_port_fast_stop_max_ns = elapsed;
+		lego_port_fast_stop_count++;
+	}
+	spin_unlock_irqrestore(&lego_port_fast_stop_lock, flags);
+}
+
+/**
+ * lego_port_fast_stop - Immediately stop all motors on all ports.
+ * @brake: Brake the motors if true, otherwise coast.
+ *
+ * Can be called from any context, including interrupt handlers. Motors stay
+ * stopped until lego_port_fast_stop_release() is called.
+ */
+void lego_port_fast_stop(bool brake)
+{
+	lego_port_do_fast_stop(brake ? DC_MOTOR_COMMAND_BRAKE
+				     : DC_MOTOR_COMMAND_COAST, ktime_get());
+}
+EXPORT_SYMBOL_GPL(lego_port_fast_stop);
+
+/**
+ * lego_port_fast_stop_release - Allow motors to run again after a fast stop.
+ */
+void lego_port_fast_stop_release(void)
+{
+	lego_port_do_fast_stop(DC_MOTOR_COMMAND_RUN, ktime_get());
+}
+EXPORT_SYMBOL_GPL(lego_port_fast_stop_release);
+
+static irqreturn_t lego_port_fast_stop_irq(int irq, void *dev_id)
+{
+	lego_port_do_fast_stop(DC_MOTOR_COMMAND_BRAKE, ktime_get());
+
+	return IRQ_HANDLED;
+}
 
 static ssize_t mode_show(struct device *dev, struct device_attribute *attr,
 			 char *buf)
@@ -185,7 +275,8 @@ static void lego_port_release(struct device *dev)
 {
 }
 
-static unsigned lego_port_class_id = 0;
+/* ports can be registered by several drivers at the same time */
+static atomic_t lego_port_class_id = ATOMIC_INIT(-1);
 
 int lego_port_register(struct lego_port_device *port,
 		       const struct device_type *type,
@@ -200,12 +291,26 @@ int lego_port_register(struct lego_port_device *port,
 	port->dev.parent = parent;
 	port->dev.class = &lego_port_class;
 	port->dev.type = type;
-	dev_set_name(&port->dev, "port%d", lego_port_class_id++);
+	dev_set_name(&port->dev, "port%d",
+		     atomic_inc_return(&lego_port_class_id));
 
 	err = device_register(&port->dev);
 	if (err)
 		return err;
 
+	INIT_LIST_HEAD(&port->fast_stop_entry);
+	if (port->motor_ops && port->motor_ops->set_fast_stop) {
+		unsigned long flags;
+
+		spin_lock_irqsave(&lego_port_fast_stop_lock, flags);
+		list_add_tail(&port->fast_stop_entry, &lego_port_fast_stop_list);
+		/* new ports must not escape a stop that is in effect */
+		if (lego_port_fast_stop_state != DC_MOTOR_COMMAND_RUN)
+			port->motor_ops->set_fast_stop(port->context,
+						lego_port_fast_stop_state);
+		spin_unlock_irqrestore(&lego_port_fast_stop_lock, flags);
+	}
+
 	dev_info(&port->dev, "Bound to device '%s'\n", dev_name(parent));
 
 	return 0;
@@ -214,6 +319,12 @@ EXPORT_SYMBOL_GPL(lego_port_register);
 
 void lego_port_unregister(struct lego_port_device *port)
 {
+	unsigned long flags;
+
+	spin_lock_irqsave(&lego_port_fast_stop_lock, flags);
+	list_del_init(&port->fast_stop_entry);
+	spin_unlock_irqrestore(&lego_port_fast_stop_lock, flags);
+
 	dev_info(&port->dev, "Unregistered\n");
 	device_unregister(&port->dev);
 }
@@ -238,9 +349,45 @@ static char *lego_port_devnode(struct device *dev, umode_t *mode)
 	return kasprintf(GFP_KERNEL, "lego-port/%s", dev_name(dev));
 }
 
+static const char *lego_port_fast_stop_names[] = {
+	[DC_MOTOR_COMMAND_RUN]		= "release",
+	[DC_MOTOR_COMMAND_COAST]	= "coast",
+	[DC_MOTOR_COMMAND_BRAKE]	= "brake",
+};
+
+static ssize_t fast_stop_show(struct class *class, struct class_attribute *attr,
+			      char *buf)
+{
+	return sprintf(buf, "%s\n",
+		       lego_port_fast_stop_names[lego_port_fast_stop_state]);
+}
+
+static ssize_t fast_stop_store(struct class *class,
+			       struct class_attribute *attr,
+			       const char *buf, size_t count)
+{
+	ktime_t start = ktime_get();
+	int i;
+
+	for (i = 0; i < NUM_DC_MOTOR_COMMANDS; i++) {
+		if (sysfs_streq(buf, lego_port_fast_stop_names[i])) {
+			lego_port_do_fast_stop(i, start);
+			return count;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static struct class_attribute lego_port_class_attrs[] = {
+	__ATTR_RW(fast_stop),
+	__ATTR_NULL
+};
+
 struct class lego_port_class = {
 	.name		= "lego-port",
 	.owner		= THIS_MODULE,
+	.class_attrs	= lego_port_class_attrs,
 	.dev_groups	= lego_port_class_groups,
 	.dev_uevent	= lego_port_dev_uevent,
 	.devnode	= lego_port_devnode,
@@ -249,12 +396,58 @@ EXPORT_SYMBOL_GPL(lego_port_class);
 
 static int __init lego_port_class_init(void)
 {
-	return class_register(&lego_port_class);
+	int err;
+
+	err = class_register(&lego_port_class);
+	if (err)
+		return err;
+
+	if (fast_stop_gpio >= 0) {
+		err = gpio_request_one(fast_stop_gpio, GPIOF_IN, "fast_stop");
+		if (err) {
+			pr_err("failed to request fast stop gpio (%d)\n", err);
+			goto err_gpio_request;
+		}
+		err = request_irq(gpio_to_irq(fast_stop_gpio),
+				  lego_port_fast_stop_irq, IRQF_TRIGGER_FALLING,
+				  "lego-port-fast-stop", NULL);
+		if (err) {
+			pr_err("failed to request fast stop irq (%d)\n", err);
+			goto err_request_irq;
+		}
+	}
+
+	lego_port_debugfs = debugfs_create_dir("lego-port", NULL);
+	if (!IS_ERR_OR_NULL(lego_port_debugfs)) {
+		debugfs_create_u64("fast_stop_last_ns", S_IRUGO,
+				   lego_port_debugfs,
+				   &lego_port_fast_stop_last_ns);
+		debugfs_create_u64("fast_stop_max_ns", S_IRUGO | S_IWUSR,
+				   lego_port_debugfs,
+				   &lego_port_fast_stop_max_ns);
+		debugfs_create_u32("fast_stop_count", S_IRUGO,
+				   lego_port_debugfs,
+				   &lego_port_fast_stop_count);
+	}
+
+	return 0;
+
+err_request_irq:
+	gpio_free(fast_stop_gpio);
+err_gpio_request:
+	class_unregister(&lego_port_class);
+
+	return err;
 }
 module_init(lego_port_class_init);
 
 static void __exit lego_port_class_exit(void)
 {
+	debugfs_remove_recursive(lego_port_debugfs);
+	if (fast_stop_gpio >= 0) {
+		free_irq(gpio_to_irq(fast_stop_gpio), NULL);
+		gpio_free(fast_stop_gpio);
+	}
 	class_unregister(&lego_port_class);
 }
 module_exit(lego_port_class_exit);
@@ -32,14 +32,20 @@
  * -----------------------------------------------------------------------------
  */
 
+#include <linux/bitops.h>
+#include <linux/delay.h>
 #include <linux/module.h>
 #include <linux/types.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
 #include <linux/device.h>
 #include <linux/err.h>
 #include <linux/hrtimer.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
 #include <linux/platform_data/legoev3.h>
 
 #include <mach/legoev3.h>
@@ -48,20 +54,36 @@
 
 #define DRVNAME "legoev3-analog"
 
+static unsigned capture_buffer_size = 65536;
+module_param(capture_buffer_size, uint, 0444);
+MODULE_PARM_DESC(capture_buffer_size, "Number of samples in the capture buffer");
+
 /*
  * The EV3 uses a TI ADS7957 A/C converter chip for reading analog voltage
  * values. <http://www.ti.com/lit/ds/symlink/alg7957.pdf>
  */
 
-#define ADS7957_NUM_CHANNELS	16
+#define ADS7957_NUM_CHANNELS	LEGOEV3_ANALOG_NUM_CHANNELS
 #define ADS7957_RESOLUTION	10
 #define ADS7957_VALUE_MASK	((1 << ADS7957_RESOLUTION) - 1)
 #define ADS7957_REF_UV		2500000
 #define ADS7957_LSB_UV		(2 * ADS7957_REF_UV / ADS7957_VALUE_MASK)
 #define ADS7957_MODE_MANUAL	0x1
-#define ADS7957_MODE_AUTO1	0x2
 #define ADS7957_PROG_ENA	0x1
 #define ADS7957_RANGE_5V	0x1
+/*
+ * In manual mode, the result for the channel selected in frame n is shifted
+ * out in frame n + 2. Every result carries its channel number, so results that
+ * spill over into the next message are still stored in the correct place.
+ */
+#define ADS7957_PIPELINE_DEPTH	2
+/*
+ * Limits the length of a scan message so that it always completes well
+ * within one tick, even when channels are oversampled. Channels that do not
+ * fit are scanned on the next tick.
+ */
+#define ADS7957_MAX_SCAN_FRAMES	128
+#define ADS7957_MAX_FRAMES	(ADS7957_MAX_SCAN_FRAMES + ADS7957_PIPELINE_DEPTH)
 
 #define ADS7957_COMMAND_MANUAL(channel) \
 	((ADS7957_MODE_MANUAL	<< 12) |	\
@@ -69,26 +91,112 @@
 	 ((channel)		<< 7)  |	\
 	 (ADS7957_RANGE_5V	<< 6))
 
-#define ADS7957_COMMAND_AUTO \
-	((ADS7957_MODE_AUTO1	<< 12) |	\
-	 (ADS7957_PROG_ENA	<< 11) |	\
-	 (ADS7957_RANGE_5V	<< 6))
+/*
+ * One buffer holds the latest published scan, one is being filled by the SPI
+ * completion and one is left for readers that are still looking at the
+ * previous scan, e.g. callbacks that are running in the tasklet.
+ */
+#define NUM_SCAN_BUFFERS	3
+
+/* Longest time to wait for an SPI message that is in flight */
+#define MSG_TIMEOUT_MS		100
 
 #define UPDATE_SLOW_NS		10000000		/*  10 msec */
 #define UPDATE_FAST_NS		(UPDATE_SLOW_NS / 10)	/*   1 msec */
 #define UPDATE_COLOR_NS		(UPDATE_FAST_NS / 5)	/* 200 usec */
+#define UPDATE_BATTERY_NS	(UPDATE_SLOW_NS * 10)	/* 100 msec */
+
+/*
+ * Channels are scheduled in units of UPDATE_TICK_NS. Channels that nobody has
+ * asked for a rate on are still read every UPDATE_SLOW_NS since the input and
+ * output ports poll them for device detection.
+ */
+#define UPDATE_TICK_NS		UPDATE_FAST_NS
+#define NS_TO_TICKS(ns)		DIV_ROUND_UP((ns), UPDATE_TICK_NS)
+#define DEFAULT_PERIOD_TICKS	NS_TO_TICKS(UPDATE_SLOW_NS)
+#define BATTERY_PERIOD_TICKS	NS_TO_TICKS(UPDATE_BATTERY_NS)
+
+/*
+ * While NXT color sensors are being read, the timer runs every UPDATE_COLOR_NS
+ * to give the LEDs time to settle between conversions. One of these ticks out
+ * of every UPDATE_TICK_NS is used for the scheduled channels instead.
+ */
+#define COLOR_TICKS_PER_TICK	(UPDATE_TICK_NS / UPDATE_COLOR_NS)
+
+/* A single conversion has to wait for the result to come out of the pipeline */
+#define READ_ONE_FRAMES		(1 + ADS7957_PIPELINE_DEPTH)
+
+enum legoev3_analog_capture_state {
+	CAPTURE_STATE_IDLE,
+	CAPTURE_STATE_ARMED,
+	CAPTURE_STATE_TRIGGERED,
+	CAPTURE_STATE_DONE,
+	NUM_CAPTURE_STATE
+};
+
+static const char * const legoev3_analog_capture_state_names[] = {
+	[CAPTURE_STATE_IDLE]		= "idle",
+	[CAPTURE_STATE_ARMED]		= "armed",
+	[CAPTURE_STATE_TRIGGERED]	= "triggered",
+	[CAPTURE_STATE_DONE]		= "done",
+};
 
-enum nxt_color_read_state {
-	NXT_COLOR_READ_STATE_AMBIANT,
-	NXT_COLOR_READ_STATE_RED,
-	NXT_COLOR_READ_STATE_GREEN,
-	NXT_COLOR_READ_STATE_BLUE,
-	NUM_NXT_COLOR_READ_STATE,
+/**
+ * struct legoev3_analog_capture - high rate capture of a set of channels
+ * @state: The state of the capture.
+ * @channels: Bitmap of the channels to capture.
+ * @trigger_ch: The channel that triggers the capture or -1 to start right
+ *	away.
+ * @trigger_rising: Trigger when the value rises to trigger_level instead of
+ *	when it falls to trigger_level.
+ * @trigger_level: Raw value that triggers the capture.
+ * @pretrigger: Number of samples to keep from before the trigger.
+ * @buf: Ring buffer of raw ADC words. Each word contains the channel number in
+ *	the top 4 bits like the words returned by the ADC.
+ * @head: Index in buf where the next sample is written.
+ * @count: Number of valid samples in buf.
+ * @remaining: Number of samples left to capture after the trigger.
+ * @skip: Number of results to skip at the start of the next message.
+ * @last_value: Previous value of the trigger channel.
+ * @scan_due: Set by the timer while the capture is armed to have the next
+ *	capture message replaced by a normal scan.
+ */
+struct legoev3_analog_capture {
+	enum legoev3_analog_capture_state state;
+	unsigned long channels;
+	int trigger_ch;
+	bool trigger_rising;
+	u16 trigger_level;
+	unsigned pretrigger;
+	u16 *buf;
+	unsigned head;
+	unsigned count;
+	unsigned remaining;
+	unsigned skip;
+	u16 last_value;
+	bool scan_due;
 };
 
 struct legoev3_analog_callback_info {
 	legoev3_analog_cb_func_t function;
 	void *context;
+	unsigned flags;
+};
+
+/**
+ * struct legoev3_analog_nxt_color_info - NXT color sensor on an input port
+ * @set_led: Selects the LED for the next conversion.
+ * @frame_ready: Called when a new frame has been published.
+ * @context: Passed back to set_led and frame_ready.
+ * @frames: Buffers for the frames.
+ * @latest: The most recently published frame.
+ */
+struct legoev3_analog_nxt_color_info {
+	legoev3_analog_nxt_color_led_func_t set_led;
+	legoev3_analog_nxt_color_cb_func_t frame_ready;
+	void *context;
+	struct legoev3_analog_nxt_color_frame frames[2];
+	struct legoev3_analog_nxt_color_frame *latest;
 };
 
 /**
@@ -102,29 +210,54 @@ struct legoev3_analog_callback_info {
  *	update.
  * @msg_busy: Used to prevent sending a second SPI message before the current
  *	one has completed.
+ * @read_one_busy: The "read one channel" message for an NXT color sensor has
+ *	been sent and its completion has not finished yet.
+ * @msg_wait: Woken up when an SPI message has completed.
  * @read_one_tx_buf: Transmit buffer for a "read one channel" message.
  * @read_one_rx_buf: Receive buffer for a "read one channel" message.
- * @read_one_txf: Structure that binds the transmit and receive buffers to the
+ * @read_one_txf: Structures that bind the transmit and receive buffers to the
  *	"read one channel" message.
  * @read_one_msg: SPI message that reads only one channel of the ADC.
- * @read_all_tx_buf: Transmit buffer for a "read all channels" message.
- * @read_all_rx_buf: Receive buffer for a "read all channels" message.
- * @read_all_txf: Structure that binds the transmit and receive buffers to the
- *	"read all channels" message.
- * @read_all_msg: SPI message that we reads all of the channels of the ADC.
- * @current_command: Stores the most recent command that was sent to the ADC.
- * @raw_data: Buffer to hold the raw (unscaled) input from the ADC for each
- *	channel.
+ * @scan_tx_buf: Transmit buffer for a scan message.
+ * @scan_rx_buf: Receive buffer for a scan message.
+ * @scan_txf: Structures that bind the transmit and receive buffers to the
+ *	scan message, one frame each.
+ * @scan_msg: SPI message that reads the channels that are due on this tick.
+ * @scan_len: Number of frames in the current scan message.
+ * @scan_pending: Channels that are due but have not been scanned yet, e.g.
+ *	because the previous message had not completed.
+ * @scan_next: Channel where the next scan starts. This is the first channel
+ *	that did not fit in the previous scan, or else the one after the last
+ *	channel of that scan.
+ * @ch_period: Number of ticks between reads for each channel.
+ * @ch_countdown: Number of ticks until each channel is due again.
+ * @ch_oversample: Number of conversions that are averaged for each reported
+ *	sample of each channel.
+ * @scans: Buffers for the scan results.
+ * @latest: The most recently published scan. Only the SPI completion writes
+ *	to the scan buffers, so this is all the synchronization that is needed.
  * @callbacks: Callback functions for each channel. Called when data is updated.
+ * @cb_lock: Protects callbacks. Consumers unregister from interrupt handlers,
+ *	so the function and context are copied under the lock before calling.
  * @callback_tasklet: Tasklet to perform callbacks for each channel.
- * @num_connected: Number of devices connected to the input and output ports.
- * @read_nxt_color: Indicates if we should be reading NXT color data for each
- *	input port.
+ * @dirty: Bitmap of the channels that have been read since the tasklet last
+ *	ran. Only the callbacks for these channels are called.
+ * @nxt_color_ports: Bitmap of the input ports that have an NXT color sensor
+ *	registered.
+ * @nxt_color_ready: Bitmap of the input ports that have a new frame that has
+ *	not been passed to frame_ready yet.
+ * @nxt_color: NXT color sensor info for each input port.
+ * @color_tick: Counts the UPDATE_COLOR_NS ticks within one UPDATE_TICK_NS.
  * @current_nxt_color_port: Indicate the currently selected port for reading NXT
  *	color data.
  * @current_nxt_color_read_state: Indicates which color we are currently reading
  *	for the current port.
- * @nxt_color_raw_data: Buffer to hold the raw data ready from NXT color sensors.
+ * @nxt_color_raw_data: The frame that is currently being acquired.
+ * @capture: High rate capture. While a capture is running, it uses the scan
+ *	message. While it is waiting for the trigger, a normal scan of all
+ *	channels is still done every UPDATE_SLOW_NS so that device detection
+ *	and the battery keep working. Once it is triggered, all other reads are
+ *	suspended until it is done.
  */
 struct legoev3_analog_device {
 	const char *name;
@@ -134,82 +267,391 @@ struct legoev3_analog_device {
 	struct hrtimer timer;
 	u64 next_update_ns;
 	bool msg_busy;
-	u16 read_one_tx_buf;
-	u16 read_one_rx_buf;
-	struct spi_transfer read_one_txf;
+	bool read_one_busy;
+	wait_queue_head_t msg_wait;
+	u16 read_one_tx_buf[READ_ONE_FRAMES];
+	u16 read_one_rx_buf[READ_ONE_FRAMES];
+	struct spi_transfer read_one_txf[READ_ONE_FRAMES];
 	struct spi_message read_one_msg;
-	u16 read_all_tx_buf[ADS7957_NUM_CHANNELS + 1];
-	u16 read_all_rx_buf[ADS7957_NUM_CHANNELS + 1];
-	struct spi_transfer read_all_txf[ADS7957_NUM_CHANNELS + 1];
-	struct spi_message read_all_msg;
-	u16 current_command;
-	u16 raw_data[ADS7957_NUM_CHANNELS];
+	u16 scan_tx_buf[ADS7957_MAX_FRAMES];
+	u16 scan_rx_buf[ADS7957_MAX_FRAMES];
+	struct spi_transfer scan_txf[ADS7957_MAX_FRAMES];
+	struct spi_message scan_msg;
+	unsigned scan_len;
+	unsigned long scan_pending;
+	unsigned scan_next;
+	unsigned ch_period[ADS7957_NUM_CHANNELS];
+	unsigned ch_countdown[ADS7957_NUM_CHANNELS];
+	unsigned ch_oversample[ADS7957_NUM_CHANNELS];
+	struct legoev3_analog_scan scans[NUM_SCAN_BUFFERS];
+	struct legoev3_analog_scan *latest;
 	struct legoev3_analog_callback_info callbacks[ADS7957_NUM_CHANNELS];
+	spinlock_t cb_lock;
 	struct tasklet_struct callback_tasklet;
-	u8 num_connected;
-	bool read_nxt_color[NUM_EV3_PORT_IN];
+	unsigned long dirty;
+	unsigned long nxt_color_ports;
+	unsigned long nxt_color_ready;
+	struct legoev3_analog_nxt_color_info nxt_color[NUM_EV3_PORT_IN];
+	unsigned color_tick;
 	enum legoev3_input_port_id current_nxt_color_port;
 	enum nxt_color_read_state current_nxt_color_read_state;
-	u16 nxt_color_raw_data[NUM_EV3_PORT_IN][NUM_NXT_COLOR_READ_STATE];
+	u16 nxt_color_raw_data[NUM_NXT_COLOR_READ_STATE];
+	struct legoev3_analog_capture capture;
 };
 
+static bool legoev3_analog_capture_running(struct legoev3_analog_device *alg);
+static int legoev3_analog_start_capture(struct legoev3_analog_device *alg);
+
+static void legoev3_analog_get_cb(struct legoev3_analog_device *alg, int ch,
+				  struct legoev3_analog_callback_info *info)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&alg->cb_lock, flags);
+	*info = alg->callbacks[ch];
+	spin_unlock_irqrestore(&alg->cb_lock, flags);
+}
+
+/*
+ * Moves on to the next port that has an NXT color sensor, starting with the
+ * ambient reading. The LED of the new port is already off since that is where
+ * every frame ends.
+ */
+static void legoev3_analog_next_nxt_color_port(struct legoev3_analog_device *alg)
+{
+	unsigned long ports = ACCESS_ONCE(alg->nxt_color_ports);
+	int port;
+
+	port = find_next_bit(&ports, NUM_EV3_PORT_IN,
+			     alg->current_nxt_color_port + 1);
+	if (port >= NUM_EV3_PORT_IN)
+		port = find_first_bit(&ports, NUM_EV3_PORT_IN);
+	if (port < NUM_EV3_PORT_IN)
+		alg->current_nxt_color_port = port;
+	alg->current_nxt_color_read_state = NXT_COLOR_READ_STATE_AMBIANT;
+}
+
+static void legoev3_analog_publish_nxt_color(struct legoev3_analog_device *alg)
+{
+	enum legoev3_input_port_id port = alg->current_nxt_color_port;
+	struct legoev3_analog_nxt_color_info *info = &alg->nxt_color[port];
+	struct legoev3_analog_nxt_color_frame *frame;
+
+	frame = &info->frames[info->latest == &info->frames[0]];
+	memcpy(frame->raw_data, alg->nxt_color_raw_data,
+	       sizeof(frame->raw_data));
+	frame->timestamp = ktime_get();
+	frame->generation = info->latest->generation + 1;
+	/* make sure the data is visible before the new pointer */
+	smp_wmb();
+	ACCESS_ONCE(info->latest) = frame;
+	set_bit(port, &alg->nxt_color_ready);
+}
+
 static void legoev3_analog_read_one_msg_complete(void* context)
 {
 	struct legoev3_analog_device *alg = context;
-	u16 val;
+	enum legoev3_input_port_id port = alg->current_nxt_color_port;
+	struct legoev3_analog_nxt_color_info *info = &alg->nxt_color[port];
+	u16 rx = alg->read_one_rx_buf[READ_ONE_FRAMES - 1];
 
 	if (alg->read_one_msg.status) {
 		dev_err(&alg->spi->dev, "%s: spi async fail %d\n",
 					__func__,
 					alg->read_one_msg.status);
 		hrtimer_cancel(&alg->timer);
-	} else if (alg->read_nxt_color[alg->current_nxt_color_port]) {
-		val = alg->read_one_rx_buf & ADS7957_VALUE_MASK;
-		alg->nxt_color_raw_data[alg->current_nxt_color_port][alg->current_nxt_color_read_state] = val;
+	} else if (!test_bit(port, &alg->nxt_color_ports)) {
+		/* the sensor was unregistered while we were reading it */
+		legoev3_analog_next_nxt_color_port(alg);
+	} else {
+		alg->nxt_color_raw_data[alg->current_nxt_color_read_state] =
+			(rx >> (12 - ADS7957_RESOLUTION)) & ADS7957_VALUE_MASK;
 		alg->current_nxt_color_read_state++;
-		if (alg->current_nxt_color_read_state >= NUM_NXT_COLOR_READ_STATE) {
-			alg->current_nxt_color_read_state = NXT_COLOR_READ_STATE_AMBIANT;
-			alg->current_nxt_color_port++;
-			if (alg->current_nxt_color_port >= NUM_EV3_PORT_IN)
-				alg->current_nxt_color_port = EV3_PORT_IN1;
-		}
-		if (alg->current_nxt_color_read_state) {
-			/* TODO: notify color sensor to update LED */
+		if (alg->current_nxt_color_read_state < NUM_NXT_COLOR_READ_STATE) {
+			/* the LED settles until the next color tick */
+			info->set_led(info->context,
+				      alg->current_nxt_color_read_state);
+		} else {
+			legoev3_analog_publish_nxt_color(alg);
+			info->set_led(info->context,
+				      NXT_COLOR_READ_STATE_AMBIANT);
+			legoev3_analog_next_nxt_color_port(alg);
+			tasklet_schedule(&alg->callback_tasklet);
 		}
 	}
 	alg->msg_busy = false;
+	/* the context of an unregistered sensor is no longer used after this */
+	ACCESS_ONCE(alg->read_one_busy) = false;
+	wake_up(&alg->msg_wait);
 }
 
-static void legoev3_analog_read_all_msg_complete(void* context)
+static void legoev3_analog_scan_msg_complete(void* context)
 {
 	struct legoev3_analog_device *alg = context;
-	int i = ADS7957_NUM_CHANNELS;
-	bool read_color = alg->read_nxt_color[alg->current_nxt_color_port];
+	struct legoev3_analog_scan *prev = alg->latest;
+	struct legoev3_analog_scan *next;
+	struct legoev3_analog_callback_info info;
+	u32 sum[ADS7957_NUM_CHANNELS] = { 0 };
+	u8 count[ADS7957_NUM_CHANNELS] = { 0 };
+	unsigned long updated = 0;
 	u16 val, channel;
+	int i, ret;
 
-	if (alg->read_all_msg.status) {
+	if (alg->scan_msg.status) {
 		dev_err(&alg->spi->dev, "%s: spi async fail %d\n",
 					__func__,
-					alg->read_all_msg.status);
+					alg->scan_msg.status);
 		hrtimer_cancel(&alg->timer);
 	} else {
-		do {
-			channel = alg->read_all_rx_buf[i] >> 12;
-			val = (alg->read_all_rx_buf[i] >> (12 - ADS7957_RESOLUTION))
+		next = &alg->scans[(prev - alg->scans + 1) % NUM_SCAN_BUFFERS];
+		memcpy(next->raw_data, prev->raw_data, sizeof(next->raw_data));
+		memcpy(next->hires_data, prev->hires_data,
+		       sizeof(next->hires_data));
+		/*
+		 * The first frames return the results of the previous message,
+		 * which are older than this scan, so they are skipped.
+		 */
+		for (i = ADS7957_PIPELINE_DEPTH; i < alg->scan_len; i++) {
+			channel = alg->scan_rx_buf[i] >> 12;
+			val = (alg->scan_rx_buf[i] >> (12 - ADS7957_RESOLUTION))
 			      & ADS7957_VALUE_MASK;
-			alg->raw_data[channel] = val;
-		} while (--i);
-		if (read_color) {
-			/* TODO: turn on first LED */
-		} else {
-			alg->current_nxt_color_port++;
-			if (alg->current_nxt_color_port >= NUM_EV3_PORT_IN)
-				alg->current_nxt_color_port = EV3_PORT_IN1;
-			alg->current_nxt_color_read_state = NXT_COLOR_READ_STATE_AMBIANT;
+			sum[channel] += val;
+			count[channel]++;
+			updated |= BIT(channel);
+		}
+		/* decimate oversampled channels to one sample each */
+		for_each_set_bit(i, &updated, ADS7957_NUM_CHANNELS) {
+			next->hires_data[i] = DIV_ROUND_CLOSEST(
+				sum[i] << LEGOEV3_ANALOG_HIRES_SHIFT, count[i]);
+			next->raw_data[i] = DIV_ROUND_CLOSEST(sum[i], count[i]);
+		}
+		next->updated = updated;
+		next->timestamp = ktime_get();
+		next->generation = prev->generation + 1;
+		/* make sure the data is visible before the new pointer */
+		smp_wmb();
+		ACCESS_ONCE(alg->latest) = next;
+
+		for_each_set_bit(i, &updated, ADS7957_NUM_CHANNELS) {
+			legoev3_analog_get_cb(alg, i, &info);
+			if (!info.function)
+				continue;
+			if (info.flags & LEGOEV3_ANALOG_CB_DIRECT)
+				info.function(info.context, next);
+			else
+				set_bit(i, &alg->dirty);
+		}
+		if (alg->dirty)
+			tasklet_schedule(&alg->callback_tasklet);
+
+		/* this scan was done in between the messages of a capture */
+		if (legoev3_analog_capture_running(alg)) {
+			ret = legoev3_analog_start_capture(alg);
+			if (!ret)
+				return;
+			dev_err(&alg->spi->dev, "%s: spi async fail %d\n",
+						__func__, ret);
+			alg->capture.state = CAPTURE_STATE_DONE;
 		}
-		tasklet_schedule(&alg->callback_tasklet);
 	}
 	alg->msg_busy = false;
+	wake_up(&alg->msg_wait);
+}
+
+/*
+ * Advances the per-channel countdowns by one tick and adds the channels that
+ * are due to scan_pending. Returns the number of ticks until the next channel
+ * is due.
+ */
+static unsigned legoev3_analog_schedule_tick(struct legoev3_analog_device *alg)
+{
+	unsigned next = DEFAULT_PERIOD_TICKS;
+	int i;
+
+	for (i = 0; i < ADS7957_NUM_CHANNELS; i++) {
+		if (alg->ch_countdown[i] <= 1) {
+			alg->scan_pending |= BIT(i);
+			alg->ch_countdown[i] = alg->ch_period[i];
+		} else
+			alg->ch_countdown[i]--;
+		if (alg->ch_countdown[i] < next)
+			next = alg->ch_countdown[i];
+	}
+
+	return next;
+}
+
+/*
+ * We only wake up when the next channel is due, so all of the countdowns have
+ * to be advanced by the time we are going to sleep.
+ */
+static void legoev3_analog_skip_ticks(struct legoev3_analog_device *alg,
+				      unsigned ticks)
+{
+	int i;
+
+	for (i = 0; i < ADS7957_NUM_CHANNELS; i++)
+		alg->ch_countdown[i] -= ticks - 1;
+}
+
+/*
+ * Builds a manual mode message that selects only the pending channels, once
+ * for each conversion of oversampled channels. The extra frames at the end
+ * flush the pipeline so that the results for all of the selected channels are
+ * returned in this message. Channels are taken in turn starting at scan_next,
+ * so that oversampled channels that are due on every tick cannot keep the
+ * ones that do not fit from ever being read. The first channel always fits
+ * since LEGOEV3_ANALOG_MAX_OVERSAMPLE is less than ADS7957_MAX_SCAN_FRAMES.
+ */
+static void legoev3_analog_build_scan(struct legoev3_analog_device *alg)
+{
+	int ch, i, j, n = 0;
+	int skipped = -1;
+
+	for (j = 0; j < ADS7957_NUM_CHANNELS; j++) {
+		ch = (alg->scan_next + j) % ADS7957_NUM_CHANNELS;
+		if (!(alg->scan_pending & BIT(ch)))
+			continue;
+		if (n + alg->ch_oversample[ch] > ADS7957_MAX_SCAN_FRAMES) {
+			if (skipped < 0)
+				skipped = ch;
+			continue;
+		}
+		for (i = 0; i < alg->ch_oversample[ch]; i++)
+			alg->scan_tx_buf[n++] = ADS7957_COMMAND_MANUAL(ch);
+		alg->scan_pending &= ~BIT(ch);
+		if (skipped < 0)
+			alg->scan_next = (ch + 1) % ADS7957_NUM_CHANNELS;
+	}
+	if (skipped >= 0)
+		alg->scan_next = skipped;
+	for (i = 0; i < ADS7957_PIPELINE_DEPTH; i++, n++)
+		alg->scan_tx_buf[n] = alg->scan_tx_buf[n - 1];
+
+	spi_message_init(&alg->scan_msg);
+	alg->scan_msg.complete = legoev3_analog_scan_msg_complete;
+	alg->scan_msg.context = alg;
+	for (ch = 0; ch < n; ch++) {
+		/* CS has to be pulsed between frames, but not after the last */
+		alg->scan_txf[ch].cs_change = ch < n - 1;
+		spi_message_add_tail(&alg->scan_txf[ch], &alg->scan_msg);
+	}
+	alg->scan_len = n;
+}
+
+static bool legoev3_analog_capture_running(struct legoev3_analog_device *alg)
+{
+	enum legoev3_analog_capture_state state = ACCESS_ONCE(alg->capture.state);
+
+	return state == CAPTURE_STATE_ARMED || state == CAPTURE_STATE_TRIGGERED;
+}
+
+static void legoev3_analog_capture_sample(struct legoev3_analog_device *alg,
+					  u16 rx)
+{
+	struct legoev3_analog_capture *cap = &alg->capture;
+	u16 val = (rx >> (12 - ADS7957_RESOLUTION)) & ADS7957_VALUE_MASK;
+	bool crossed;
+
+	cap->buf[cap->head] = rx;
+	cap->head = (cap->head + 1) % capture_buffer_size;
+	if (cap->count < capture_buffer_size)
+		cap->count++;
+
+	if (cap->state == CAPTURE_STATE_TRIGGERED) {
+		if (!--cap->remaining)
+			cap->state = CAPTURE_STATE_DONE;
+		return;
+	}
+	if (cap->state != CAPTURE_STATE_ARMED || rx >> 12 != cap->trigger_ch)
+		return;
+
+	if (cap->trigger_rising)
+		crossed = cap->last_value < cap->trigger_level
+			  && val >= cap->trigger_level;
+	else
+		crossed = cap->last_value > cap->trigger_level
+			  && val <= cap->trigger_level;
+	cap->last_value = val;
+	if (crossed && cap->count >= cap->pretrigger) {
+		cap->remaining = capture_buffer_size - cap->pretrigger;
+		cap->state = cap->remaining ? CAPTURE_STATE_TRIGGERED
+					    : CAPTURE_STATE_DONE;
+	}
+}
+
+/*
+ * Capture messages are sent back to back from the completion until the
+ * capture is done, so there are no gaps between them other than the time it
+ * takes to submit the next message.
+ */
+static void legoev3_analog_capture_msg_complete(void* context)
+{
+	struct legoev3_analog_device *alg = context;
+	struct legoev3_analog_capture *cap = &alg->capture;
+	int i, ret;
+
+	if (alg->scan_msg.status) {
+		dev_err(&alg->spi->dev, "%s: spi async fail %d\n",
+					__func__,
+					alg->scan_msg.status);
+		cap->state = CAPTURE_STATE_DONE;
+	} else {
+		for (i = cap->skip; i < alg->scan_len; i++) {
+			legoev3_analog_capture_sample(alg, alg->scan_rx_buf[i]);
+			if (!legoev3_analog_capture_running(alg))
+				break;
+		}
+		cap->skip = 0;
+	}
+	if (legoev3_analog_capture_running(alg)) {
+		if (cap->state == CAPTURE_STATE_ARMED && cap->scan_due) {
+			/* the capture is restarted when the scan completes */
+			cap->scan_due = false;
+			alg->scan_pending = BIT(ADS7957_NUM_CHANNELS) - 1;
+			legoev3_analog_build_scan(alg);
+		}
+		ret = spi_async(alg->spi, &alg->scan_msg);
+		if (!ret)
+			return;
+		dev_err(&alg->spi->dev, "%s: spi async fail %d\n",
+					__func__, ret);
+		cap->state = CAPTURE_STATE_DONE;
+	}
+	alg->msg_busy = false;
+	wake_up(&alg->msg_wait);
+}
+
+/*
+ * Builds a message that cycles through the capture channels. The length is a
+ * multiple of the number of channels so that consecutive messages continue
+ * the cycle. Since the next message follows right away, the results that are
+ * left in the pipeline at the end of one message are the first results of the
+ * next one, so no flush frames are needed.
+ */
+static int legoev3_analog_start_capture(struct legoev3_analog_device *alg)
+{
+	struct legoev3_analog_capture *cap = &alg->capture;
+	unsigned long channels = cap->channels;
+	int ch, n = 0;
+
+	while (n + hweight_long(channels) <= ADS7957_MAX_SCAN_FRAMES) {
+		for_each_set_bit(ch, &channels, ADS7957_NUM_CHANNELS)
+			alg->scan_tx_buf[n++] = ADS7957_COMMAND_MANUAL(ch);
+	}
+
+	spi_message_init(&alg->scan_msg);
+	alg->scan_msg.complete = legoev3_analog_capture_msg_complete;
+	alg->scan_msg.context = alg;
+	for (ch = 0; ch < n; ch++) {
+		alg->scan_txf[ch].cs_change = ch < n - 1;
+		spi_message_add_tail(&alg->scan_txf[ch], &alg->scan_msg);
+	}
+	alg->scan_len = n;
+	/* these are the results of whatever was read before the capture */
+	cap->skip = ADS7957_PIPELINE_DEPTH;
+
+	return spi_async(alg->spi, &alg->scan_msg);
 }
 
 static enum hrtimer_restart legoev3_analog_timer_callback(struct hrtimer *timer)
@@ -217,41 +659,73 @@ static enum hrtimer_restart legoev3_analog_timer_callback(struct hrtimer *timer)
 	struct legoev3_analog_device *alg =
 		container_of(timer, struct legoev3_analog_device, timer);
 	struct spi_device *spi = alg->spi;
-	bool read_all = alg->current_command == ADS7957_COMMAND_AUTO;
-	bool read_color = alg->read_nxt_color[alg->current_nxt_color_port];
-	bool last_color_read_state = alg->current_nxt_color_read_state ==
-						NUM_NXT_COLOR_READ_STATE - 1;
-	int ret;
-
-	if (!alg->num_connected)
+	bool read_color = ACCESS_ONCE(alg->nxt_color_ports);
+	bool scan = !read_color || alg->color_tick == 0;
+	unsigned ticks = 1;
+	u16 command;
+	int i, ret = 0;
+
+	if (legoev3_analog_capture_running(alg)) {
+		if (!alg->msg_busy) {
+			alg->msg_busy = true;
+			ret = legoev3_analog_start_capture(alg);
+			if (ret < 0) {
+				dev_err(&spi->dev, "%s: spi async fail %d\n",
+					__func__, ret);
+				alg->capture.state = CAPTURE_STATE_DONE;
+				alg->msg_busy = false;
+				wake_up(&alg->msg_wait);
+			}
+		} else if (alg->capture.state == CAPTURE_STATE_ARMED) {
+			alg->capture.scan_due = true;
+		}
 		alg->next_update_ns = UPDATE_SLOW_NS;
-	else if (read_color)
-		alg->next_update_ns = UPDATE_COLOR_NS;
-	else
-		alg->next_update_ns = UPDATE_FAST_NS;
-	hrtimer_forward_now(timer, ktime_set(0, alg->next_update_ns));
-
-	if (alg->msg_busy)
+		hrtimer_forward_now(timer, ns_to_ktime(alg->next_update_ns));
 		return HRTIMER_RESTART;
+	}
 
-	alg->current_command = (read_color && !last_color_read_state)
-		? ADS7957_COMMAND_MANUAL(alg->pdata->in_pin1_ch[alg->current_nxt_color_port])
-		: ADS7957_COMMAND_AUTO;
-	alg->msg_busy = true;
-	if (read_all) {
-		alg->read_all_tx_buf[ADS7957_NUM_CHANNELS - 1] = alg->current_command;
-		ret = spi_async(spi, &alg->read_all_msg);
-	} else {
-		alg->read_one_tx_buf = alg->current_command;
-		ret = spi_async(spi, &alg->read_one_msg);
+	if (read_color)
+		alg->color_tick = (alg->color_tick + 1) % COLOR_TICKS_PER_TICK;
+	if (scan)
+		ticks = legoev3_analog_schedule_tick(alg);
+
+	if (!alg->msg_busy && (!scan || alg->scan_pending)) {
+		alg->msg_busy = true;
+		if (scan) {
+			legoev3_analog_build_scan(alg);
+			ret = spi_async(spi, &alg->scan_msg);
+		} else {
+			if (!test_bit(alg->current_nxt_color_port,
+				      &alg->nxt_color_ports))
+				legoev3_analog_next_nxt_color_port(alg);
+			command = ADS7957_COMMAND_MANUAL(
+				alg->pdata->in_pin1_ch[alg->current_nxt_color_port]);
+			for (i = 0; i < READ_ONE_FRAMES; i++)
+				alg->read_one_tx_buf[i] = command;
+			alg->read_one_busy = true;
+			ret = spi_async(spi, &alg->read_one_msg);
+		}
 	}
 	if (ret < 0) {
 		dev_err(&spi->dev, "%s: spi async fail %d\n",
 				__func__, ret);
 		alg->msg_busy = false;
+		alg->read_one_busy = false;
+		wake_up(&alg->msg_wait);
 		return HRTIMER_NORESTART;
 	}
 
+	/* channels that did not fit in this message are read on the next tick */
+	if (alg->scan_pending || read_color)
+		ticks = 1;
+	if (scan)
+		legoev3_analog_skip_ticks(alg, ticks);
+	if (read_color)
+		alg->next_update_ns = UPDATE_COLOR_NS;
+	else
+		alg->next_update_ns = ticks * UPDATE_TICK_NS;
+	hrtimer_forward_now(timer, ns_to_ktime(alg->next_update_ns));
+
 	return HRTIMER_RESTART;
 }
 
@@ -265,11 +739,29 @@ u16 legoev3_analog_get_value_for_ch(struct legoev3_analog_device *alg, u8 channe
 			 __func__, channel, ADS7957_NUM_CHANNELS);
 		return ret;
 	}
-	val = alg->raw_data[channel];
-	ret = val * ADS7957_LSB_UV / 1000;
+	val = ACCESS_ONCE(alg->latest)->hires_data[channel];
+	ret = val * ADS7957_LSB_UV / (1000 << LEGOEV3_ANALOG_HIRES_SHIFT);
 	return ret;
 }
 
+/*
+ * The *_ch() functions return the ADC channel of a pin for use with
+ * legoev3_analog_register_cb_for_ch().
+ */
+u8 legoev3_analog_in_pin1_ch(struct legoev3_analog_device *alg,
+			     enum legoev3_input_port_id id)
+{
+	return alg->pdata->in_pin1_ch[id];
+}
+EXPORT_SYMBOL_GPL(legoev3_analog_in_pin1_ch);
+
+u8 legoev3_analog_out_pin5_ch(struct legoev3_analog_device *alg,
+			      enum legoev3_output_port_id id)
+{
+	return alg->pdata->out_pin5_ch[id];
+}
+EXPORT_SYMBOL_GPL(legoev3_analog_out_pin5_ch);
+
 u16 legoev3_analog_in_pin1_value(struct legoev3_analog_device *alg,
 				 enum legoev3_input_port_id id)
 {
@@ -318,20 +810,185 @@ u16 legoev3_analog_batt_curr_value(struct legoev3_analog_device *alg)
 }
 EXPORT_SYMBOL_GPL(legoev3_analog_batt_curr_value);
 
+/**
+ * legoev3_analog_get_scan - get a coherent copy of the latest scan
+ * @alg: The analog device.
+ * @scan: Filled in with the latest scan.
+ *
+ * All of the channels in the copy are from the same scan, so they can be
+ * compared with each other and the timestamps of successive copies can be
+ * used to compute the sample interval.
+ */
+void legoev3_analog_get_scan(struct legoev3_analog_device *alg,
+			     struct legoev3_analog_scan *scan)
+{
+	do {
+		memcpy(scan, ACCESS_ONCE(alg->latest), sizeof(*scan));
+		smp_rmb();
+		/*
+		 * A buffer is not reused until two newer scans have been
+		 * published, so if that happened while we were copying, the
+		 * copy may be torn and we have to try again.
+		 */
+	} while (ACCESS_ONCE(alg->latest)->generation - scan->generation > 1);
+}
+EXPORT_SYMBOL_GPL(legoev3_analog_get_scan);
+
+/**
+ * legoev3_analog_set_oversample - set the oversampling factor of a channel
+ * @alg: The analog device.
+ * @channel: The ADC channel.
+ * @factor: Number of conversions to average for each sample. Must be 1 (off)
+ *	or a power of 2 from 4 to LEGOEV3_ANALOG_MAX_OVERSAMPLE.
+ *
+ * Each 4x of oversampling adds about one bit of effective resolution, so
+ * 4x, 16x and 64x give 11, 12 and 13 bits. The extra bits are returned in
+ * legoev3_analog_scan.hires_data and used by the *_value() functions.
+ */
+int legoev3_analog_set_oversample(struct legoev3_analog_device *alg,
+				  u8 channel, unsigned factor)
+{
+	if (channel >= ADS7957_NUM_CHANNELS)
+		return -EINVAL;
+	if (factor != 1 && (factor < 4 || factor > LEGOEV3_ANALOG_MAX_OVERSAMPLE
+			    || !is_power_of_2(factor)))
+		return -EINVAL;
+
+	alg->ch_oversample[channel] = factor;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(legoev3_analog_set_oversample);
+
+/**
+ * legoev3_analog_register_cb_for_ch - register a consumer for a channel
+ * @alg: The analog device.
+ * @channel: The ADC channel.
+ * @function: Called each time a new value for the channel is available or
+ *	NULL to unregister. The scan that is passed to the function is only
+ *	valid until the function returns.
+ * @context: Passed back to function.
+ * @period_ns: How often the channel should be read. It is rounded up to a
+ *	multiple of UPDATE_TICK_NS and capped at UPDATE_SLOW_NS. Ignored when
+ *	unregistering.
+ * @flags: LEGOEV3_ANALOG_CB_* flags.
+ *
+ * The function is only called after scans that read the channel. This may be
+ * called from any context. A call that is already in progress may still
+ * finish after the function has been unregistered.
+ */
 void legoev3_analog_register_cb_for_ch(struct legoev3_analog_device *alg,
 				       u8 channel,
 				       legoev3_analog_cb_func_t function,
-				       void *context)
+				       void *context, unsigned period_ns,
+				       unsigned flags)
 {
+	unsigned period = DEFAULT_PERIOD_TICKS;
+	unsigned long irq_flags;
+
 	if (channel >= ADS7957_NUM_CHANNELS) {
 		dev_crit(&alg->dev, "%s: channel id %d >= available channels (%d)\n",
 			 __func__, channel, ADS7957_NUM_CHANNELS);
 		return;
 	}
 
+	if (function)
+		period = clamp_t(unsigned, NS_TO_TICKS(period_ns), 1,
+				 DEFAULT_PERIOD_TICKS);
+
+	spin_lock_irqsave(&alg->cb_lock, irq_flags);
 	alg->callbacks[channel].function = function;
 	alg->callbacks[channel].context = context;
+	alg->callbacks[channel].flags = flags;
+	spin_unlock_irqrestore(&alg->cb_lock, irq_flags);
+	alg->ch_period[channel] = period;
+	if (alg->ch_countdown[channel] > period)
+		alg->ch_countdown[channel] = period;
 }
+EXPORT_SYMBOL_GPL(legoev3_analog_register_cb_for_ch);
+
+/**
+ * legoev3_analog_register_nxt_color - register an NXT color sensor
+ * @alg: The analog device.
+ * @id: The input port the sensor is connected to.
+ * @set_led: Selects the LED for the next conversion or NULL to unregister.
+ * @frame_ready: Called (in a tasklet) each time a new frame is available.
+ *	May be NULL if the frames are only read with
+ *	legoev3_analog_get_nxt_color_frame().
+ * @context: Passed back to set_led and frame_ready.
+ *
+ * While at least one NXT color sensor is registered, the ADC is polled every
+ * UPDATE_COLOR_NS. Each poll reads one state of one sensor and then switches
+ * the LED for the next state, so the LED has until the next poll to settle.
+ * The sensors on different ports take turns, one frame at a time.
+ *
+ * Unregistering waits for set_led and frame_ready calls that are already
+ * running, so it must be called from a context that can sleep. Once it
+ * returns 0, context is not used any more. If it returns an error, the SPI
+ * message that may still call set_led did not complete and context must not
+ * be freed.
+ */
+int legoev3_analog_register_nxt_color(struct legoev3_analog_device *alg,
+				      enum legoev3_input_port_id id,
+				      legoev3_analog_nxt_color_led_func_t set_led,
+				      legoev3_analog_nxt_color_cb_func_t frame_ready,
+				      void *context)
+{
+	struct legoev3_analog_nxt_color_info *info;
+
+	if (id >= NUM_EV3_PORT_IN)
+		return -EINVAL;
+
+	info = &alg->nxt_color[id];
+	if (!set_led) {
+		clear_bit(id, &alg->nxt_color_ports);
+		clear_bit(id, &alg->nxt_color_ready);
+		/* the completion or the tasklet may be using info right now */
+		if (!wait_event_timeout(alg->msg_wait,
+					!ACCESS_ONCE(alg->read_one_busy),
+					msecs_to_jiffies(MSG_TIMEOUT_MS)))
+		{
+			dev_err(&alg->dev, "%s: timeout waiting for spi\n",
+				__func__);
+			return -ETIMEDOUT;
+		}
+		tasklet_unlock_wait(&alg->callback_tasklet);
+		return 0;
+	}
+	if (test_bit(id, &alg->nxt_color_ports))
+		return -EBUSY;
+
+	info->set_led = set_led;
+	info->frame_ready = frame_ready;
+	info->context = context;
+	set_led(context, NXT_COLOR_READ_STATE_AMBIANT);
+	/* make sure the info is visible before the port is */
+	smp_wmb();
+	set_bit(id, &alg->nxt_color_ports);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(legoev3_analog_register_nxt_color);
+
+/**
+ * legoev3_analog_get_nxt_color_frame - get a copy of the latest color frame
+ * @alg: The analog device.
+ * @id: The input port.
+ * @frame: Filled in with the most recent complete frame.
+ */
+void legoev3_analog_get_nxt_color_frame(struct legoev3_analog_device *alg,
+					enum legoev3_input_port_id id,
+					struct legoev3_analog_nxt_color_frame *frame)
+{
+	struct legoev3_analog_nxt_color_info *info = &alg->nxt_color[id];
+
+	do {
+		memcpy(frame, ACCESS_ONCE(info->latest), sizeof(*frame));
+		smp_rmb();
+		/* there are only two buffers, so any new frame means a retry */
+	} while (ACCESS_ONCE(info->latest)->generation != frame->generation);
+}
+EXPORT_SYMBOL_GPL(legoev3_analog_get_nxt_color_frame);
 
 void legoev3_analog_register_in_cb(struct legoev3_analog_device *alg,
 				   enum legoev3_input_port_id id,
@@ -344,7 +1001,7 @@ void legoev3_analog_register_in_cb(struct legoev3_analog_device *alg,
 		return;
 	}
 	legoev3_analog_register_cb_for_ch(alg, alg->pdata->in_pin1_ch[id],
-	                                  function, context);
+					  function, context, UPDATE_FAST_NS, 0);
 }
 EXPORT_SYMBOL_GPL(legoev3_analog_register_in_cb);
 
@@ -355,20 +1012,250 @@ static ssize_t legoev3_analog_show_name(struct device *dev,
 	return sprintf(buf, "%s\n", to_legoev3_analog_device(dev)->name);
 }
 
+static ssize_t legoev3_analog_show_oversample(struct device *dev,
+					      struct device_attribute *devattr,
+					      char *buf)
+{
+	struct legoev3_analog_device *alg = to_legoev3_analog_device(dev);
+	int i, count = 0;
+
+	for (i = 0; i < ADS7957_NUM_CHANNELS; i++)
+		count += sprintf(buf + count, "%u ", alg->ch_oversample[i]);
+	buf[count - 1] = '\n';
+
+	return count;
+}
+
+/*
+ * Takes "<channel> <factor>", e.g. "3 16".
+ */
+static ssize_t legoev3_analog_store_oversample(struct device *dev,
+					       struct device_attribute *devattr,
+					       const char *buf, size_t count)
+{
+	struct legoev3_analog_device *alg = to_legoev3_analog_device(dev);
+	unsigned channel, factor;
+	int err;
+
+	if (sscanf(buf, "%u %u", &channel, &factor) != 2
+	    || channel >= ADS7957_NUM_CHANNELS)
+		return -EINVAL;
+	err = legoev3_analog_set_oversample(alg, channel, factor);
+	if (err < 0)
+		return err;
+
+	return count;
+}
+
+static ssize_t legoev3_analog_show_capture(struct device *dev,
+					   struct device_attribute *devattr,
+					   char *buf)
+{
+	struct legoev3_analog_device *alg = to_legoev3_analog_device(dev);
+
+	return sprintf(buf, "%s\n",
+		legoev3_analog_capture_state_names[ACCESS_ONCE(alg->capture.state)]);
+}
+
+/*
+ * Takes "start" or "stop". The capture is started on the next timer tick.
+ */
+static ssize_t legoev3_analog_store_capture(struct device *dev,
+					    struct device_attribute *devattr,
+					    const char *buf, size_t count)
+{
+	struct legoev3_analog_device *alg = to_legoev3_analog_device(dev);
+	struct legoev3_analog_capture *cap = &alg->capture;
+
+	if (sysfs_streq(buf, "stop")) {
+		if (legoev3_analog_capture_running(alg))
+			cap->state = CAPTURE_STATE_DONE;
+		return count;
+	}
+	if (!sysfs_streq(buf, "start"))
+		return -EINVAL;
+	if (legoev3_analog_capture_running(alg))
+		return -EBUSY;
+	if (!cap->channels || (cap->trigger_ch >= 0
+			       && !test_bit(cap->trigger_ch, &cap->channels)))
+		return -EINVAL;
+	if (!cap->buf) {
+		cap->buf = vmalloc(capture_buffer_size * sizeof(*cap->buf));
+		if (!cap->buf)
+			return -ENOMEM;
+	}
+
+	cap->head = 0;
+	cap->count = 0;
+	cap->last_value = cap->trigger_rising ? ADS7957_VALUE_MASK : 0;
+	cap->remaining = capture_buffer_size;
+	cap->scan_due = false;
+	/* make sure everything is set before the timer sees the new state */
+	smp_wmb();
+	cap->state = cap->trigger_ch < 0 ? CAPTURE_STATE_TRIGGERED
+					 : CAPTURE_STATE_ARMED;
+
+	return count;
+}
+
+static ssize_t legoev3_analog_show_capture_channels(struct device *dev,
+					struct device_attribute *devattr,
+					char *buf)
+{
+	struct legoev3_analog_device *alg = to_legoev3_analog_device(dev);
+
+	return sprintf(buf, "0x%04lx\n", alg->capture.channels);
+}
+
+static ssize_t legoev3_analog_store_capture_channels(struct device *dev,
+					struct device_attribute *devattr,
+					const char *buf, size_t count)
+{
+	struct legoev3_analog_device *alg = to_legoev3_analog_device(dev);
+	unsigned long channels;
+	int err;
+
+	err = kstrtoul(buf, 0, &channels);
+	if (err < 0)
+		return err;
+	if (channels >= BIT(ADS7957_NUM_CHANNELS))
+		return -EINVAL;
+	if (legoev3_analog_capture_running(alg))
+		return -EBUSY;
+	alg->capture.channels = channels;
+
+	return count;
+}
+
+static ssize_t legoev3_analog_show_capture_trigger(struct device *dev,
+					struct device_attribute *devattr,
+					char *buf)
+{
+	struct legoev3_analog_capture *cap = &to_legoev3_analog_device(dev)->capture;
+
+	if (cap->trigger_ch < 0)
+		return sprintf(buf, "none\n");
+
+	return sprintf(buf, "%d %s %u\n", cap->trigger_ch,
+		       cap->trigger_rising ? "rising" : "falling",
+		       cap->trigger_level);
+}
+
+/*
+ * Takes "none" or "<channel> rising|falling <raw level>", e.g. "3 rising 512".
+ */
+static ssize_t legoev3_analog_store_capture_trigger(struct device *dev,
+					struct device_attribute *devattr,
+					const char *buf, size_t count)
+{
+	struct legoev3_analog_device *alg = to_legoev3_analog_device(dev);
+	struct legoev3_analog_capture *cap = &alg->capture;
+	char edge[8];
+	unsigned channel, level;
+
+	if (legoev3_analog_capture_running(alg))
+		return -EBUSY;
+	if (sysfs_streq(buf, "none")) {
+		cap->trigger_ch = -1;
+		return count;
+	}
+	if (sscanf(buf, "%u %7s %u", &channel, edge, &level) != 3
+	    || channel >= ADS7957_NUM_CHANNELS || level > ADS7957_VALUE_MASK)
+		return -EINVAL;
+	if (!strcmp(edge, "rising"))
+		cap->trigger_rising = true;
+	else if (!strcmp(edge, "falling"))
+		cap->trigger_rising = false;
+	else
+		return -EINVAL;
+	cap->trigger_ch = channel;
+	cap->trigger_level = level;
+
+	return count;
+}
+
+static ssize_t legoev3_analog_show_capture_pretrigger(struct device *dev,
+					struct device_attribute *devattr,
+					char *buf)
+{
+	struct legoev3_analog_device *alg = to_legoev3_analog_device(dev);
+
+	return sprintf(buf, "%u\n", alg->capture.pretrigger);
+}
+
+static ssize_t legoev3_analog_store_capture_pretrigger(struct device *dev,
+					struct device_attribute *devattr,
+					const char *buf, size_t count)
+{
+	struct legoev3_analog_device *alg = to_legoev3_analog_device(dev);
+	unsigned pretrigger;
+	int err;
+
+	err = kstrtouint(buf, 0, &pretrigger);
+	if (err < 0)
+		return err;
+	if (pretrigger > capture_buffer_size)
+		return -EINVAL;
+	if (legoev3_analog_capture_running(alg))
+		return -EBUSY;
+	alg->capture.pretrigger = pretrigger;
+
+	return count;
+}
+
+/*
+ * Returns the captured samples, oldest first. Each sample is a raw 16-bit
+ * word from the ADC with the channel number in the top 4 bits.
+ */
+static ssize_t legoev3_analog_capture_data_read(struct file *file,
+						struct kobject *kobj,
+						struct bin_attribute *attr,
+						char *buf, loff_t off,
+						size_t count)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct legoev3_analog_device *alg = to_legoev3_analog_device(dev);
+	struct legoev3_analog_capture *cap = &alg->capture;
+	unsigned oldest, index, n;
+	size_t size;
+
+	if (legoev3_analog_capture_running(alg))
+		return -EBUSY;
+	size = cap->count * sizeof(*cap->buf);
+	if (off >= size || !count)
+		return 0;
+	size -= off;
+	if (count < size)
+		size = count;
+	size &= ~(sizeof(*cap->buf) - 1);
+
+	oldest = cap->count < capture_buffer_size ? 0 : cap->head;
+	index = (oldest + off / sizeof(*cap->buf)) % capture_buffer_size;
+	n = min_t(unsigned, size / sizeof(*cap->buf),
+		  capture_buffer_size - index);
+	memcpy(buf, &cap->buf[index], n * sizeof(*cap->buf));
+	memcpy(buf + n * sizeof(*cap->buf), cap->buf,
+	       size - n * sizeof(*cap->buf));
+
+	return size;
+}
+
 static ssize_t legoev3_analog_raw_data_read(struct file *file, struct kobject *kobj,
 				     struct bin_attribute *attr,
 				     char *buf, loff_t off, size_t count)
 {
 	struct device *dev = container_of(kobj, struct device, kobj);
 	struct legoev3_analog_device *alg = to_legoev3_analog_device(dev);
-	size_t size = sizeof(alg->raw_data);
+	struct legoev3_analog_scan scan;
+	size_t size = sizeof(scan.raw_data);
 
 	if (off >= size || !count)
 		return 0;
 	size -= off;
 	if (count < size)
 		size = count;
-	memcpy(buf + off, alg->raw_data, size);
+	legoev3_analog_get_scan(alg, &scan);
+	memcpy(buf + off, scan.raw_data, size);
 
 	return size;
 }
@@ -381,19 +1268,39 @@ static ssize_t legoev3_analog_raw_nxt_color_data_read(struct file *file,
 {
 	struct device *dev = container_of(kobj, struct device, kobj);
 	struct legoev3_analog_device *alg = to_legoev3_analog_device(dev);
-	size_t size = sizeof(alg->nxt_color_raw_data);
+	struct legoev3_analog_nxt_color_frame frame;
+	u16 data[NUM_EV3_PORT_IN][NUM_NXT_COLOR_READ_STATE];
+	size_t size = sizeof(data);
+	int i;
 
 	if (off >= size || !count)
 		return 0;
 	size -= off;
 	if (count < size)
 		size = count;
-	memcpy(buf + off, alg->nxt_color_raw_data, size);
+	for (i = 0; i < NUM_EV3_PORT_IN; i++) {
+		legoev3_analog_get_nxt_color_frame(alg, i, &frame);
+		memcpy(data[i], frame.raw_data, sizeof(data[i]));
+	}
+	memcpy(buf + off, data, size);
 
 	return size;
 }
 
 static DEVICE_ATTR(name, S_IRUGO, legoev3_analog_show_name, NULL);
+static DEVICE_ATTR(oversample, S_IRUGO | S_IWUSR, legoev3_analog_show_oversample,
+		   legoev3_analog_store_oversample);
+static DEVICE_ATTR(capture, S_IRUGO | S_IWUSR, legoev3_analog_show_capture,
+		   legoev3_analog_store_capture);
+static DEVICE_ATTR(capture_channels, S_IRUGO | S_IWUSR,
+		   legoev3_analog_show_capture_channels,
+		   legoev3_analog_store_capture_channels);
+static DEVICE_ATTR(capture_trigger, S_IRUGO | S_IWUSR,
+		   legoev3_analog_show_capture_trigger,
+		   legoev3_analog_store_capture_trigger);
+static DEVICE_ATTR(capture_pretrigger, S_IRUGO | S_IWUSR,
+		   legoev3_analog_show_capture_pretrigger,
+		   legoev3_analog_store_capture_pretrigger);
 
 static struct bin_attribute raw_data_attr = {
 	.attr = {
@@ -413,8 +1320,21 @@ static struct bin_attribute raw_nxt_color_data_attr = {
 	.read = legoev3_analog_raw_nxt_color_data_read,
 };
 
+static struct bin_attribute capture_data_attr = {
+	.attr = {
+		.name = "capture_data",
+		.mode = S_IRUGO,
+	},
+	.read = legoev3_analog_capture_data_read,
+};
+
 static struct attribute *legoev3_analog_attrs[] = {
 	&dev_attr_name.attr,
+	&dev_attr_oversample.attr,
+	&dev_attr_capture.attr,
+	&dev_attr_capture_channels.attr,
+	&dev_attr_capture_trigger.attr,
+	&dev_attr_capture_pretrigger.attr,
 	NULL
 };
 
@@ -467,8 +1387,14 @@ int legoev3_analog_device_register(struct device *parent,
 	if (err < 0)
 		goto sysfs_create_bin_file_raw_nxt_color_data_attr_fail;
 
+	err = sysfs_create_bin_file(&dev->kobj, &capture_data_attr);
+	if (err < 0)
+		goto sysfs_create_bin_file_capture_data_attr_fail;
+
 	return 0;
 
+sysfs_create_bin_file_capture_data_attr_fail:
+	sysfs_remove_bin_file(&dev->kobj, &raw_nxt_color_data_attr);
 sysfs_create_bin_file_raw_nxt_color_data_attr_fail:
 	sysfs_remove_bin_file(&dev->kobj, &raw_data_attr);
 sysfs_create_bin_file_raw_data_attr_fail:
@@ -482,11 +1408,22 @@ add_device_failed:
 void legoev3_analog_tasklet_func(unsigned long data)
 {
 	struct legoev3_analog_device *alg = (void *)data;
+	const struct legoev3_analog_scan *scan = ACCESS_ONCE(alg->latest);
+	unsigned long dirty = xchg(&alg->dirty, 0);
+	unsigned long ready = xchg(&alg->nxt_color_ready, 0);
+	struct legoev3_analog_callback_info cb;
+	struct legoev3_analog_nxt_color_info *info;
 	int i;
 
-	for (i = 0; i < ADS7957_NUM_CHANNELS; i++) {
-		if (alg->callbacks[i].function)
-			alg->callbacks[i].function(alg->callbacks[i].context);
+	for_each_set_bit(i, &dirty, ADS7957_NUM_CHANNELS) {
+		legoev3_analog_get_cb(alg, i, &cb);
+		if (cb.function)
+			cb.function(cb.context, scan);
+	}
+	for_each_set_bit(i, &ready, NUM_EV3_PORT_IN) {
+		info = &alg->nxt_color[i];
+		if (test_bit(i, &alg->nxt_color_ports) && info->frame_ready)
+			info->frame_ready(info->context, info->latest);
 	}
 }
 
@@ -544,32 +1481,44 @@ static int legoev3_analog_probe(struct spi_device *spi)
 
 	hrtimer_init(&alg->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	alg->timer.function = legoev3_analog_timer_callback;
+	init_waitqueue_head(&alg->msg_wait);
 
 	spi_message_init(&alg->read_one_msg);
-	alg->read_one_txf.tx_buf = &alg->read_one_tx_buf;
-	alg->read_one_txf.rx_buf = &alg->read_one_rx_buf;
-	alg->read_one_txf.len = 2;
-	spi_message_add_tail(&alg->read_one_txf, &alg->read_one_msg);
+	for (i = 0; i < READ_ONE_FRAMES; i++) {
+		alg->read_one_txf[i].tx_buf = &alg->read_one_tx_buf[i];
+		alg->read_one_txf[i].rx_buf = &alg->read_one_rx_buf[i];
+		alg->read_one_txf[i].len = 2;
+		alg->read_one_txf[i].cs_change = i < READ_ONE_FRAMES - 1;
+		spi_message_add_tail(&alg->read_one_txf[i], &alg->read_one_msg);
+	}
 
 	alg->read_one_msg.complete = legoev3_analog_read_one_msg_complete;
 	alg->read_one_msg.context = alg;
 
-	spi_message_init(&alg->read_all_msg);
 	/*
-	 * each word has to have an individual transfer so that the CS line can
-	 * be pulsed between each transfer. Last transfer does not pulse CS.
+	 * Each frame has to have an individual transfer so that the CS line
+	 * can be pulsed between frames. The message itself is built on each
+	 * tick from the channels that are due.
 	 */
-	for (i = 0; i <= ADS7957_NUM_CHANNELS; i++) {
-		alg->read_all_txf[i].tx_buf = &alg->read_all_tx_buf[i];
-		alg->read_all_txf[i].rx_buf = &alg->read_all_rx_buf[i];
-		alg->read_all_txf[i].len = 2;
-		if (i < ADS7957_NUM_CHANNELS)
-			alg->read_all_txf[i].cs_change = 1;
-		spi_message_add_tail(&alg->read_all_txf[i], &alg->read_all_msg);
+	for (i = 0; i < ADS7957_MAX_FRAMES; i++) {
+		alg->scan_txf[i].tx_buf = &alg->scan_tx_buf[i];
+		alg->scan_txf[i].rx_buf = &alg->scan_rx_buf[i];
+		alg->scan_txf[i].len = 2;
 	}
-	alg->read_all_msg.complete = legoev3_analog_read_all_msg_complete;
-	alg->read_all_msg.context = alg;
-
+	for (i = 0; i < ADS7957_NUM_CHANNELS; i++) {
+		alg->ch_period[i] = DEFAULT_PERIOD_TICKS;
+		alg->ch_oversample[i] = 1;
+	}
+	alg->ch_period[alg->pdata->batt_volt_ch] = BATTERY_PERIOD_TICKS;
+	alg->ch_period[alg->pdata->batt_curr_ch] = BATTERY_PERIOD_TICKS;
+	alg->latest = &alg->scans[0];
+	alg->capture.trigger_ch = -1;
+	for (i = 0; i < NUM_EV3_PORT_IN; i++)
+		alg->nxt_color[i].latest = &alg->nxt_color[i].frames[0];
+	/* read everything once right away */
+	alg->scan_pending = BIT(ADS7957_NUM_CHANNELS) - 1;
+
+	spin_lock_init(&alg->cb_lock);
 	tasklet_init(&alg->callback_tasklet, legoev3_analog_tasklet_func,
 		     (unsigned long)alg);
 
@@ -593,7 +1542,19 @@ static int legoev3_analog_remove(struct spi_device *spi)
 {
 	struct legoev3_analog_device *alg = spi_get_drvdata(spi);
 
+	if (legoev3_analog_capture_running(alg))
+		alg->capture.state = CAPTURE_STATE_DONE;
 	hrtimer_cancel(&alg->timer);
+	/* a capture message may still be in flight */
+	if (wait_event_timeout(alg->msg_wait, !ACCESS_ONCE(alg->msg_busy),
+			       msecs_to_jiffies(MSG_TIMEOUT_MS)))
+	{
+		vfree(alg->capture.buf);
+		alg->capture.buf = NULL;
+	} else {
+		/* leak the buffer rather than have the completion write to it */
+		dev_err(&alg->dev, "%s: timeout waiting for spi\n", __func__);
+	}
 	tasklet_kill(&alg->callback_tasklet);
 	device_unregister(&alg->dev);
 	spi_set_drvdata(alg->spi, NULL);
@@ -16,18 +16,88 @@
 #ifndef __LINUX_LEGOEV3_ANALOG_H
 #define __LINUX_LEGOEV3_ANALOG_H
 
+#include <linux/ktime.h>
 #include <linux/spi/spi.h>
 
 #include <mach/legoev3.h>
 
 #define to_legoev3_analog_device(x) container_of((x), struct legoev3_analog_device, dev)
 
-typedef void (*legoev3_analog_cb_func_t)(void *context);
+#define LEGOEV3_ANALOG_NUM_CHANNELS	16
+/* Number of fractional bits in legoev3_analog_scan.hires_data */
+#define LEGOEV3_ANALOG_HIRES_SHIFT	3
+#define LEGOEV3_ANALOG_MAX_OVERSAMPLE	64
+
+/**
+ * struct legoev3_analog_scan - the result of one ADC scan
+ * @generation: Incremented each time a scan is published.
+ * @timestamp: The time when the scan completed.
+ * @updated: Bitmap of the channels that were read by this scan. The values of
+ *	the other channels are carried over from the previous scan.
+ * @raw_data: The raw (unscaled) value for each channel. For oversampled
+ *	channels, this is the rounded average.
+ * @hires_data: The raw value for each channel with LEGOEV3_ANALOG_HIRES_SHIFT
+ *	extra bits. For oversampled channels, this is the average of all of the
+ *	conversions, otherwise the extra bits are 0.
+ */
+struct legoev3_analog_scan {
+	u32 generation;
+	ktime_t timestamp;
+	unsigned long updated;
+	u16 raw_data[LEGOEV3_ANALOG_NUM_CHANNELS];
+	u16 hires_data[LEGOEV3_ANALOG_NUM_CHANNELS];
+};
+
+typedef void (*legoev3_analog_cb_func_t)(void *context,
+					 const struct legoev3_analog_scan *scan);
+
+/*
+ * Call the function directly from the SPI completion (interrupt context)
+ * instead of from the tasklet. The function must be short and must not sleep.
+ */
+#define LEGOEV3_ANALOG_CB_DIRECT	BIT(0)
+
+/*
+ * An NXT color sensor is read once with the LED off and once with each of the
+ * red, green and blue LEDs on.
+ */
+enum nxt_color_read_state {
+	NXT_COLOR_READ_STATE_AMBIANT,
+	NXT_COLOR_READ_STATE_RED,
+	NXT_COLOR_READ_STATE_GREEN,
+	NXT_COLOR_READ_STATE_BLUE,
+	NUM_NXT_COLOR_READ_STATE,
+};
+
+/**
+ * struct legoev3_analog_nxt_color_frame - one complete NXT color sensor reading
+ * @generation: Incremented each time a frame is published for the port.
+ * @timestamp: The time when the last conversion of the frame completed.
+ * @raw_data: The raw (unscaled) value for each state.
+ */
+struct legoev3_analog_nxt_color_frame {
+	u32 generation;
+	ktime_t timestamp;
+	u16 raw_data[NUM_NXT_COLOR_READ_STATE];
+};
+
+/*
+ * Selects the LED for the next conversion. Called in interrupt context, so it
+ * must not sleep.
+ */
+typedef void (*legoev3_analog_nxt_color_led_func_t)(void *context,
+						    enum nxt_color_read_state);
+typedef void (*legoev3_analog_nxt_color_cb_func_t)(void *context,
+			const struct legoev3_analog_nxt_color_frame *frame);
 
 struct legoev3_analog_device;
 
 extern struct legoev3_analog_device *get_legoev3_analog(void);
 extern void put_legoev3_analog(struct legoev3_analog_device *);
+extern u8 legoev3_analog_in_pin1_ch(struct legoev3_analog_device *,
+				   enum legoev3_input_port_id);
+extern u8 legoev3_analog_out_pin5_ch(struct legoev3_analog_device *,
+				    enum legoev3_output_port_id);
 extern u16 legoev3_analog_in_pin1_value(struct legoev3_analog_device *,
 					enum legoev3_input_port_id);
 extern u16 legoev3_analog_in_pin6_value(struct legoev3_analog_device *,
@@ -36,10 +106,27 @@ extern u16 legoev3_analog_out_pin5_value(struct legoev3_analog_device *,
 					 enum legoev3_output_port_id);
 extern u16 legoev3_analog_batt_volt_value(struct legoev3_analog_device *);
 extern u16 legoev3_analog_batt_curr_value(struct legoev3_analog_device *);
+extern void legoev3_analog_get_scan(struct legoev3_analog_device *,
+				    struct legoev3_analog_scan *);
+extern void legoev3_analog_register_cb_for_ch(struct legoev3_analog_device *,
+					      u8 channel,
+					      legoev3_analog_cb_func_t, void *,
+					      unsigned period_ns, unsigned flags);
+extern int legoev3_analog_set_oversample(struct legoev3_analog_device *,
+					 u8 channel, unsigned factor);
 extern void legoev3_analog_register_in_cb(struct legoev3_analog_device *,
 					  enum legoev3_input_port_id,
 					  legoev3_analog_cb_func_t, void *);
 
+extern int legoev3_analog_register_nxt_color(struct legoev3_analog_device *,
+					    enum legoev3_input_port_id,
+					    legoev3_analog_nxt_color_led_func_t,
+					    legoev3_analog_nxt_color_cb_func_t,
+					    void *);
+extern void legoev3_analog_get_nxt_color_frame(struct legoev3_analog_device *,
+				enum legoev3_input_port_id,
+				struct legoev3_analog_nxt_color_frame *);
+
 extern struct spi_driver legoev3_analog_driver;
 
 #endif /* __LINUX_LEGOEV3_ANALOG_H */
@@ -16,8 +16,69 @@
 #ifndef _LEGOEV3_PORTS_H_
 #define _LEGOEV3_PORTS_H_
 
+#include <linux/ktime.h>
 #include <linux/platform_data/legoev3.h>
 
+#define LEGOEV3_PORT_MAX_STATES		8
+#define LEGOEV3_PORT_LATENCY_BUCKETS	8
+
+/**
+ * struct legoev3_port_stats - Statistics about device detection on a port
+ * @port_name: The name of the port, used in tracepoints.
+ * @state_names: Names of the connection states of the port.
+ * @num_states: Number of entries in @state_names.
+ * @state: The current connection state.
+ * @state_start: Time when the port entered @state.
+ * @state_ns: Total time spent in each connection state.
+ * @plug_start: Time when the pins first changed from the idle state or 0 if
+ *	nothing is being debounced.
+ * @false_starts: Number of times the debounce was restarted because the pins
+ *	changed again before a device was detected.
+ * @decision_mv: Raw pin voltage used to decide the type of the last device.
+ * @detect_ms: Time from the first pin change to the decision for the last
+ *	device.
+ * @latency_hist: Histogram of @detect_ms. Bucket n counts detections that
+ *	took less than 64 << n ms, the last bucket counts everything slower.
+ */
+struct legoev3_port_stats {
+	const char *port_name;
+	const char * const *state_names;
+	unsigned num_states;
+	unsigned state;
+	ktime_t state_start;
+	u64 state_ns[LEGOEV3_PORT_MAX_STATES];
+	ktime_t plug_start;
+	u32 false_starts;
+	u32 decision_mv;
+	u32 detect_ms;
+	u32 latency_hist[LEGOEV3_PORT_LATENCY_BUCKETS];
+};
+
+/*
+ * Addresses that NXT I2C sensors are autodetected at. This is shared with the
+ * input ports, which probe them to see if a sensor has finished booting.
+ */
+#define LEGOEV3_NXT_I2C_SENSOR_ADDRS	0x01, 0x02, 0x08, 0x0A, 0x11, 0x18, \
+					0x50, 0x51, 0x52, 0x58
+
+extern struct dentry *legoev3_ports_debugfs;
+extern struct workqueue_struct *legoev3_ports_wq;
+extern bool legoev3_ports_event_detect;
+extern bool legoev3_ports_fast_boot;
+
+extern void legoev3_port_stats_init(struct legoev3_port_stats *stats,
+				    const char *port_name,
+				    const char * const *state_names,
+				    unsigned num_states, unsigned state,
+				    struct dentry *debugfs);
+extern void legoev3_port_stats_set_state(struct legoev3_port_stats *stats,
+					 unsigned state);
+extern void legoev3_port_stats_pins_changed(struct legoev3_port_stats *stats,
+					    unsigned old_flags,
+					    unsigned new_flags);
+extern void legoev3_port_stats_detected(struct legoev3_port_stats *stats,
+					const char *type, unsigned mv);
+
 extern struct lego_port_device
 *ev3_input_port_register(struct ev3_input_port_platform_data *pdata,
 			 struct device *parent);
@@ -59,10 +59,31 @@
  *   device and gpios used by the port free to be controlled directly or used
  *   by other drivers.
  * .
+ * `event_detect`
+ * : Setting to `N` keeps polling ports that have nothing connected. By
+ *   default, empty ports stop polling and wait for one of the pins to change.
+ *   Default is `Y`.
+ * .
+ * `fast_boot`
+ * : Setting to `Y` registers devices that are already connected when the
+ *   ports are loaded without waiting for the usual debounce time. They are
+ *   still checked in the background and removed if they are not really
+ *   there. Default is `N`.
+ * .
+ * ### Debugging
+ * .
+ * Device detection can be followed with the `legoev3_ports` trace events. Each
+ * port also has a directory in `/sys/kernel/debug/legoev3-ports/` with the
+ * time spent in each detection state (`state_ms`), the number of times the
+ * debounce was restarted (`false_starts`), the pin voltage used for the last
+ * decision (`decision_mv`), how long the last detection took (`detect_ms`)
+ * and a histogram of detection times in milliseconds (`latency_hist`).
+ * .
  * [legoev3-input-port]: docs/ports/legoev3-input-port
  * [legoev3-output-port]: docs/ports/legoev3-output-port
  */
 
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/module.h>
 #include <linux/string.h>
@@ -72,11 +93,16 @@
 #include <linux/ioport.h>
 #include <linux/platform_device.h>
 #include <linux/platform_data/legoev3.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
 
 #include <lego_port_class.h>
 
 #include "legoev3_ports.h"
 
+#define CREATE_TRACE_POINTS
+#include "legoev3_ports_trace.h"
+
 struct legoev3_ports_data {
 	struct platform_device *pdev;
 	struct legoev3_ports_platform_data *pdata;
@@ -84,6 +110,15 @@ struct legoev3_ports_data {
 	struct lego_port_device *out_ports[NUM_EV3_PORT_OUT];
 };
 
+/* Parent directory for the per-port debugfs directories */
+struct dentry *legoev3_ports_debugfs;
+
+/*
+ * Registering a device on a port can take a long time (e.g. waiting for an
+ * I2C sensor to boot), so it is done here instead of the system workqueue.
+ */
+struct workqueue_struct *legoev3_ports_wq;
+
 static uint disable_in_port[NUM_EV3_PORT_IN];
 static int num_disabled_in_port;
 module_param_array(disable_in_port, uint, &num_disabled_in_port, 0);
@@ -92,6 +127,188 @@ static uint disable_out_port[NUM_EV3_PORT_OUT];
 static int num_disabled_out_port;
 module_param_array(disable_out_port, uint, &num_disabled_out_port, 0);
 MODULE_PARM_DESC(disable_out_port, "Disables specified output ports. (1,2,3,4)");
+bool legoev3_ports_event_detect = true;
+module_param_named(event_detect, legoev3_ports_event_detect, bool, 0444);
+MODULE_PARM_DESC(event_detect, "Stop polling empty ports and wait for pin changes instead");
+bool legoev3_ports_fast_boot;
+module_param_named(fast_boot, legoev3_ports_fast_boot, bool, 0444);
+MODULE_PARM_DESC(fast_boot, "Skip the debounce time for devices connected at load time");
+
+/*
+ * The detection state machines run in the port timers, so the statistics
+ * below are updated without locking. A reader may see a slightly stale
+ * value, which is fine for debugging.
+ */
+
+static int legoev3_port_state_ms_show(struct seq_file *s, void *unused)
+{
+	struct legoev3_port_stats *stats = s->private;
+	u64 ns;
+	int i;
+
+	for (i = 0; i < stats->num_states; i++) {
+		ns = stats->state_ns[i];
+		if (i == stats->state)
+			ns += ktime_to_ns(ktime_sub(ktime_get(),
+						    stats->state_start));
+		seq_printf(s, "%-24s %llu\n", stats->state_names[i],
+			   div_u64(ns, NSEC_PER_MSEC));
+	}
+
+	return 0;
+}
+
+static int legoev3_port_state_ms_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, legoev3_port_state_ms_show, inode->i_private);
+}
+
+static const struct file_operations legoev3_port_state_ms_fops = {
+	.open		= legoev3_port_state_ms_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int legoev3_port_latency_hist_show(struct seq_file *s, void *unused)
+{
+	struct legoev3_port_stats *stats = s->private;
+	int i;
+
+	for (i = 0; i < LEGOEV3_PORT_LATENCY_BUCKETS - 1; i++)
+		seq_printf(s, "<%-6u %u\n", 64 << i, stats->latency_hist[i]);
+	seq_printf(s, ">=%-5u %u\n", 64 << i, stats->latency_hist[i]);
+
+	return 0;
+}
+
+static int legoev3_port_latency_hist_open(struct inode *inode,
+					  struct file *file)
+{
+	return single_open(file, legoev3_port_latency_hist_show,
+			   inode->i_private);
+}
+
+static const struct file_operations legoev3_port_latency_hist_fops = {
+	.open		= legoev3_port_latency_hist_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/**
+ * legoev3_port_stats_init - Start collecting detection statistics for a port
+ * @stats: The statistics to initialize.
+ * @port_name: The name of the port.
+ * @state_names: Names of the connection states of the port.
+ * @num_states: Number of connection states (at most LEGOEV3_PORT_MAX_STATES).
+ * @state: The initial connection state.
+ * @debugfs: Directory for the statistics files or NULL.
+ */
+void legoev3_port_stats_init(struct legoev3_port_stats *stats,
+			     const char *port_name,
+			     const char * const *state_names,
+			     unsigned num_states, unsigned state,
+			     struct dentry *debugfs)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->port_name = port_name;
+	stats->state_names = state_names;
+	stats->num_states = min_t(unsigned, num_states,
+				  LEGOEV3_PORT_MAX_STATES);
+	stats->state = state;
+	stats->state_start = ktime_get();
+
+	if (IS_ERR_OR_NULL(debugfs))
+		return;
+
+	debugfs_create_file("state_ms", S_IRUGO, debugfs, stats,
+			    &legoev3_port_state_ms_fops);
+	debugfs_create_file("latency_hist", S_IRUGO, debugfs, stats,
+			    &legoev3_port_latency_hist_fops);
+	debugfs_create_u32("false_starts", S_IRUGO, debugfs,
+			   &stats->false_starts);
+	debugfs_create_u32("decision_mv", S_IRUGO, debugfs,
+			   &stats->decision_mv);
+	debugfs_create_u32("detect_ms", S_IRUGO, debugfs, &stats->detect_ms);
+}
+
+/**
+ * legoev3_port_stats_set_state - Account for a connection state change
+ * @stats: The statistics for the port.
+ * @state: The new connection state.
+ */
+void legoev3_port_stats_set_state(struct legoev3_port_stats *stats,
+				  unsigned state)
+{
+	ktime_t now;
+	s64 elapsed;
+
+	if (state == stats->state || state >= stats->num_states)
+		return;
+
+	now = ktime_get();
+	elapsed = ktime_to_ns(ktime_sub(now, stats->state_start));
+	stats->state_ns[stats->state] += elapsed;
+	trace_legoev3_port_state(stats->port_name,
+				 stats->state_names[stats->state],
+				 stats->state_names[state],
+				 div_s64(elapsed, NSEC_PER_USEC));
+	stats->state = state;
+	stats->state_start = now;
+}
+
+/**
+ * legoev3_port_stats_pins_changed - Account for a change of the pin flags
+ * @stats: The statistics for the port.
+ * @old_flags: The pin flags that were being debounced.
+ * @new_flags: The pin flags that were just read.
+ *
+ * Must be called while waiting for a device, before the debounce counter is
+ * restarted.
+ */
+void legoev3_port_stats_pins_changed(struct legoev3_port_stats *stats,
+				     unsigned old_flags, unsigned new_flags)
+{
+	if (new_flags == old_flags)
+		return;
+
+	if (ktime_to_ns(stats->plug_start)) {
+		stats->false_starts++;
+		trace_legoev3_port_false_start(stats->port_name, old_flags,
+					       new_flags);
+		if (!new_flags)
+			stats->plug_start = ktime_set(0, 0);
+	} else if (new_flags) {
+		stats->plug_start = ktime_get();
+	}
+}
+
+/**
+ * legoev3_port_stats_detected - Account for the decision about a device
+ * @stats: The statistics for the port.
+ * @type: The name of the type of device that was found.
+ * @mv: The raw pin voltage used to make the decision.
+ */
+void legoev3_port_stats_detected(struct legoev3_port_stats *stats,
+				 const char *type, unsigned mv)
+{
+	unsigned ms = 0;
+	int i;
+
+	if (ktime_to_ns(stats->plug_start))
+		ms = ktime_to_ms(ktime_sub(ktime_get(), stats->plug_start));
+	stats->plug_start = ktime_set(0, 0);
+
+	for (i = 0; i < LEGOEV3_PORT_LATENCY_BUCKETS - 1; i++) {
+		if (ms < 64 << i)
+			break;
+	}
+	stats->latency_hist[i]++;
+	stats->decision_mv = mv;
+	stats->detect_ms = ms;
+	trace_legoev3_port_detect(stats->port_name, type, mv, ms);
+}
 
 int legoev3_register_input_ports(struct legoev3_ports_data *ports,
 				 struct ev3_input_port_platform_data data[],
@@ -191,6 +408,22 @@ static int legoev3_ports_probe(struct platform_device *pdev)
 	ports->pdata = pdev->dev.platform_data;
 	dev_set_drvdata(&pdev->dev, ports);
 
+	legoev3_ports_wq = alloc_workqueue("legoev3-ports", 0, 0);
+	if (!legoev3_ports_wq) {
+		err = -ENOMEM;
+		goto err_alloc_workqueue;
+	}
+
+	legoev3_ports_debugfs = debugfs_create_dir("legoev3-ports", NULL);
+	if (IS_ERR(legoev3_ports_debugfs))
+		legoev3_ports_debugfs = NULL;
+
+	/*
+	 * Registering a port only takes a moment and each port starts its own
+	 * detection as soon as it is registered, so all of the ports are
+	 * already detecting devices at the same time. Registering them in
+	 * order keeps the portN names the same on every boot.
+	 */
 	err = legoev3_register_input_ports(ports,
 					   ports->pdata->input_port_data,
 					   NUM_EV3_PORT_IN);
@@ -202,7 +435,6 @@ static int legoev3_ports_probe(struct platform_device *pdev)
 	err = legoev3_register_output_ports(ports,
 					    ports->pdata->output_port_data,
 					    NUM_EV3_PORT_OUT);
-
 	if (err) {
 		dev_err(&pdev->dev, "Could not register output ports!\n");
 		goto err_legoev3_register_output_ports;
@@ -214,6 +446,9 @@ err_legoev3_register_output_ports:
 	for(i = 0; i < NUM_EV3_PORT_IN; i++)
 		ev3_input_port_unregister(ports->in_ports[i]);
 err_legoev3_register_input_ports:
+	debugfs_remove_recursive(legoev3_ports_debugfs);
+	destroy_workqueue(legoev3_ports_wq);
+err_alloc_workqueue:
 	dev_set_drvdata(&pdev->dev, NULL);
 	kfree(ports);
 
@@ -229,6 +464,8 @@ static int legoev3_ports_remove(struct platform_device *pdev)
 		ev3_input_port_unregister(ports->in_ports[i]);
 	for(i = 0; i < NUM_EV3_PORT_OUT; i++)
 		ev3_output_port_unregister(ports->out_ports[i]);
+	debugfs_remove_recursive(legoev3_ports_debugfs);
+	destroy_workqueue(legoev3_ports_wq);
 	dev_set_drvdata(&pdev->dev, NULL);
 	kfree(ports);
 
@@ -13,12 +13,16 @@
  * GNU General Public License for more details.
  */
 
+#include <linux/debugfs.h>
 #include <linux/err.h>
 #include <linux/delay.h>
+#include <linux/i2c.h>
 #include <linux/module.h>
 #include <linux/workqueue.h>
 #include <linux/gpio.h>
 #include <linux/i2c-legoev3.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
 #include <linux/platform_device.h>
 #include <linux/platform_data/legoev3.h>
 
@@ -35,6 +39,15 @@
 #define ADD_CNT			35		/* 350 msec */
 #define REMOVE_CNT		10		/* 100 msec */
 
+/*
+ * NXT I2C sensors need some time to boot after they are plugged in. We poll
+ * them until they ACK, backing off from I2C_READY_POLL_MIN_MS to
+ * I2C_READY_POLL_MAX_MS between tries.
+ */
+#define I2C_READY_POLL_MIN_MS	10
+#define I2C_READY_POLL_MAX_MS	200
+#define I2C_READY_TIMEOUT_MS	2000
+
 #define PIN1_NEAR_5V		4900		/* 4.90V */
 #define PIN1_NEAR_PIN2		3100		/* 3.1V */
 #define PIN1_TOUCH_HIGH		950 		/* 0.95V */
@@ -208,6 +221,14 @@ enum gpio_index {
 	NUM_GPIO
 };
 
+/* The digital pins that can wake up an idle port */
+enum wake_irq_index {
+	WAKE_IRQ_PIN2,
+	WAKE_IRQ_PIN5,
+	WAKE_IRQ_PIN6,
+	NUM_WAKE_IRQ
+};
+
 enum pin5_mux_mode {
 	PIN5_MUX_MODE_I2C,
 	PIN5_MUX_MODE_UART,
@@ -233,6 +254,17 @@ enum connection_state {
 	NUM_CON_STATE
 };
 
+static const char * const ev3_input_port_con_state_names[] = {
+	[CON_STATE_INIT]		= "init",
+	[CON_STATE_INIT_SETTLE]		= "init-settle",
+	[CON_STATE_NO_DEV]		= "no-dev",
+	[CON_STATE_TEST_NXT_TOUCH]	= "test-nxt-touch",
+	[CON_STATE_HAVE_NXT]		= "have-nxt",
+	[CON_STATE_HAVE_EV3]		= "have-ev3",
+	[CON_STATE_HAVE_I2C]		= "have-i2c",
+	[CON_STATE_HAVE_PIN5_ERR]	= "have-pin5-err",
+};
+
 enum pin_state_flag {
 	PIN_STATE_FLAG_PIN2_LOW,
 	PIN_STATE_FLAG_PIN1_LOADED,
@@ -431,6 +463,13 @@ static struct device_type ev3_input_port_type = {
  *	connected and disconnected.
  * @timer: Polling timer to monitor the port.
  * @timer_loop_cnt: Used to measure time in the polling loop.
+ * @wake_irq: Interrupts for the digital pins that wake up an idle port or 0
+ *	if the port can't be idle.
+ * @idle: Set while nothing is connected and the timer is stopped. The port
+ *	is woken up by an edge on pin 2, 5 or 6 or by the analog scan when the
+ *	pin 1 voltage drops.
+ * @fast_boot: The next device found is registered after SETTLE_CNT instead
+ *	of ADD_CNT since it was already connected when the port was loaded.
  * @con_state: The current state of the port.
  * @pin_state_flags: Used in the polling loop to track certain changes in the
  *	state of the port's pins.
@@ -438,6 +477,12 @@ static struct device_type ev3_input_port_type = {
  * @sensor_type: The type of sensor currently connected.
  * @sensor_type_id: The sensor type id for EV3 sensors or -1 for NXT sensors.
  * @sensor: The sensor connected to the port
+ * @i2c_ready_ms: Time it took the last NXT I2C sensor to respond.
+ * @i2c_ready_max_ms: Longest time it took an NXT I2C sensor to respond.
+ * @i2c_ready_tries: Number of probes needed for the last NXT I2C sensor.
+ * @i2c_ready_timeouts: Number of times an NXT I2C sensor did not respond.
+ * @stats: Device detection statistics.
+ * @debugfs: The debugfs directory for this port.
  */
 struct ev3_input_port_data {
 	enum legoev3_input_port_id id;
@@ -451,12 +496,21 @@ struct ev3_input_port_data {
 	struct work_struct work;
 	struct hrtimer timer;
 	unsigned timer_loop_cnt;
+	int wake_irq[NUM_WAKE_IRQ];
+	unsigned long idle;
+	unsigned fast_boot:1;
 	enum connection_state con_state;
 	unsigned pin_state_flags:NUM_PIN_STATE_FLAG;
 	unsigned pin1_mv;
 	enum sensor_type sensor_type;
 	enum sensor_type_id sensor_type_id;
 	struct lego_device *sensor;
+	u32 i2c_ready_ms;
+	u32 i2c_ready_max_ms;
+	u32 i2c_ready_tries;
+	u32 i2c_ready_timeouts;
+	struct legoev3_port_stats stats;
+	struct dentry *debugfs;
 };
 
 static int ev3_input_port_get_pin1_mv(struct ev3_input_port_data *data)
@@ -503,7 +557,8 @@ static struct lego_port_nxt_analog_ops ev3_input_port_nxt_analog_ops = {
 	.set_pin5_gpio	= ev3_input_port_set_pin5_gpio,
 };
 
-static void ev3_input_port_nxt_analog_cb(void *context)
+static void ev3_input_port_nxt_analog_cb(void *context,
+					 const struct legoev3_analog_scan *scan)
 {
 	struct ev3_input_port_data *data = context;
 
@@ -513,7 +568,8 @@ static void ev3_input_port_nxt_analog_cb(void *context)
 		data->port.notify_raw_data_func(data->port.notify_raw_data_context);
 }
 
-static void ev3_input_port_ev3_analog_cb(void *context)
+static void ev3_input_port_ev3_analog_cb(void *context,
+					 const struct legoev3_analog_scan *scan)
 {
 	struct ev3_input_port_data *data = context;
 
@@ -590,6 +646,91 @@ void ev3_input_port_float(struct ev3_input_port_data *data)
 	gpio_direction_output(data->gpio[GPIO_BUF_ENA].gpio, 1); /* active low */
 }
 
+static const unsigned short ev3_input_port_i2c_addrs[] = {
+	LEGOEV3_NXT_I2C_SENSOR_ADDRS
+};
+
+static int ev3_input_port_match_i2c_adapter(struct device *dev, void *data)
+{
+	return i2c_verify_adapter(dev) != NULL;
+}
+
+static int ev3_input_port_match_i2c_client(struct device *dev, void *data)
+{
+	return i2c_verify_client(dev) != NULL;
+}
+
+static bool ev3_input_port_i2c_ack(struct i2c_adapter *adap)
+{
+	union i2c_smbus_data dummy;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ev3_input_port_i2c_addrs); i++) {
+		if (i2c_smbus_xfer(adap, ev3_input_port_i2c_addrs[i], 0,
+				   I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &dummy) >= 0)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * The i2c core tries to detect the sensor as soon as the adapter is
+ * registered. If the sensor was still booting, nothing was found, so we wait
+ * for the sensor to respond and then register the adapter again.
+ */
+static void ev3_input_port_wait_for_i2c(struct ev3_input_port_data *data)
+{
+	unsigned long start = jiffies;
+	unsigned delay = I2C_READY_POLL_MIN_MS;
+	struct i2c_adapter *adap;
+	struct device *dev, *client;
+	bool ready;
+	int err;
+
+	dev = device_find_child(&data->i2c_pdev->dev, NULL,
+				ev3_input_port_match_i2c_adapter);
+	if (!dev)
+		return;
+	adap = i2c_verify_adapter(dev);
+
+	client = device_find_child(&adap->dev, NULL,
+				   ev3_input_port_match_i2c_client);
+	if (client) {
+		put_device(client);
+		put_device(dev);
+		data->i2c_ready_ms = 0;
+		data->i2c_ready_tries = 0;
+		return;
+	}
+
+	data->i2c_ready_tries = 0;
+	while (!(ready = ev3_input_port_i2c_ack(adap))) {
+		data->i2c_ready_tries++;
+		if (time_after(jiffies, start
+				+ msecs_to_jiffies(I2C_READY_TIMEOUT_MS)))
+			break;
+		msleep(delay);
+		delay = min(delay * 2, I2C_READY_POLL_MAX_MS);
+	}
+	put_device(dev);
+
+	if (!ready) {
+		data->i2c_ready_timeouts++;
+		return;
+	}
+	data->i2c_ready_ms = jiffies_to_msecs(jiffies - start);
+	if (data->i2c_ready_ms > data->i2c_ready_max_ms)
+		data->i2c_ready_max_ms = data->i2c_ready_ms;
+
+	/* registering the adapter again probes the sensor again */
+	ev3_input_port_unregister_i2c(data);
+	err = ev3_input_port_register_i2c(data);
+	if (err < 0)
+		dev_err(&data->port.dev,
+			"Could not register i2c adapter again. (%d)\n", err);
+}
+
 void ev3_input_port_register_sensor(struct work_struct *work)
 {
 	struct ev3_input_port_data *data =
@@ -616,9 +757,8 @@ void ev3_input_port_register_sensor(struct work_struct *work)
 			ev3_input_port_ev3_analog_cb, data);
 		break;
 	case SENSOR_NXT_I2C:
-		/* Give the sensor time to boot */
-		msleep(1000);
-		ev3_input_port_register_i2c(data);
+		if (!ev3_input_port_register_i2c(data))
+			ev3_input_port_wait_for_i2c(data);
 		/*
 		 * I2C sensors are handled by the i2c stack, so we are just
 		 * registering a fake device here so that it doesn't break
@@ -667,6 +807,92 @@ void ev3_input_port_unregister_sensor(struct work_struct *work)
 	ev3_input_port_disable_uart(data);
 }
 
+/*
+ * Stops waiting for pin changes. Returns true if the port was idle. Safe to
+ * call from any context.
+ */
+static bool ev3_input_port_cancel_idle(struct ev3_input_port_data *data)
+{
+	int i;
+
+	if (!test_and_clear_bit(0, &data->idle))
+		return false;
+
+	for (i = 0; i < NUM_WAKE_IRQ; i++)
+		disable_irq_nosync(data->wake_irq[i]);
+	legoev3_analog_register_cb_for_ch(data->analog,
+		legoev3_analog_in_pin1_ch(data->analog, data->id), NULL, NULL,
+		0, 0);
+
+	return true;
+}
+
+static void ev3_input_port_wake(struct ev3_input_port_data *data)
+{
+	if (!ev3_input_port_cancel_idle(data))
+		return;
+
+	/* the pins have to be stable for ADD_CNT like when polling */
+	data->timer_loop_cnt = 0;
+	hrtimer_start(&data->timer, ktime_set(0, INPUT_PORT_POLL_NS),
+		      HRTIMER_MODE_REL);
+}
+
+static irqreturn_t ev3_input_port_wake_irq(int irq, void *dev_id)
+{
+	ev3_input_port_wake(dev_id);
+
+	return IRQ_HANDLED;
+}
+
+static void ev3_input_port_pin1_wake_cb(void *context,
+					const struct legoev3_analog_scan *scan)
+{
+	struct ev3_input_port_data *data = context;
+
+	if (ev3_input_port_get_pin1_mv(data) < PIN1_NEAR_5V)
+		ev3_input_port_wake(data);
+}
+
+static bool ev3_input_port_pins_idle(struct ev3_input_port_data *data)
+{
+	return gpio_get_value(data->gpio[GPIO_PIN2].gpio)
+		&& gpio_get_value(data->gpio[GPIO_PIN5].gpio)
+		&& !gpio_get_value(data->gpio[GPIO_PIN6].gpio)
+		&& ev3_input_port_get_pin1_mv(data) >= PIN1_NEAR_5V;
+}
+
+/*
+ * Stops polling an empty port and waits for one of the pins to change
+ * instead. Returns false if something changed while we were setting this up,
+ * in which case polling has to continue.
+ */
+static bool ev3_input_port_enter_idle(struct ev3_input_port_data *data)
+{
+	int i;
+
+	legoev3_analog_register_cb_for_ch(data->analog,
+		legoev3_analog_in_pin1_ch(data->analog, data->id),
+		ev3_input_port_pin1_wake_cb, data, INPUT_PORT_POLL_NS,
+		LEGOEV3_ANALOG_CB_DIRECT);
+	for (i = 0; i < NUM_WAKE_IRQ; i++)
+		enable_irq(data->wake_irq[i]);
+	set_bit(0, &data->idle);
+
+	/* an edge before the interrupts were enabled would have been missed */
+	if (ev3_input_port_pins_idle(data))
+		return true;
+
+	return !ev3_input_port_cancel_idle(data);
+}
+
+static void ev3_input_port_set_state(struct ev3_input_port_data *data,
+				     enum connection_state state)
+{
+	legoev3_port_stats_set_state(&data->stats, state);
+	data->con_state = state;
+}
+
 static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 {
 	struct ev3_input_port_data *data =
@@ -687,13 +913,13 @@ static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 			data->timer_loop_cnt = 0;
 			data->sensor_type = SENSOR_NONE;
 			data->sensor_type_id = SENSOR_TYPE_ID_UNKNOWN;
-			data->con_state = CON_STATE_INIT_SETTLE;
+			ev3_input_port_set_state(data, CON_STATE_INIT_SETTLE);
 		}
 		break;
 	case CON_STATE_INIT_SETTLE:
 		if (data->timer_loop_cnt >= SETTLE_CNT) {
 			data->timer_loop_cnt = 0;
-			data->con_state = CON_STATE_NO_DEV;
+			ev3_input_port_set_state(data, CON_STATE_NO_DEV);
 		}
 		break;
 	case CON_STATE_NO_DEV:
@@ -706,13 +932,18 @@ static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 			new_pin_state_flags |= BIT(PIN_STATE_FLAG_PIN5_LOW);
 		if (gpio_get_value(data->gpio[GPIO_PIN6].gpio))
 			new_pin_state_flags |= BIT(PIN_STATE_FLAG_PIN6_HIGH);
+		legoev3_port_stats_pins_changed(&data->stats,
+						data->pin_state_flags,
+						new_pin_state_flags);
 		if (new_pin_state_flags != data->pin_state_flags)
 			data->timer_loop_cnt = 0;
-		else if (new_pin_state_flags && data->timer_loop_cnt >= ADD_CNT
-			 && !work_busy(&data->work))
+		else if (new_pin_state_flags && !work_busy(&data->work)
+			 && data->timer_loop_cnt >= (data->fast_boot ? SETTLE_CNT
+								     : ADD_CNT))
 		{
+			data->fast_boot = 0;
 			if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN2_LOW)) {
-				data->con_state = CON_STATE_HAVE_NXT;
+				ev3_input_port_set_state(data, CON_STATE_HAVE_NXT);
 				if ((~new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN5_LOW))
 				    && (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN6_HIGH))) {
 					if (new_pin1_mv < PIN1_NEAR_GND) {
@@ -736,7 +967,8 @@ static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 					data->sensor_type_id = SENSOR_TYPE_ID_NXT_TOUCH;
 				} else if (new_pin1_mv > PIN1_TOUCH_LOW
 					 && new_pin1_mv < PIN1_TOUCH_HIGH) {
-					data->con_state = CON_STATE_TEST_NXT_TOUCH;
+					ev3_input_port_set_state(data,
+						CON_STATE_TEST_NXT_TOUCH);
 					data->timer_loop_cnt = 0;
 					data->pin1_mv = new_pin1_mv;
 				} else {
@@ -744,7 +976,7 @@ static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 					data->sensor_type_id = SENSOR_TYPE_ID_NXT_ANALOG;
 				}
 			} else if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN1_LOADED)) {
-				data->con_state = CON_STATE_HAVE_EV3;
+				ev3_input_port_set_state(data, CON_STATE_HAVE_EV3);
 				if (new_pin1_mv > PIN1_NEAR_PIN2) {
 					data->sensor_type = SENSOR_ERR;
 				} else if (new_pin1_mv < PIN1_NEAR_GND) {
@@ -757,25 +989,37 @@ static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 						data->sensor_type = SENSOR_ERR;
 				}
 			} else if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN6_HIGH)) {
-				data->con_state = CON_STATE_HAVE_I2C;
+				ev3_input_port_set_state(data, CON_STATE_HAVE_I2C);
 				data->sensor_type = SENSOR_NXT_I2C;
 				data->sensor_type_id = SENSOR_TYPE_ID_NXT_I2C;
 			} else {
-				data->con_state = CON_STATE_HAVE_PIN5_ERR;
+				ev3_input_port_set_state(data, CON_STATE_HAVE_PIN5_ERR);
 				data->sensor_type = SENSOR_ERR;
 				data->sensor_type_id = SENSOR_TYPE_ID_UNKNOWN;
 			}
 			data->timer_loop_cnt = 0;
+			if (data->con_state != CON_STATE_TEST_NXT_TOUCH)
+				legoev3_port_stats_detected(&data->stats,
+					ev3_input_port_state_names[data->sensor_type],
+					new_pin1_mv);
 			if (data->sensor_type != SENSOR_ERR) {
 				INIT_WORK(&data->work, ev3_input_port_register_sensor);
-				schedule_work(&data->work);
+				queue_work(legoev3_ports_wq, &data->work);
+			}
+		} else if (!new_pin_state_flags
+			   && data->timer_loop_cnt >= SETTLE_CNT) {
+			/* nothing was connected at boot */
+			data->fast_boot = 0;
+			if (data->wake_irq[0] && ev3_input_port_enter_idle(data)) {
+				data->pin_state_flags = new_pin_state_flags;
+				return HRTIMER_NORESTART;
 			}
 		}
 		data->pin_state_flags = new_pin_state_flags;
 		break;
 	case CON_STATE_TEST_NXT_TOUCH:
 		if (data->timer_loop_cnt >= SETTLE_CNT) {
-			data->con_state = CON_STATE_HAVE_NXT;
+			ev3_input_port_set_state(data, CON_STATE_HAVE_NXT);
 			data->sensor_type = SENSOR_NXT_ANALOG;
 			new_pin1_mv = legoev3_analog_in_pin1_value(data->analog, data->id);
 			if (new_pin1_mv > (data->pin1_mv - PIN1_TOUCH_VAR) &&
@@ -783,6 +1027,9 @@ static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 				data->sensor_type_id = SENSOR_TYPE_ID_NXT_TOUCH;
 			else
 				data->sensor_type_id = SENSOR_TYPE_ID_NXT_ANALOG;
+			legoev3_port_stats_detected(&data->stats,
+				ev3_input_port_state_names[data->sensor_type],
+				new_pin1_mv);
 		}
 		break;
 	case CON_STATE_HAVE_NXT:
@@ -803,7 +1050,7 @@ static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 			data->timer_loop_cnt = 0;
 		break;
 	default:
-		data->con_state = CON_STATE_INIT;
+		ev3_input_port_set_state(data, CON_STATE_INIT);
 		break;
 	}
 	if (data->sensor_type
@@ -811,9 +1058,9 @@ static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 	{
 		if (data->sensor) {
 			INIT_WORK(&data->work, ev3_input_port_unregister_sensor);
-			schedule_work(&data->work);
+			queue_work(legoev3_ports_wq, &data->work);
 		}
-		data->con_state = CON_STATE_INIT;
+		ev3_input_port_set_state(data, CON_STATE_INIT);
 	}
 
 	return HRTIMER_RESTART;
@@ -891,6 +1138,7 @@ static int ev3_input_port_set_mode(void *context, u8 mode)
 	 */
 
 	cancel_work_sync(&data->work);
+	ev3_input_port_cancel_idle(data);
 
 	if (data->port.mode == EV3_INPUT_PORT_MODE_OTHER_UART)
 		ev3_input_port_disable_uart(data);
@@ -901,7 +1149,7 @@ static int ev3_input_port_set_mode(void *context, u8 mode)
 
 	switch (mode) {
 	case EV3_INPUT_PORT_MODE_AUTO:
-		data->con_state = CON_STATE_INIT;
+		ev3_input_port_set_state(data, CON_STATE_INIT);
 		hrtimer_start(&data->timer, ktime_set(0, INPUT_PORT_POLL_NS),
 							HRTIMER_MODE_REL);
 		break;
@@ -960,6 +1208,52 @@ static const char *ev3_input_port_get_status(void *context)
 }
 
 
+/*
+ * The wake interrupts stay disabled except while the port is idle. If they
+ * can't be requested, the port is polled all of the time.
+ */
+static void ev3_input_port_request_wake_irqs(struct ev3_input_port_data *data)
+{
+	static const enum gpio_index pins[NUM_WAKE_IRQ] = {
+		[WAKE_IRQ_PIN2]	= GPIO_PIN2,
+		[WAKE_IRQ_PIN5]	= GPIO_PIN5,
+		[WAKE_IRQ_PIN6]	= GPIO_PIN6,
+	};
+	int i, irq, err;
+
+	for (i = 0; i < NUM_WAKE_IRQ; i++) {
+		irq = gpio_to_irq(data->gpio[pins[i]].gpio);
+		if (irq < 0)
+			goto err_request_irq;
+		irq_set_status_flags(irq, IRQ_NOAUTOEN);
+		err = request_irq(irq, ev3_input_port_wake_irq,
+				  IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+				  data->port.port_name, data);
+		if (err < 0)
+			goto err_request_irq;
+		data->wake_irq[i] = irq;
+	}
+
+	return;
+
+err_request_irq:
+	dev_warn(&data->port.dev, "Could not get wake interrupts, polling instead.\n");
+	for (i--; i >= 0; i--) {
+		free_irq(data->wake_irq[i], data);
+		data->wake_irq[i] = 0;
+	}
+}
+
+static void ev3_input_port_free_wake_irqs(struct ev3_input_port_data *data)
+{
+	int i;
+
+	for (i = 0; i < NUM_WAKE_IRQ; i++) {
+		if (data->wake_irq[i])
+			free_irq(data->wake_irq[i], data);
+	}
+}
+
 struct lego_port_device
 *ev3_input_port_register(struct ev3_input_port_platform_data *pdata,
 			 struct device *parent)
@@ -1037,10 +1331,31 @@ struct lego_port_device
 	}
 
 	INIT_WORK(&data->work, NULL);
+
+	data->debugfs = debugfs_create_dir(data->port.port_name,
+					   legoev3_ports_debugfs);
+	if (!IS_ERR_OR_NULL(data->debugfs)) {
+		debugfs_create_u32("i2c_ready_ms", S_IRUGO, data->debugfs,
+				   &data->i2c_ready_ms);
+		debugfs_create_u32("i2c_ready_max_ms", S_IRUGO, data->debugfs,
+				   &data->i2c_ready_max_ms);
+		debugfs_create_u32("i2c_ready_tries", S_IRUGO, data->debugfs,
+				   &data->i2c_ready_tries);
+		debugfs_create_u32("i2c_ready_timeouts", S_IRUGO, data->debugfs,
+				   &data->i2c_ready_timeouts);
+	}
+	legoev3_port_stats_init(&data->stats, data->port.port_name,
+				ev3_input_port_con_state_names, NUM_CON_STATE,
+				CON_STATE_INIT, data->debugfs);
+
 	hrtimer_init(&data->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	data->timer.function = ev3_input_port_timer_callback;
 
-	data->con_state = CON_STATE_INIT;
+	if (legoev3_ports_event_detect)
+		ev3_input_port_request_wake_irqs(data);
+
+	ev3_input_port_set_state(data, CON_STATE_INIT);
+	data->fast_boot = legoev3_ports_fast_boot;
 	hrtimer_start(&data->timer, ktime_set(0, INPUT_PORT_POLL_NS),
 		      HRTIMER_MODE_REL);
 
@@ -1065,8 +1380,10 @@ void ev3_input_port_unregister(struct lego_port_device *port)
 		return;
 
 	data =container_of(port, struct ev3_input_port_data, port);
-
+	debugfs_remove_recursive(data->debugfs);
+	ev3_input_port_cancel_idle(data);
 	hrtimer_cancel(&data->timer);
+	ev3_input_port_free_wake_irqs(data);
 	cancel_work_sync(&data->work);
 	if (port->mode == EV3_INPUT_PORT_MODE_OTHER_UART)
 		ev3_input_port_disable_uart(data);
@@ -14,13 +14,18 @@
  * GNU General Public License for more details.
  */
 
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/err.h>
 #include <linux/gpio.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/pwm.h>
 #include <linux/pm_runtime.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/workqueue.h>
 #include <linux/platform_data/legoev3.h>
 
@@ -38,6 +43,8 @@
 #define ADD_CNT			(350000000/OUTPUT_PORT_POLL_NS)	/* 350 msec */
 #define REMOVE_CNT		(100000000/OUTPUT_PORT_POLL_NS)	/* 100 msec */
 
+#define PWM_PERIOD_NS		(NSEC_PER_SEC / 10000)		/* 10 kHz */
+
 #define ADC_REF              5000 /* [mV] Maximum voltage that the A/D can read */
 
 #define PIN5_IIC_HIGH        3700 /* [mV] values in between these limits means that */
@@ -87,6 +94,13 @@ enum gpio_index {
 	NUM_GPIO
 };
 
+enum gpio_state {
+	GPIO_STATE_UNKNOWN,
+	GPIO_STATE_INPUT,
+	GPIO_STATE_LOW,
+	GPIO_STATE_HIGH,
+};
+
 enum connection_state {
 	CON_STATE_INIT,				/* Wait for motor to unregister, then */
 						/* Set port to "float" state */
@@ -103,6 +117,17 @@ enum connection_state {
 	NUM_CON_STATE
 };
 
+static const char * const ev3_output_port_con_state_names[] = {
+	[CON_STATE_INIT]			= "init",
+	[CON_STATE_INIT_SETTLE]			= "init-settle",
+	[CON_STATE_NO_DEV]			= "no-dev",
+	[CON_STATE_PIN6_SETTLE]			= "pin6-settle",
+	[CON_STATE_CONNECTED]			= "connected",
+	[CON_STATE_PIN5_SETTLE]			= "pin5-settle",
+	[CON_STATE_DEVICE_CONNECTED]		= "device-connected",
+	[CON_STATE_WAITING_FOR_DISCONNECT]	= "waiting-for-disconnect",
+};
+
 enum pin_state_flag {
 	PIN_STATE_FLAG_PIN2_LOW,
 	PIN_STATE_FLAG_PIN5_LOADED,
@@ -238,6 +263,13 @@ struct device_type ev3_motor_device_types[] = {
  *	connected and disconnected.
  * @timer: Polling timer to monitor the port connect/disconnect.
  * @timer_loop_cnt: Used to measure time in the polling loop.
+ * @wake_irq: Interrupt for pin 6 that wakes up an idle port or 0 if the port
+ *	can't be idle.
+ * @idle: Set while nothing is connected and the timer is stopped. The port
+ *	is woken up by an edge on pin 6 or by the analog scan when pin 5 is
+ *	loaded.
+ * @fast_boot: The next device found is registered after SETTLE_CNT instead
+ *	of ADD_CNT since it was already connected when the port was loaded.
  * @con_state: The current state of the port.
  * @pin_state_flags: Used in the polling loop to track certain changes in the
  *	state of the port's pins.
@@ -247,6 +279,22 @@ struct device_type ev3_motor_device_types[] = {
  * @motor: Pointer to the motor device that is connected to the output port.
  * @command: The current command for the motor driver of the output port.
  * @direction: The current direction for the motor driver of the output port.
+ * @blinking: The pwm is being used to blink the output instead of using the
+ *	normal pwm period.
+ * @fast_stop: The output has been stopped by a fast stop and ignores commands
+ *	from the motor driver until released.
+ * @lock: Protects fast_stop, the shadow copies below and writing the outputs,
+ *	which can happen from the timer, process context and the fast stop
+ *	interrupt.
+ * @gpio_state: Shadow copy of the last state written to each gpio.
+ * @pwm_duty_ns: Shadow copy of the last duty cycle written to the pwm.
+ * @pwm_period_ns: Shadow copy of the last period written to the pwm.
+ * @gpio_writes: Number of times a gpio was actually changed.
+ * @gpio_writes_elided: Number of gpio writes skipped because nothing changed.
+ * @pwm_writes: Number of times the pwm was actually changed.
+ * @pwm_writes_elided: Number of pwm writes skipped because nothing changed.
+ * @stats: Device detection statistics.
+ * @debugfs: The debugfs directory for this port.
  */
 struct ev3_output_port_data {
 	enum legoev3_output_port_id id;
@@ -257,6 +305,9 @@ struct ev3_output_port_data {
 	struct work_struct work;
 	struct hrtimer timer;
 	unsigned timer_loop_cnt;
+	int wake_irq;
+	unsigned long idle;
+	unsigned fast_boot:1;
 	enum connection_state con_state;
 	unsigned pin_state_flags:NUM_PIN_STATE_FLAG;
 	unsigned pin5_float_mv;
@@ -265,27 +316,112 @@ struct ev3_output_port_data {
 	struct lego_device *motor;
 	enum dc_motor_command command;
 	enum dc_motor_direction direction;
+	unsigned blinking:1;
+	bool fast_stop;
+	spinlock_t lock;
+	enum gpio_state gpio_state[NUM_GPIO];
+	unsigned pwm_duty_ns;
+	unsigned pwm_period_ns;
+	u32 gpio_writes;
+	u32 gpio_writes_elided;
+	u32 pwm_writes;
+	u32 pwm_writes_elided;
+	struct legoev3_port_stats stats;
+	struct dentry *debugfs;
 };
 
+/*
+ * The motor drivers update the output on every control loop tick, usually
+ * with the same values as last time, so we keep a shadow copy of the gpio
+ * and pwm state and only touch the hardware when something actually changes.
+ * The shadow copy is only valid if it is updated together with the hardware,
+ * so the __ functions must be called with data->lock held.
+ */
+
+static void __ev3_output_port_set_gpio(struct ev3_output_port_data *data,
+				       enum gpio_index index,
+				       enum gpio_state state)
+{
+	if (data->gpio_state[index] == state) {
+		data->gpio_writes_elided++;
+		return;
+	}
+
+	if (state == GPIO_STATE_INPUT)
+		gpio_direction_input(data->gpio[index].gpio);
+	else
+		gpio_direction_output(data->gpio[index].gpio,
+				      state == GPIO_STATE_HIGH);
+	data->gpio_state[index] = state;
+	data->gpio_writes++;
+}
+
+static void ev3_output_port_set_gpio(struct ev3_output_port_data *data,
+				     enum gpio_index index,
+				     enum gpio_state state)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&data->lock, flags);
+	__ev3_output_port_set_gpio(data, index, state);
+	spin_unlock_irqrestore(&data->lock, flags);
+}
+
+static void ev3_output_port_invalidate_gpios(struct ev3_output_port_data *data)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&data->lock, flags);
+	for (i = 0; i < NUM_GPIO; i++)
+		data->gpio_state[i] = GPIO_STATE_UNKNOWN;
+	spin_unlock_irqrestore(&data->lock, flags);
+}
+
+static int __ev3_output_port_pwm_config(struct ev3_output_port_data *data,
+					unsigned duty_ns, unsigned period_ns)
+{
+	int err;
+
+	if (data->pwm_duty_ns == duty_ns && data->pwm_period_ns == period_ns) {
+		data->pwm_writes_elided++;
+		return 0;
+	}
+
+	err = pwm_config(data->pwm, duty_ns, period_ns);
+	if (err < 0)
+		return err;
+	data->pwm_duty_ns = duty_ns;
+	data->pwm_period_ns = period_ns;
+	data->pwm_writes++;
+
+	return 0;
+}
+
+/* Must be called with data->lock held */
 int ev3_output_port_set_direction_gpios(struct ev3_output_port_data *data)
 {
 	switch(data->command) {
 	case DC_MOTOR_COMMAND_RUN:
 		if (data->direction == DC_MOTOR_DIRECTION_FORWARD) {
-			gpio_direction_output(data->gpio[GPIO_PIN1].gpio, 1);
-			gpio_direction_input(data->gpio[GPIO_PIN2].gpio);
+			__ev3_output_port_set_gpio(data, GPIO_PIN1,
+						   GPIO_STATE_HIGH);
+			__ev3_output_port_set_gpio(data, GPIO_PIN2,
+						   GPIO_STATE_INPUT);
 		} else {
-			gpio_direction_input(data->gpio[GPIO_PIN1].gpio);
-			gpio_direction_output(data->gpio[GPIO_PIN2].gpio, 1);
+			__ev3_output_port_set_gpio(data, GPIO_PIN1,
+						   GPIO_STATE_INPUT);
+			__ev3_output_port_set_gpio(data, GPIO_PIN2,
+						   GPIO_STATE_HIGH);
 		}
 		break;
 	case DC_MOTOR_COMMAND_BRAKE:
-		gpio_direction_output(data->gpio[GPIO_PIN1].gpio, 1);
-		gpio_direction_output(data->gpio[GPIO_PIN2].gpio, 1);
+		__ev3_output_port_set_gpio(data, GPIO_PIN1, GPIO_STATE_HIGH);
+		__ev3_output_port_set_gpio(data, GPIO_PIN2, GPIO_STATE_HIGH);
 		break;
 	case DC_MOTOR_COMMAND_COAST:
-		gpio_direction_output(data->gpio[GPIO_PIN1].gpio, 0);
-		gpio_direction_output(data->gpio[GPIO_PIN2].gpio, 0);
+		__ev3_output_port_set_gpio(data, GPIO_PIN1, GPIO_STATE_LOW);
+		__ev3_output_port_set_gpio(data, GPIO_PIN2, GPIO_STATE_LOW);
 		break;
 	default:
 		return -EINVAL;
@@ -310,12 +446,17 @@ static int ev3_output_port_set_command(void *context,
 				       enum dc_motor_command command)
 {
 	struct ev3_output_port_data *data = context;
+	unsigned long flags;
+	int err = 0;
 
-	if (data->command == command)
-		return 0;
-	data->command = command;
+	spin_lock_irqsave(&data->lock, flags);
+	if (!data->fast_stop && data->command != command) {
+		data->command = command;
+		err = ev3_output_port_set_direction_gpios(data);
+	}
+	spin_unlock_irqrestore(&data->lock, flags);
 
-	return ev3_output_port_set_direction_gpios(data);
+	return err;
 }
 
 static enum dc_motor_direction ev3_output_port_get_direction(void *context)
@@ -329,32 +470,110 @@ static int ev3_output_port_set_direction(void *context,
 					enum dc_motor_direction direction)
 {
 	struct ev3_output_port_data *data = context;
+	unsigned long flags;
+	int err = 0;
+
+	spin_lock_irqsave(&data->lock, flags);
+	if (data->direction != direction) {
+		data->direction = direction;
+		/* a fast stop holds the gpios until it is released */
+		if (!data->fast_stop)
+			err = ev3_output_port_set_direction_gpios(data);
+	}
+	spin_unlock_irqrestore(&data->lock, flags);
 
-	if (data->direction == direction)
-		return 0;
-	data->direction = direction;
-
-	return ev3_output_port_set_direction_gpios(data);
+	return err;
 }
 
 static unsigned ev3_output_port_get_duty_cycle(void *context)
 {
 	struct ev3_output_port_data *data = context;
-	unsigned period = pwm_get_period(data->pwm);
+	unsigned period = data->pwm_period_ns;
 
 	if (unlikely(period == 0))
 		return 0;
-	return pwm_get_duty_cycle(data->pwm) * 100 / period;
+	/* the blink period is long enough to overflow 32-bit math */
+	return div_u64((u64)data->pwm_duty_ns * 100, period);
 }
 
 static int ev3_output_port_set_duty_cycle(void *context, unsigned duty)
 {
 	struct ev3_output_port_data *data = context;
-	unsigned period = pwm_get_period(data->pwm);
+	unsigned long flags;
+	unsigned period;
+	int err = 0;
 
 	if (duty > 100)
 		return -EINVAL;
-	return pwm_config(data->pwm, period * duty / 100, period);
+
+	spin_lock_irqsave(&data->lock, flags);
+	if (!data->fast_stop) {
+		period = data->pwm_period_ns;
+		if (data->blinking) {
+			period = PWM_PERIOD_NS;
+			data->blinking = 0;
+		}
+		err = __ev3_output_port_pwm_config(data, period * duty / 100,
+						 period);
+	}
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	return err;
+}
+
+/*
+ * The pwm is normally running at 10kHz, but it can also run slow enough to
+ * be seen, which gives us a blinking LED that does not need any timers.
+ */
+static int ev3_output_port_set_blink(void *context, unsigned long on_ms,
+				     unsigned long off_ms)
+{
+	struct ev3_output_port_data *data = context;
+	u64 period_ns = (u64)(on_ms + off_ms) * NSEC_PER_MSEC;
+	unsigned long flags;
+	int err;
+
+	if (!on_ms || !off_ms || period_ns > INT_MAX)
+		return -EINVAL;
+
+	spin_lock_irqsave(&data->lock, flags);
+	if (data->fast_stop) {
+		err = -EBUSY;
+	} else {
+		err = __ev3_output_port_pwm_config(data, on_ms * NSEC_PER_MSEC,
+						 period_ns);
+		if (!err)
+			data->blinking = 1;
+	}
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	return err;
+}
+
+/*
+ * Only touches the gpios and the pwm, both of which are safe to use in an
+ * atomic context, so this can be called from an interrupt handler.
+ */
+static int ev3_output_port_set_fast_stop(void *context,
+					 enum dc_motor_command command)
+{
+	struct ev3_output_port_data *data = context;
+	unsigned long flags;
+	int err = 0;
+
+	spin_lock_irqsave(&data->lock, flags);
+	if (command == DC_MOTOR_COMMAND_RUN) {
+		data->fast_stop = false;
+	} else {
+		data->fast_stop = true;
+		data->blinking = 0;
+		__ev3_output_port_pwm_config(data, 0, PWM_PERIOD_NS);
+		data->command = command;
+		err = ev3_output_port_set_direction_gpios(data);
+	}
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	return err;
 }
 
 static struct dc_motor_ops ev3_output_port_motor_ops = {
@@ -365,16 +584,22 @@ static struct dc_motor_ops ev3_output_port_motor_ops = {
 	.set_direction		= ev3_output_port_set_direction,
 	.set_duty_cycle		= ev3_output_port_set_duty_cycle,
 	.get_duty_cycle		= ev3_output_port_get_duty_cycle,
+	.set_blink		= ev3_output_port_set_blink,
+	.set_fast_stop		= ev3_output_port_set_fast_stop,
 };
 
 void ev3_output_port_float(struct ev3_output_port_data *data)
 {
-	gpio_direction_output(data->gpio[GPIO_PIN1].gpio, 0);
-	gpio_direction_output(data->gpio[GPIO_PIN2].gpio, 0);
-	gpio_direction_input(data->gpio[GPIO_PIN5].gpio);
-	gpio_direction_input(data->gpio[GPIO_PIN5_INT].gpio);
-	gpio_direction_input(data->gpio[GPIO_PIN6_DIR].gpio);
+	unsigned long flags;
+
+	spin_lock_irqsave(&data->lock, flags);
+	__ev3_output_port_set_gpio(data, GPIO_PIN1, GPIO_STATE_LOW);
+	__ev3_output_port_set_gpio(data, GPIO_PIN2, GPIO_STATE_LOW);
+	__ev3_output_port_set_gpio(data, GPIO_PIN5, GPIO_STATE_INPUT);
+	__ev3_output_port_set_gpio(data, GPIO_PIN5_INT, GPIO_STATE_INPUT);
+	__ev3_output_port_set_gpio(data, GPIO_PIN6_DIR, GPIO_STATE_INPUT);
 	data->command = DC_MOTOR_COMMAND_COAST;
+	spin_unlock_irqrestore(&data->lock, flags);
 }
 
 void ev3_output_port_register_motor(struct work_struct *work)
@@ -426,6 +651,86 @@ void ev3_output_port_unregister_motor(struct work_struct *work)
 	data->motor = NULL;
 }
 
+/*
+ * Stops waiting for pin changes. Returns true if the port was idle. Safe to
+ * call from any context.
+ */
+static bool ev3_output_port_cancel_idle(struct ev3_output_port_data *data)
+{
+	if (!test_and_clear_bit(0, &data->idle))
+		return false;
+
+	disable_irq_nosync(data->wake_irq);
+	legoev3_analog_register_cb_for_ch(data->analog,
+		legoev3_analog_out_pin5_ch(data->analog, data->id), NULL, NULL,
+		0, 0);
+
+	return true;
+}
+
+static void ev3_output_port_wake(struct ev3_output_port_data *data)
+{
+	if (!ev3_output_port_cancel_idle(data))
+		return;
+
+	/* the pins have to be stable for ADD_CNT like when polling */
+	data->timer_loop_cnt = 0;
+	hrtimer_start(&data->timer, ktime_set(0, OUTPUT_PORT_POLL_NS),
+		      HRTIMER_MODE_REL);
+}
+
+static irqreturn_t ev3_output_port_wake_irq(int irq, void *dev_id)
+{
+	ev3_output_port_wake(dev_id);
+
+	return IRQ_HANDLED;
+}
+
+static bool ev3_output_port_pin5_loaded(struct ev3_output_port_data *data)
+{
+	unsigned pin5_mv = legoev3_analog_out_pin5_value(data->analog, data->id);
+
+	return pin5_mv < PIN5_BALANCE_LOW || pin5_mv > PIN5_BALANCE_HIGH;
+}
+
+static void ev3_output_port_pin5_wake_cb(void *context,
+					 const struct legoev3_analog_scan *scan)
+{
+	struct ev3_output_port_data *data = context;
+
+	if (ev3_output_port_pin5_loaded(data))
+		ev3_output_port_wake(data);
+}
+
+/*
+ * Stops polling an empty port and waits for one of the pins to change
+ * instead. Returns false if something changed while we were setting this up,
+ * in which case polling has to continue.
+ */
+static bool ev3_output_port_enter_idle(struct ev3_output_port_data *data)
+{
+	legoev3_analog_register_cb_for_ch(data->analog,
+		legoev3_analog_out_pin5_ch(data->analog, data->id),
+		ev3_output_port_pin5_wake_cb, data, OUTPUT_PORT_POLL_NS,
+		LEGOEV3_ANALOG_CB_DIRECT);
+	enable_irq(data->wake_irq);
+	set_bit(0, &data->idle);
+
+	/* an edge before the interrupt was enabled would have been missed */
+	if (!gpio_get_value(data->gpio[GPIO_PIN6_DIR].gpio)
+	    && !ev3_output_port_pin5_loaded(data))
+		return true;
+
+	return !ev3_output_port_cancel_idle(data);
+}
+
+static void ev3_output_port_set_state(struct ev3_output_port_data *data,
+				      enum connection_state state)
+{
+	legoev3_port_stats_set_state(&data->stats, state);
+	data->con_state = state;
+}
+
 static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer)
 {
 	struct ev3_output_port_data *data =
@@ -445,13 +750,13 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 			ev3_output_port_float(data);
 			data->timer_loop_cnt = 0;
 			data->tacho_motor_type = MOTOR_NONE;
-			data->con_state = CON_STATE_INIT_SETTLE;
+			ev3_output_port_set_state(data, CON_STATE_INIT_SETTLE);
 		}
 		break;
 	case CON_STATE_INIT_SETTLE:
 		if (data->timer_loop_cnt >= SETTLE_CNT) {
 			data->timer_loop_cnt = 0;
-			data->con_state = CON_STATE_NO_DEV;
+			ev3_output_port_set_state(data, CON_STATE_NO_DEV);
 		}
 		break;
 	case CON_STATE_NO_DEV:
@@ -462,16 +767,27 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 		if ((new_pin5_mv < PIN5_BALANCE_LOW) || (new_pin5_mv > PIN5_BALANCE_HIGH))
 			new_pin_state_flags |= BIT(PIN_STATE_FLAG_PIN5_LOADED);
 
+		legoev3_port_stats_pins_changed(&data->stats,
+						data->pin_state_flags,
+						new_pin_state_flags);
 		if (new_pin_state_flags != data->pin_state_flags) {
 			data->pin_state_flags = new_pin_state_flags;
 			data->timer_loop_cnt = 0;
 		}
 
-		if (data->pin_state_flags && (data->timer_loop_cnt >= ADD_CNT)) {
+		if (data->pin_state_flags && data->timer_loop_cnt
+				>= (data->fast_boot ? SETTLE_CNT : ADD_CNT)) {
+			data->fast_boot = 0;
 			data->pin5_float_mv = new_pin5_mv;
 			data->timer_loop_cnt = 0;
-			gpio_direction_output(data->gpio[GPIO_PIN6_DIR].gpio, 0);
-			data->con_state = CON_STATE_PIN6_SETTLE;
+			ev3_output_port_set_gpio(data, GPIO_PIN6_DIR, GPIO_STATE_LOW);
+			ev3_output_port_set_state(data, CON_STATE_PIN6_SETTLE);
+		} else if (!data->pin_state_flags
+			   && data->timer_loop_cnt >= SETTLE_CNT) {
+			/* nothing was connected at boot */
+			data->fast_boot = 0;
+			if (data->wake_irq && ev3_output_port_enter_idle(data))
+				return HRTIMER_NORESTART;
 		}
 		break;
 
@@ -481,8 +797,8 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 		if (data->timer_loop_cnt >= SETTLE_CNT) {
 			data->pin5_low_mv = new_pin5_mv;
 			data->timer_loop_cnt = 0;
-			gpio_direction_input(data->gpio[GPIO_PIN6_DIR].gpio);
-			data->con_state = CON_STATE_CONNECTED;
+			ev3_output_port_set_gpio(data, GPIO_PIN6_DIR, GPIO_STATE_INPUT);
+			ev3_output_port_set_state(data, CON_STATE_CONNECTED);
 			}
 		break;
 
@@ -502,26 +818,26 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 			{
 				/* NXT TOUCH SENSOR, NXT SOUND SENSOR or NEW UART SENSOR */
 				data->tacho_motor_type = MOTOR_ERR;
-				data->con_state = CON_STATE_WAITING_FOR_DISCONNECT;
+				ev3_output_port_set_state(data, CON_STATE_WAITING_FOR_DISCONNECT);
 
 			} else if (data->pin5_float_mv < PIN5_NEAR_GND) {
 				/* NEW DUMB SENSOR */
 				data->tacho_motor_type = MOTOR_ERR;
-				data->con_state = CON_STATE_WAITING_FOR_DISCONNECT;
+				ev3_output_port_set_state(data, CON_STATE_WAITING_FOR_DISCONNECT);
 
 			} else if ((data->pin5_float_mv >= PIN5_LIGHT_LOW)
 				&& (data->pin5_float_mv <= PIN5_LIGHT_HIGH))
 			{
 				/* NXT LIGHT SENSOR */
 				data->tacho_motor_type = MOTOR_ERR;
-				data->con_state = CON_STATE_WAITING_FOR_DISCONNECT;
+				ev3_output_port_set_state(data, CON_STATE_WAITING_FOR_DISCONNECT);
 
 			} else if ((data->pin5_float_mv >= PIN5_IIC_LOW)
 				&& (data->pin5_float_mv <= PIN5_IIC_HIGH))
 			{
 				/* NXT IIC SENSOR */
 				data->tacho_motor_type = MOTOR_ERR;
-				data->con_state = CON_STATE_WAITING_FOR_DISCONNECT;
+				ev3_output_port_set_state(data, CON_STATE_WAITING_FOR_DISCONNECT);
 
 			} else if (data->pin5_float_mv < PIN5_BALANCE_LOW) {
 
@@ -536,12 +852,12 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 
 				}
 
-				data->con_state = CON_STATE_DEVICE_CONNECTED;
+				ev3_output_port_set_state(data, CON_STATE_DEVICE_CONNECTED);
 
 			} else {
-				gpio_direction_output(data->gpio[GPIO_PIN5].gpio, 1);
+				ev3_output_port_set_gpio(data, GPIO_PIN5, GPIO_STATE_HIGH);
 				data->timer_loop_cnt = 0;
-				data->con_state = CON_STATE_PIN5_SETTLE;
+				ev3_output_port_set_state(data, CON_STATE_PIN5_SETTLE);
 			}
 
 		/* Value5Float is NOT equal to Value5Low */
@@ -550,11 +866,15 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 		{
 			/* NEW ACTUATOR */
 			data->tacho_motor_type = MOTOR_ERR;
-			data->con_state = CON_STATE_WAITING_FOR_DISCONNECT;
+			ev3_output_port_set_state(data, CON_STATE_WAITING_FOR_DISCONNECT);
 		} else {
 			data->tacho_motor_type = MOTOR_ERR;
-			data->con_state = CON_STATE_WAITING_FOR_DISCONNECT;
+			ev3_output_port_set_state(data, CON_STATE_WAITING_FOR_DISCONNECT);
 		}
+		if (data->con_state != CON_STATE_PIN5_SETTLE)
+			legoev3_port_stats_detected(&data->stats,
+				ev3_output_port_state_names[data->tacho_motor_type],
+				data->pin5_float_mv);
 		break;
 
 	case CON_STATE_PIN5_SETTLE:
@@ -562,7 +882,7 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 		if (data->timer_loop_cnt >= SETTLE_CNT) {
 			data->pin5_low_mv = legoev3_analog_out_pin5_value(data->analog, data->id);
 			data->timer_loop_cnt = 0;
-			gpio_direction_output(data->gpio[GPIO_PIN5].gpio, 0);
+			ev3_output_port_set_gpio(data, GPIO_PIN5, GPIO_STATE_LOW);
 
 			if (data->pin5_low_mv < PIN5_MINITACHO_LOW1)
 				data->tacho_motor_type = MOTOR_ERR;
@@ -571,7 +891,10 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 			else
 				data->tacho_motor_type = MOTOR_TACHO;
 
-			data->con_state = CON_STATE_DEVICE_CONNECTED;
+			legoev3_port_stats_detected(&data->stats,
+				ev3_output_port_state_names[data->tacho_motor_type],
+				data->pin5_low_mv);
+			ev3_output_port_set_state(data, CON_STATE_DEVICE_CONNECTED);
 		}
 		break;
 
@@ -579,8 +902,8 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 		data->timer_loop_cnt = 0;
 		if (data->tacho_motor_type != MOTOR_ERR && !work_busy(&data->work)) {
 			INIT_WORK(&data->work, ev3_output_port_register_motor);
-			schedule_work(&data->work);
-			data->con_state = CON_STATE_WAITING_FOR_DISCONNECT;
+			queue_work(legoev3_ports_wq, &data->work);
+			ev3_output_port_set_state(data, CON_STATE_WAITING_FOR_DISCONNECT);
 		}
 		break;
 
@@ -592,13 +915,13 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 
 		if ((data->timer_loop_cnt >= REMOVE_CNT) && !work_busy(&data->work) && data) {
 			INIT_WORK(&data->work, ev3_output_port_unregister_motor);
-			schedule_work(&data->work);
-			data->con_state = CON_STATE_INIT;
+			queue_work(legoev3_ports_wq, &data->work);
+			ev3_output_port_set_state(data, CON_STATE_INIT);
 		}
 		break;
 
 	default:
-		data->con_state = CON_STATE_INIT;
+		ev3_output_port_set_state(data, CON_STATE_INIT);
 		break;
 	}
 
@@ -644,6 +967,8 @@ void ev3_output_port_disable_raw_mode(struct ev3_output_port_data * data)
 	sysfs_remove_groups(&data->out_port.dev.kobj, ev3_output_port_raw_groups);
 	for (i = 0; i < NUM_GPIO; i++)
 		gpio_unexport(data->gpio[i].gpio);
+	/* userspace could have changed the gpios while they were exported */
+	ev3_output_port_invalidate_gpios(data);
 	ev3_output_port_float(data);
 }
 
@@ -652,6 +977,7 @@ static int ev3_output_port_set_mode(void *context, u8 mode)
 	struct ev3_output_port_data *data = context;
 
 	cancel_work_sync(&data->work);
+	ev3_output_port_cancel_idle(data);
 
 	if (data->motor)
 		ev3_output_port_unregister_motor(&data->work);
@@ -659,7 +985,7 @@ static int ev3_output_port_set_mode(void *context, u8 mode)
 		ev3_output_port_disable_raw_mode(data);
 	switch (mode) {
 	case EV3_OUTPUT_PORT_MODE_AUTO:
-		data->con_state = CON_STATE_INIT;
+		ev3_output_port_set_state(data, CON_STATE_INIT);
 		hrtimer_start(&data->timer, ktime_set(0, OUTPUT_PORT_POLL_NS),
 			      HRTIMER_MODE_REL);
 		break;
@@ -696,6 +1022,31 @@ static struct device_type ev3_output_port_type = {
 	.name	= "legoev3-output-port",
 };
 
+/*
+ * The wake interrupt stays disabled except while the port is idle. If it can't
+ * be requested, the port is polled all of the time.
+ */
+static void ev3_output_port_request_wake_irq(struct ev3_output_port_data *data)
+{
+	int irq, err;
+
+	irq = gpio_to_irq(data->gpio[GPIO_PIN6_DIR].gpio);
+	if (irq < 0)
+		goto err_request_irq;
+	irq_set_status_flags(irq, IRQ_NOAUTOEN);
+	err = request_irq(irq, ev3_output_port_wake_irq,
+			  IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+			  data->out_port.port_name, data);
+	if (err < 0)
+		goto err_request_irq;
+	data->wake_irq = irq;
+
+	return;
+
+err_request_irq:
+	dev_warn(&data->out_port.dev, "Could not get wake interrupt, polling instead.\n");
+}
+
 struct lego_port_device
 *ev3_output_port_register(struct ev3_output_port_platform_data *pdata,
 			  struct device *parent)
@@ -712,6 +1063,7 @@ struct lego_port_device
 		return ERR_PTR(-ENOMEM);
 
 	data->id = pdata->id;
+	spin_lock_init(&data->lock);
 	data->analog = get_legoev3_analog();
 	if (IS_ERR(data->analog)) {
 		dev_err(parent, "Could not get legoev3-analog device.\n");
@@ -754,7 +1106,7 @@ struct lego_port_device
 		goto err_pwm_get;
 	}
 
-	err = pwm_config(pwm, 0, NSEC_PER_SEC / 10000);
+	err = pwm_config(pwm, 0, PWM_PERIOD_NS);
 	if (err) {
 		dev_err(parent,
 			"Failed to set pwm duty percent and frequency! (%d)\n",
@@ -770,6 +1122,8 @@ struct lego_port_device
 	/* This lets us set the pwm duty cycle in an atomic context */
 	pm_runtime_irq_safe(pwm->chip->dev);
 	data->pwm = pwm;
+	data->pwm_duty_ns = 0;
+	data->pwm_period_ns = PWM_PERIOD_NS;
 
 	data->out_port.num_modes = NUM_EV3_OUTPUT_PORT_MODE;
 	data->out_port.mode_info = legoev3_output_port_mode_info;
@@ -786,10 +1140,29 @@ struct lego_port_device
 
 	INIT_WORK(&data->work, NULL);
 
-	data->con_state = CON_STATE_INIT;
+	data->debugfs = debugfs_create_dir(data->out_port.port_name,
+					   legoev3_ports_debugfs);
+	if (!IS_ERR_OR_NULL(data->debugfs)) {
+		debugfs_create_u32("gpio_writes", S_IRUGO, data->debugfs,
+				   &data->gpio_writes);
+		debugfs_create_u32("gpio_writes_elided", S_IRUGO, data->debugfs,
+				   &data->gpio_writes_elided);
+		debugfs_create_u32("pwm_writes", S_IRUGO, data->debugfs,
+				   &data->pwm_writes);
+		debugfs_create_u32("pwm_writes_elided", S_IRUGO, data->debugfs,
+				   &data->pwm_writes_elided);
+	}
+	legoev3_port_stats_init(&data->stats, data->out_port.port_name,
+				ev3_output_port_con_state_names, NUM_CON_STATE,
+				CON_STATE_INIT, data->debugfs);
+
+	ev3_output_port_set_state(data, CON_STATE_INIT);
+	data->fast_boot = legoev3_ports_fast_boot;
 
 	hrtimer_init(&data->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	data->timer.function = ev3_output_port_timer_callback;
+	if (legoev3_ports_event_detect)
+		ev3_output_port_request_wake_irq(data);
 	hrtimer_start(&data->timer, ktime_set(0, OUTPUT_PORT_POLL_NS),
 		      HRTIMER_MODE_REL);
 
@@ -819,15 +1192,20 @@ void ev3_output_port_unregister(struct lego_port_device *port)
 		return;
 
 	data = container_of(port, struct ev3_output_port_data, out_port);
-	pwm_disable(data->pwm);
-	pwm_put(data->pwm);
+	debugfs_remove_recursive(data->debugfs);
+	ev3_output_port_cancel_idle(data);
 	hrtimer_cancel(&data->timer);
+	if (data->wake_irq)
+		free_irq(data->wake_irq, data);
 	cancel_work_sync(&data->work);
 	if (data->motor)
 		ev3_output_port_unregister_motor(&data->work);
 	if (port->mode == EV3_OUTPUT_PORT_MODE_RAW)
 		ev3_output_port_disable_raw_mode(data);
 	lego_port_unregister(&data->out_port);
+	/* fast stop cannot reach the pwm after lego_port_unregister() */
+	pwm_disable(data->pwm);
+	pwm_put(data->pwm);
 	ev3_output_port_float(data);
 	gpio_free_array(data->gpio, ARRAY_SIZE(data->gpio));
 	put_legoev3_analog(data->analog);
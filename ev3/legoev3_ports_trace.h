@@ -0,0 +1,102 @@
+/*
+ * Tracepoints for the input and output ports on the LEGO MINDSTORMS EV3
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM legoev3_ports
+
+#if !defined(_LEGOEV3_PORTS_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _LEGOEV3_PORTS_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(legoev3_port_state,
+
+	TP_PROTO(const char *port, const char *from, const char *to,
+		 unsigned elapsed_us),
+
+	TP_ARGS(port, from, to, elapsed_us),
+
+	TP_STRUCT__entry(
+		__string(port, port)
+		__string(from, from)
+		__string(to, to)
+		__field(unsigned, elapsed_us)
+	),
+
+	TP_fast_assign(
+		__assign_str(port, port);
+		__assign_str(from, from);
+		__assign_str(to, to);
+		__entry->elapsed_us = elapsed_us;
+	),
+
+	TP_printk("%s: %s -> %s after %uus", __get_str(port), __get_str(from),
+		  __get_str(to), __entry->elapsed_us)
+);
+
+TRACE_EVENT(legoev3_port_false_start,
+
+	TP_PROTO(const char *port, unsigned old_flags, unsigned new_flags),
+
+	TP_ARGS(port, old_flags, new_flags),
+
+	TP_STRUCT__entry(
+		__string(port, port)
+		__field(unsigned, old_flags)
+		__field(unsigned, new_flags)
+	),
+
+	TP_fast_assign(
+		__assign_str(port, port);
+		__entry->old_flags = old_flags;
+		__entry->new_flags = new_flags;
+	),
+
+	TP_printk("%s: pin flags 0x%x -> 0x%x", __get_str(port),
+		  __entry->old_flags, __entry->new_flags)
+);
+
+TRACE_EVENT(legoev3_port_detect,
+
+	TP_PROTO(const char *port, const char *type, unsigned mv,
+		 unsigned latency_ms),
+
+	TP_ARGS(port, type, mv, latency_ms),
+
+	TP_STRUCT__entry(
+		__string(port, port)
+		__string(type, type)
+		__field(unsigned, mv)
+		__field(unsigned, latency_ms)
+	),
+
+	TP_fast_assign(
+		__assign_str(port, port);
+		__assign_str(type, type);
+		__entry->mv = mv;
+		__entry->latency_ms = latency_ms;
+	),
+
+	TP_printk("%s: %s at %umV after %ums", __get_str(port),
+		  __get_str(type), __entry->mv, __entry->latency_ms)
+);
+
+#endif /* _LEGOEV3_PORTS_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE legoev3_ports_trace
+#include <trace/define_trace.h>
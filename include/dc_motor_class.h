@@ -57,6 +57,16 @@ enum dc_motor_direction {
  * 	negative error;
  * @get_duty_cycle: Returns the current duty cycle in percent (0 to 100).
  * @set_duty_cycle: Sets the duty cycle. Returns 0 on success or negative error.
+ * @set_blink: Optional. Uses the PWM hardware to switch the output fully on
+ * 	for on_ms and off for off_ms, repeating without any software
+ * 	involvement. Setting the duty cycle cancels blinking. Returns 0 on
+ * 	success or negative error if the hardware cannot generate the
+ * 	requested timing.
+ * @set_fast_stop: Optional. Immediately stops the motor by coasting or braking
+ * 	and latches it in that state so that any later set_command,
+ * 	set_duty_cycle and set_blink calls are ignored. Passing
+ * 	DC_MOTOR_COMMAND_RUN releases the latch. Must be safe to call from
+ * 	interrupt context. Returns 0 on success or negative error.
  */
 struct dc_motor_ops {
 	unsigned (*get_supported_commands)(void* context);
@@ -66,6 +76,9 @@ struct dc_motor_ops {
 	int (*set_direction)(void *context, enum dc_motor_direction direction);
 	unsigned (*get_duty_cycle)(void *context);
 	int (*set_duty_cycle)(void *context, unsigned duty_cycle);
+	int (*set_blink)(void *context, unsigned long on_ms,
+			 unsigned long off_ms);
+	int (*set_fast_stop)(void *context, enum dc_motor_command command);
 };
 
 /**
@@ -17,6 +17,7 @@
 #define _LEGO_PORT_CLASS_H_
 
 #include <linux/device.h>
+#include <linux/list.h>
 #include <linux/types.h>
 
 #define LEGO_PORT_NAME_SIZE	30
@@ -71,6 +72,7 @@ struct lego_port_nxt_i2c_ops {
  * @notify_raw_data_func: Registered by sensor drivers to be notified of new
  * 	raw data.
  * @notify_raw_data_context: Send to notify_raw_data_func as parameter.
+ * @fast_stop_entry: Entry in the list of ports used by lego_port_fast_stop().
  */
 struct lego_port_device {
 	char port_name[LEGO_PORT_NAME_SIZE + 1];
@@ -91,6 +93,7 @@ struct lego_port_device {
 	unsigned raw_data_size;
 	lego_port_notify_raw_data_func_t notify_raw_data_func;
 	void *notify_raw_data_context;
+	struct list_head fast_stop_entry;
 };
 
 #define to_lego_port_device(_dev) container_of(_dev, struct lego_port_device, dev)
@@ -99,6 +102,8 @@ extern int lego_port_register(struct lego_port_device *lego_port,
 			      const struct device_type *type,
 			      struct device *parent);
 extern void lego_port_unregister(struct lego_port_device *lego_port);
+extern void lego_port_fast_stop(bool brake);
+extern void lego_port_fast_stop_release(void);
 
 static inline void
 lego_port_set_raw_data_ptr_and_func(struct lego_port_device *port,
@@ -137,6 +137,7 @@ extern u32 lego_sensor_itof(int i, unsigned dp);
 
 extern int register_lego_sensor(struct lego_sensor_device *, struct device *);
 extern void unregister_lego_sensor(struct lego_sensor_device *);
+extern void lego_sensor_notify_mode_change(struct lego_sensor_device *);
 
 extern struct class lego_sensor_class;
 
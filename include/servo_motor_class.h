@@ -17,9 +17,14 @@
 #define _LINUX_LEGOEV3_SERVO_MOTOR_CLASS_H
 
 #include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 #define SERVO_MOTOR_NAME_SIZE	30
+#define SERVO_MOTOR_GROUP_MAX	16
+#define SERVO_MOTOR_TIME_SP_MAX	60000
 
 enum servo_motor_command {
 	SERVO_MOTOR_COMMAND_RUN,
@@ -50,24 +55,69 @@ struct servo_motor_ops {
 	int (*set_rate)(void* context, unsigned rate);
 };
 
+struct servo_motor_device;
+
+/**
+ * @set_positions: Sets the position of several servos in one hardware
+ * 	transaction. Bit n of mask is set if positions[n] is valid for the
+ * 	servo at index n in the group. Values are pulse widths in
+ * 	milliseconds or 0 to float the output. Returns 0 on success or
+ * 	negative error.
+ */
+struct servo_motor_group_ops {
+	int (*set_positions)(void *context, unsigned long mask,
+			     const int *positions);
+};
+
+/**
+ * struct servo_motor_group
+ * @ops: Function pointers to the controller that owns the group.
+ * @context: Data struct passed back to the ops.
+ * @servos: The servos in the group, in channel order.
+ * @num_servos: The number of valid elements in the servos array.
+ *
+ * Drivers must call servo_motor_group_init() before registering any of the
+ * servos in the group.
+ */
+struct servo_motor_group {
+	struct servo_motor_group_ops ops;
+	void *context;
+	struct servo_motor_device *servos[SERVO_MOTOR_GROUP_MAX];
+	unsigned num_servos;
+	/* private */
+	struct mutex lock;
+	struct delayed_work move_work;
+};
+
 /**
  * struct servo_motor_device
  * @name: The name of servo controller.
  * @port_name: The name of the port that this motor is connected to.
  * @ops: Function pointers to the controller that registered this servo.
  * @context: Data struct passed back to the ops.
+ * @group: Optional group that this servo belongs to (or NULL).
+ * @group_index: The index of this servo in group->servos.
  * @min_pulse_ms: The size of the pulse to drive the motor to 0 degrees.
  * @mid_pulse_ms: The size of the pulse to drive the motor to 90 degrees.
  * @max_pulse_ms: The size of the pulse to drive the motor to 180 degrees.
  * @command: The current command for the motor.
  * @polarity: The polarity of the motor.
  * @position: The current position of the motor.
+ * @time_sp: The time in milliseconds used to move to a new position.
+ * @move_group: The group used to drive this servo (group or solo_group).
+ * @solo_group: Group used when the servo does not belong to a group.
+ * @moving: A timed move is in progress.
+ * @move_from: The position at the start of the current move.
+ * @move_time: The duration of the current move in milliseconds.
+ * @move_start: The time at the start of the current move.
  */
 struct servo_motor_device {
 	const char *name;
 	const char *port_name;
 	struct servo_motor_ops ops;
 	void *context;
+	struct servo_motor_group *group;
+	unsigned group_index;
 	/* private */
 	struct device dev;
 	unsigned min_pulse_ms;
@@ -76,10 +126,18 @@ struct servo_motor_device {
 	enum servo_motor_command command;
 	enum servo_motor_polarity polarity;
 	int position;
+	unsigned time_sp;
+	struct servo_motor_group *move_group;
+	struct servo_motor_group solo_group;
+	bool moving;
+	int move_from;
+	unsigned move_time;
+	ktime_t move_start;
 };
 
 #define to_servo_motor_device(_dev) container_of(_dev, struct servo_motor_device, dev)
 
+extern void servo_motor_group_init(struct servo_motor_group *);
 extern int register_servo_motor(struct servo_motor_device *, struct device *);
 extern void unregister_servo_motor(struct servo_motor_device *);
 
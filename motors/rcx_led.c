@@ -31,6 +31,10 @@
  * There is not much of interest there though - all the useful stuff is in the
  * [leds] class.
  * .
+ * When the `timer` trigger is selected, blinking is done by the output port
+ * PWM hardware, so it does not use any CPU time. Timings that the hardware
+ * cannot generate fall back to the normal software timer.
+ * .
  * This device is loaded when an [ev3-output-port] is set to `rcx-led` mode.
  * It is not automatically detected.
  * .
@@ -62,6 +66,25 @@ static void rcx_led_brightness_set(struct led_classdev *led_cdev,
 	port->motor_ops->set_duty_cycle(port->context, brightness);
 }
 
+static int rcx_led_blink_set(struct led_classdev *led_cdev,
+			     unsigned long *delay_on, unsigned long *delay_off)
+{
+	struct rcx_led_data *data =
+			container_of(led_cdev, struct rcx_led_data, cdev);
+	struct lego_port_device *port = data->motor->port;
+
+	if (!port->motor_ops->set_blink)
+		return -EINVAL;
+
+	/* The LED core wants us to pick a rate if none is given. */
+	if (!*delay_on && !*delay_off) {
+		*delay_on = 500;
+		*delay_off = 500;
+	}
+
+	return port->motor_ops->set_blink(port->context, *delay_on, *delay_off);
+}
+
 enum led_brightness rcx_led_brightness_get(struct led_classdev *led_cdev)
 {
 	struct rcx_led_data *data =
@@ -96,6 +119,7 @@ static int rcx_led_probe(struct lego_device *motor)
 	data->cdev.default_trigger = "none";
 	data->cdev.brightness_set = rcx_led_brightness_set;
 	data->cdev.brightness_get = rcx_led_brightness_get;
+	data->cdev.blink_set = rcx_led_blink_set;
 	data->cdev.brightness = LED_OFF;
 	data->cdev.max_brightness = 100;
 	data->motor = motor;
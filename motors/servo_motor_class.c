@@ -41,6 +41,17 @@
 * `device_name` (read-only)
 * : Returns the name of the servo device/driver.
 * .
+* `group_positions` (read/write)
+* : Only present on servos that share a controller that can update several
+*   channels at once. Reading returns the `position` of every servo in the
+*   group, in channel order, separated by spaces. Writing a space separated
+*   list of positions (same units and range as `position`) updates all of
+*   the servos in a single transaction so that they move at the same time.
+*   Use `-` in place of a value to leave that servo unchanged. Servos whose
+*   `command` is `float` are not driven and servos with a non-zero `time_sp`
+*   start a timed move instead. Writing to this attribute on any servo in the
+*   group has the same effect.
+* .
 * `max_pulse_ms` (read/write)
 * : Used to set the pulse size in milliseconds for the signal that tells the
 *   servo to drive to the maximum (clockwise) position. Default value is 2400.
@@ -83,13 +94,28 @@
 *   to 180 degrees. Note: Some servo controllers may not support this in which
 *   case reading and writing will fail with -ENOSYS. In continuous rotation
 *   servos, this value will affect the rate at which the speed ramps up or down.
+* .
+* `time_sp` (read/write)
+* : Sets the time in milliseconds that the servo takes to travel to a new
+*   `position`. When this is `0` (the default), the servo is sent to the new
+*   position immediately. Otherwise, the servo follows a smooth (minimum-jerk)
+*   path that is updated every 20 milliseconds by the kernel, so there is no
+*   need to update `position` in a loop from userspace. Writing a new
+*   `position` during a move starts a new move from the current point. Valid
+*   values are 0 to 60000. Servos that share a controller are updated
+*   together.
 */
 
+#include <linux/bitops.h>
+#include <linux/ctype.h>
 #include <linux/device.h>
 #include <linux/module.h>
+#include <linux/string.h>
 
 #include <servo_motor_class.h>
 
+#define SERVO_MOTOR_MOVE_PERIOD_MS	20
+
 const char *servo_motor_command_values[] = {
 	[SERVO_MOTOR_COMMAND_RUN]	= "run",
 	[SERVO_MOTOR_COMMAND_FLOAT]	= "float",
@@ -122,29 +148,151 @@ int servo_motor_class_get_command(struct servo_motor_device *motor)
 	return ret ? SERVO_MOTOR_COMMAND_RUN : SERVO_MOTOR_COMMAND_FLOAT;
 }
 
+static int servo_motor_class_get_pulse(struct servo_motor_device *motor,
+				       int position,
+				       enum servo_motor_polarity polarity)
+{
+	if (polarity == SERVO_MOTOR_POLARITY_INVERTED)
+		position = -position;
+	if (position > 0)
+		return servo_motor_class_scale(0, 100, motor->mid_pulse_ms,
+					       motor->max_pulse_ms, position);
+	return servo_motor_class_scale(-100, 0, motor->min_pulse_ms,
+				       motor->mid_pulse_ms, position);
+}
+
+/*
+ * Returns the position along a minimum-jerk trajectory from move_from to
+ * position, i.e. x(t) = x0 + (x1 - x0) * (10t^3 - 15t^4 + 6t^5), where t is
+ * the fraction of move_time that has elapsed. Fixed point with 10 fractional
+ * bits is plenty for the -100 to 100 range. Clears motor->moving when the
+ * move is finished.
+ */
+static int servo_motor_class_move_position(struct servo_motor_device *motor,
+					   ktime_t now)
+{
+	s64 elapsed = ktime_to_ms(ktime_sub(now, motor->move_start));
+	int t, t2, t3, s;
+
+	if (elapsed >= motor->move_time) {
+		motor->moving = false;
+		return motor->position;
+	}
+
+	t = ((int)elapsed << 10) / motor->move_time;
+	t2 = (t * t) >> 10;
+	t3 = (t2 * t) >> 10;
+	s = (t3 * (10240 - 15 * t + 6 * t2)) >> 10;
+
+	return motor->move_from + (((motor->position - motor->move_from) * s) >> 10);
+}
+
+/*
+ * Sends new pulse widths to the servos in the mask. Groups that cannot update
+ * all servos at once fall back to updating each servo individually.
+ */
+static int servo_motor_group_apply(struct servo_motor_group *group,
+				   unsigned long mask, const int *pulses)
+{
+	struct servo_motor_device *servo;
+	int i, err;
+
+	if (!mask)
+		return 0;
+	if (group->ops.set_positions)
+		return group->ops.set_positions(group->context, mask, pulses);
+
+	for_each_set_bit(i, &mask, group->num_servos) {
+		servo = group->servos[i];
+		err = servo->ops.set_position(servo->context, pulses[i]);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Updates all of the servos in a group that have a move in progress. This
+ * way, servos that share a controller only cost one transaction per period
+ * no matter how many of them are moving.
+ */
+static void servo_motor_group_move_work(struct work_struct *work)
+{
+	struct servo_motor_group *group = container_of(to_delayed_work(work),
+					struct servo_motor_group, move_work);
+	struct servo_motor_device *servo;
+	int pulses[SERVO_MOTOR_GROUP_MAX];
+	unsigned long mask = 0;
+	bool busy = false;
+	ktime_t now;
+	int i, err;
+
+	mutex_lock(&group->lock);
+	now = ktime_get();
+	for (i = 0; i < group->num_servos; i++) {
+		servo = group->servos[i];
+		if (!servo->moving)
+			continue;
+		pulses[i] = servo_motor_class_get_pulse(servo,
+			servo_motor_class_move_position(servo, now),
+			servo->polarity);
+		mask |= BIT(i);
+		busy |= servo->moving;
+	}
+	err = servo_motor_group_apply(group, mask, pulses);
+	if (err < 0)
+		dev_err(&group->servos[__ffs(mask)]->dev,
+			"Failed to update position. %d\n", err);
+	if (busy)
+		schedule_delayed_work(&group->move_work,
+			msecs_to_jiffies(SERVO_MOTOR_MOVE_PERIOD_MS));
+	mutex_unlock(&group->lock);
+}
+
+/*
+ * Starts a timed move to motor->position. Must be called with the group lock
+ * held. The first update happens right away unless the group already has an
+ * update pending, in which case this servo is picked up by that update.
+ */
+static void servo_motor_class_start_move(struct servo_motor_device *motor,
+					 int old_position)
+{
+	ktime_t now = ktime_get();
+
+	if (motor->moving)
+		old_position = servo_motor_class_move_position(motor, now);
+	motor->move_from = old_position;
+	motor->move_time = motor->time_sp;
+	motor->move_start = now;
+	motor->moving = true;
+	schedule_delayed_work(&motor->move_group->move_work, 0);
+}
+
 int servo_motor_class_set_position(struct servo_motor_device *motor,
 				   int new_position,
 				   enum servo_motor_polarity new_polarity)
 {
-	int scaled_position;
+	struct servo_motor_group *group = motor->move_group;
+	int old_position, err = 0;
 
+	mutex_lock(&group->lock);
+	old_position = motor->position;
 	motor->polarity = new_polarity;
 	motor->position = new_position;
 
-	if (motor->command == SERVO_MOTOR_COMMAND_RUN) {
-		if (new_polarity == SERVO_MOTOR_POLARITY_INVERTED)
-			new_position = -new_position;
-		if (new_position > 0)
-			scaled_position = servo_motor_class_scale(0, 100,
-				motor->mid_pulse_ms, motor->max_pulse_ms,
-				new_position);
-		else
-			scaled_position = servo_motor_class_scale(-100, 0,
-				motor->min_pulse_ms, motor->mid_pulse_ms,
-				new_position);
-		return motor->ops.set_position(motor->context, scaled_position);
+	if (motor->command == SERVO_MOTOR_COMMAND_RUN && motor->time_sp)
+		servo_motor_class_start_move(motor, old_position);
+	else {
+		motor->moving = false;
+		if (motor->command == SERVO_MOTOR_COMMAND_RUN)
+			err = motor->ops.set_position(motor->context,
+				servo_motor_class_get_pulse(motor, new_position,
+							    new_polarity));
 	}
-	return 0;
+	mutex_unlock(&group->lock);
+
+	return err;
 }
 
 static ssize_t device_name_show(struct device *dev,
@@ -249,12 +397,17 @@ static ssize_t command_store(struct device *dev, struct device_attribute *attr,
 		if (motor->command == i)
 			return size;
 
-		motor->command = i;
-		if (motor->command == SERVO_MOTOR_COMMAND_RUN)
+		if (i == SERVO_MOTOR_COMMAND_RUN) {
+			motor->command = i;
 			err = servo_motor_class_set_position(motor, motor->position,
 							     motor->polarity);
-		else
+		} else {
+			mutex_lock(&motor->move_group->lock);
+			motor->command = i;
+			motor->moving = false;
 			err = motor->ops.set_position(motor->context, 0);
+			mutex_unlock(&motor->move_group->lock);
+		}
 		if (err)
 			return err;
 		return size;
@@ -364,6 +517,107 @@ static ssize_t rate_store(struct device *dev, struct device_attribute *attr,
 	return count;
 }
 
+static ssize_t group_positions_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct servo_motor_device *motor = to_servo_motor_device(dev);
+	struct servo_motor_group *group = motor->group;
+	int i, count = 0;
+
+	if (!group)
+		return -ENOSYS;
+
+	for (i = 0; i < group->num_servos; i++)
+		count += sprintf(buf + count, i ? " %d" : "%d",
+				 group->servos[i]->position);
+	count += sprintf(buf + count, "\n");
+
+	return count;
+}
+
+static ssize_t group_positions_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct servo_motor_device *motor = to_servo_motor_device(dev);
+	struct servo_motor_group *group = motor->group;
+	struct servo_motor_device *servo;
+	int values[SERVO_MOTOR_GROUP_MAX];
+	int pulses[SERVO_MOTOR_GROUP_MAX];
+	unsigned long valid = 0, mask = 0;
+	const char *pos = buf;
+	int i, n, old_position, err;
+
+	if (!group || !group->ops.set_positions)
+		return -ENOSYS;
+
+	for (i = 0; i < group->num_servos; i++) {
+		pos = skip_spaces(pos);
+		if (!*pos)
+			break;
+		if (*pos == '-' && (isspace(pos[1]) || !pos[1])) {
+			pos++;
+			continue;
+		}
+		if (sscanf(pos, "%d%n", &values[i], &n) != 1
+		    || values[i] > 100 || values[i] < -100)
+			return -EINVAL;
+		pos += n;
+		valid |= BIT(i);
+	}
+	if (*skip_spaces(pos))
+		return -EINVAL;
+
+	mutex_lock(&group->lock);
+	for_each_set_bit(i, &valid, group->num_servos) {
+		servo = group->servos[i];
+		if (servo->command != SERVO_MOTOR_COMMAND_RUN || servo->time_sp)
+			continue;
+		pulses[i] = servo_motor_class_get_pulse(servo, values[i],
+							servo->polarity);
+		mask |= BIT(i);
+	}
+
+	err = servo_motor_group_apply(group, mask, pulses);
+	if (err >= 0) {
+		for_each_set_bit(i, &valid, group->num_servos) {
+			servo = group->servos[i];
+			old_position = servo->position;
+			servo->position = values[i];
+			if (servo->command != SERVO_MOTOR_COMMAND_RUN)
+				continue;
+			if (servo->time_sp)
+				servo_motor_class_start_move(servo, old_position);
+			else
+				servo->moving = false;
+		}
+	}
+	mutex_unlock(&group->lock);
+
+	return err < 0 ? err : count;
+}
+
+static ssize_t time_sp_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct servo_motor_device *motor = to_servo_motor_device(dev);
+
+	return sprintf(buf, "%u\n", motor->time_sp);
+}
+
+static ssize_t time_sp_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct servo_motor_device *motor = to_servo_motor_device(dev);
+	unsigned value;
+
+	if (sscanf(buf, "%u", &value) != 1 || value > SERVO_MOTOR_TIME_SP_MAX)
+		return -EINVAL;
+	motor->time_sp = value;
+
+	return count;
+}
+
 static DEVICE_ATTR_RO(device_name);
 static DEVICE_ATTR_RO(port_name);
 static DEVICE_ATTR_RW(min_pulse_ms);
@@ -373,6 +627,8 @@ static DEVICE_ATTR_RW(command);
 static DEVICE_ATTR_RW(polarity);
 static DEVICE_ATTR_RW(position);
 static DEVICE_ATTR_RW(rate);
+static DEVICE_ATTR_RW(group_positions);
+static DEVICE_ATTR_RW(time_sp);
 
 static struct attribute *servo_motor_class_attrs[] = {
 	&dev_attr_device_name.attr,
@@ -384,11 +640,26 @@ static struct attribute *servo_motor_class_attrs[] = {
 	&dev_attr_polarity.attr,
 	&dev_attr_position.attr,
 	&dev_attr_rate.attr,
+	&dev_attr_group_positions.attr,
+	&dev_attr_time_sp.attr,
 	NULL
 };
 
+static umode_t servo_motor_attr_is_visible(struct kobject *kobj,
+					    struct attribute *attr, int index)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct servo_motor_device *motor = to_servo_motor_device(dev);
+
+	if (attr == &dev_attr_group_positions.attr && !motor->group)
+		return 0;
+
+	return attr->mode;
+}
+
 static const struct attribute_group servo_motor_class_group = {
 	.attrs		= servo_motor_class_attrs,
+	.is_visible	= servo_motor_attr_is_visible,
 };
 
 static const struct attribute_group *servo_motor_class_groups[] = {
@@ -403,12 +674,31 @@ static void servo_motor_release(struct device *dev)
 static unsigned servo_motor_class_id = 0;
 struct class servo_motor_class;
 
+void servo_motor_group_init(struct servo_motor_group *group)
+{
+	mutex_init(&group->lock);
+	INIT_DELAYED_WORK(&group->move_work, servo_motor_group_move_work);
+}
+EXPORT_SYMBOL_GPL(servo_motor_group_init);
+
 int register_servo_motor(struct servo_motor_device *servo, struct device *parent)
 {
 	int ret;
 
 	if (!servo || !servo->port_name || !parent)
 		return -EINVAL;
+	if (servo->group && (servo->group_index >= servo->group->num_servos
+	    || servo->group->servos[servo->group_index] != servo))
+		return -EINVAL;
+
+	if (servo->group)
+		servo->move_group = servo->group;
+	else {
+		servo->solo_group.servos[0] = servo;
+		servo->solo_group.num_servos = 1;
+		servo_motor_group_init(&servo->solo_group);
+		servo->move_group = &servo->solo_group;
+	}
 
 	servo->dev.release = servo_motor_release;
 	servo->dev.parent = parent;
@@ -434,8 +724,25 @@ EXPORT_SYMBOL_GPL(register_servo_motor);
 
 void unregister_servo_motor(struct servo_motor_device *servo)
 {
+	struct servo_motor_group *group = servo->move_group;
+	bool busy = false;
+	int i;
+
 	dev_info(&servo->dev, "Unregistered\n");
 	device_unregister(&servo->dev);
+
+	mutex_lock(&group->lock);
+	servo->moving = false;
+	mutex_unlock(&group->lock);
+	cancel_delayed_work_sync(&group->move_work);
+
+	/* other servos in the group may still be moving */
+	mutex_lock(&group->lock);
+	for (i = 0; i < group->num_servos; i++)
+		busy |= group->servos[i]->moving;
+	if (busy)
+		schedule_delayed_work(&group->move_work, 0);
+	mutex_unlock(&group->lock);
 }
 EXPORT_SYMBOL_GPL(unregister_servo_motor);
 
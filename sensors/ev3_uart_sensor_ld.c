@@ -42,6 +42,86 @@
  * class] `device_name` attribute is not a real driver name. Instead it returns
  * `ev3-uart-<N>`, where `<N>` is the type id of the sensor.
  * .
+ * The line discipline can also be attached to the slave side of a
+ * pseudo-terminal. A program on the master side that speaks the sensor
+ * protocol can then be used to test the driver without a real sensor. Speed
+ * changes only show up in the termios settings of the pseudo-terminal. The
+ * time the last handshake took is in `handshake_ms` in the debugfs directory
+ * of the tty (see below). `tools/ev3-uart` in the source code has a sensor
+ * emulator and a test bench that work this way.
+ * .
+ * ### Module parameters
+ * .
+ * `info_cache`
+ * : Sensors send the same information every time they are connected, which
+ *   takes more than a second at 2400 baud. When this is `Y`, the information
+ *   is remembered and when a known sensor connects again, it is acknowledged
+ *   as soon as the information for its first mode matches. If the sensor does
+ *   not accept the early acknowledgment, the full information is used the
+ *   next time. Default is `Y`.
+ * .
+ * `async_set_mode`
+ * : When this is `Y`, writing the `mode` attribute returns right away instead
+ *   of waiting for the sensor to confirm the new mode. `poll()` on `mode`
+ *   wakes up once the first value in the new mode has been received or when
+ *   the sensor did not change modes, in which case `mode` returns the old
+ *   mode again. Default is `N`.
+ * .
+ * `keep_alive_ms`
+ * : How often a keep-alive message is sent to the sensor. It is not sent if
+ *   another command was sent to the sensor during this time. Default is 100.
+ * .
+ * `data_timeout_ms`
+ * : If no DATA has been received from the sensor for this long, the sensor is
+ *   considered disconnected and the driver waits for it to sync again. Sensor
+ *   modes that send data at a fast rate can use a much shorter time to detect
+ *   a failure sooner. Default is 700.
+ * .
+ * `max_speed`
+ * : The fastest baud rate that a sensor may ask for. Sensors that ask for a
+ *   faster rate are not used. This can be raised for third-party sensors that
+ *   support faster rates if the tty supports them too. Rates above 819200
+ *   are never used because the driver cannot buffer enough data for them.
+ *   Default is 460800.
+ * .
+ * ### sysfs Attributes
+ * .
+ * These are added to the [lego-sensor class] device of the sensor.
+ * .
+ * `mode_schedule` (read/write)
+ * : Writing a space separated list of modes makes the driver cycle through
+ *   these modes by itself. It selects the next mode after `mode_dwell` DATA
+ *   messages have been received in the current one. Writing an empty string
+ *   or writing the `mode` attribute stops cycling.
+ * .
+ * `mode_dwell` (read/write)
+ * : The number of DATA messages to receive in each mode of `mode_schedule`.
+ *   Default is 1.
+ * .
+ * `max_speed` (read/write)
+ * : Overrides the `max_speed` module parameter for this sensor. It is used
+ *   the next time the sensor syncs. Writing 0 uses the module parameter.
+ *   Values above 819200 are rejected.
+ * .
+ * `mode_data` (read-only)
+ * : The last data received in each mode. There is one 40 byte record per mode.
+ *   Each record holds the time the data was received as a signed 64-bit
+ *   `CLOCK_MONOTONIC` value in nanoseconds (0 if nothing was received yet)
+ *   followed by 32 bytes of raw data in the same format as `bin_data`.
+ * .
+ * `commands` (write-only)
+ * : Sends several commands to the sensor with one write. Each command is one
+ *   byte for the command (3 for SELECT or 4 for WRITE), one byte for the
+ *   number of data bytes that follow (1 for SELECT, 1 to 32 for WRITE) and
+ *   then the data bytes (the mode for SELECT). The commands are queued and
+ *   sent in order. When one write has several SELECTs, DATA in the mode of
+ *   any of them is accepted until DATA in the mode of the last one is
+ *   received. When the queue is full, the write returns the number of
+ *   bytes of the commands that were queued, or `EAGAIN` if there was no room
+ *   for the first one, and the rest can be written again later. The number
+ *   of commands sent and rejected are in `tx_msgs` and `tx_full` in the
+ *   debugfs directory of the tty.
+ * .
  * [line discipline]: https://en.wikipedia.org/wiki/Line_discipline
  * [lego-sensor class]: ../lego-sensor-class
  * [works with any tty]: http://lechnology.com/2014/09/using-uart-sensors-on-any-linux/
@@ -49,13 +129,19 @@
 
 #include <linux/bitops.h>
 #include <linux/circ_buf.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/hrtimer.h>
-#include <linux/interrupt.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/tty.h>
+#include <linux/workqueue.h>
 
 #include <lego.h>
 #include <lego_port_class.h>
@@ -71,11 +157,25 @@
 #define N_LEGOEV3 29
 #endif
 
-/* EV3_UART_BUFFER_SIZE must be power of 2 for circ_buf macros */
-#define EV3_UART_BUFFER_SIZE		256
+/*
+ * The receive buffer holds at least EV3_UART_RX_BUFFER_MS of data (10 bits
+ * per byte) so that nothing is lost while the worker is waiting to run. This
+ * limits the baud rate to EV3_UART_SPEED_LIMIT, even if max_speed is higher.
+ * EV3_UART_BUFFER_SIZE must be power of 2 for circ_buf macros.
+ */
+#define EV3_UART_RX_BUFFER_MS		50
+#define EV3_UART_BUFFER_SIZE		4096
+#define EV3_UART_SPEED_LIMIT		(EV3_UART_BUFFER_SIZE * 10 * 1000 \
+					 / EV3_UART_RX_BUFFER_MS)
 #define EV3_UART_MAX_DATA_SIZE		32
 #define EV3_UART_MAX_MESSAGE_SIZE	(EV3_UART_MAX_DATA_SIZE + 2)
 
+/*
+ * Commands for the sensor are queued in the transmit buffer until the tty can
+ * take them. EV3_UART_TX_BUFFER_SIZE must be power of 2 for circ_buf macros.
+ */
+#define EV3_UART_TX_BUFFER_SIZE		1024
+
 #define EV3_UART_MSG_TYPE_MASK		0xC0
 #define EV3_UART_CMD_SIZE(byte)		(1 << ((byte >> 3) & 0x7))
 #define EV3_UART_MSG_CMD_MASK		0x07
@@ -90,11 +190,20 @@
 #define EV3_UART_MODE_NAME_SIZE		11
 
 #define EV3_UART_SEND_ACK_DELAY			10 /* msec */
+#define EV3_UART_SPEED_CHANGE_DELAY		4000 /* usec */
+#define EV3_UART_SET_MODE_TIMEOUT		50 /* msec */
+#define EV3_UART_SET_MODE_RETRIES		10
 #define EV3_UART_DATA_KEEP_ALIVE_TIMEOUT	100 /* msec */
+#define EV3_UART_DATA_TIMEOUT			700 /* msec */
 
 #define EV3_UART_DEVICE_TYPE_NAME_SIZE		30
 #define EV3_UART_UNITS_SIZE			4
 
+#define EV3_UART_INFO_CACHE_SIZE		8
+
+#define EV3_UART_MUX_MAX			8
+#define EV3_UART_MUX_RESEND			10
+
 enum ev3_uart_msg_type {
 	EV3_UART_MSG_TYPE_SYS	= 0x00,
 	EV3_UART_MSG_TYPE_CMD	= 0x40,
@@ -176,16 +285,39 @@ enum ev3_uart_info_flags {
  * @tty: Pointer to the tty device that the sensor is connected to
  * @in_port: The input port device associated with this tty.
  * @sensor: The lego-sensor class structure for the sensor.
- * @rx_data_work: Workqueue item for handling received data.
+ * @rx_data_work: Workqueue item for handling received data that is not a
+ * 	DATA message.
  * @send_ack_work: Used to send ACK after a delay.
  * @change_bitrate_work: Used to change the baud rate after a delay.
- * @keep_alive_timer: Sends a NACK every 100usec when a sensor is connected.
- * @keep_alive_tasklet: Does the actual sending of the NACK.
+ * @set_mode_work: Resends SELECT until the sensor changes modes and notifies
+ * 	userspace when it is done.
+ * @tx_work: Passes queued commands to the tty when it has room again.
+ * @keep_alive_timer: Sends a NACK as keep-alive when nothing else was sent to
+ * 	the sensor and watches for DATA messages to stop.
  * @set_mode_completion: Used to block until confirmation has been received from
  * 	the sensor that the mode was actually changed.
  * @mode_info: Array of information about each mode of the sensor
  * @type_id: Type id returned by the sensor
  * @new_mode: The mode requested by set_mode.
+ * @data_mode: The mode of the last DATA message received.
+ * @set_mode_retries: Number of times set_mode_work will resend SELECT.
+ * @queued_modes: Bitmap of the modes of SELECT commands queued with the
+ * 	commands attribute since DATA was last received in new_mode. Protected
+ * 	by tx_lock.
+ * @mux_modes: Modes to cycle through.
+ * @mux_len: Number of valid modes in mux_modes or 0 if not cycling.
+ * @mux_pos: Index in mux_modes of the mode that was last selected.
+ * @mux_dwell: Number of DATA messages to receive in each mode.
+ * @mux_count: Number of DATA messages received in the selected mode.
+ * @mux_miss: Number of DATA messages received in other modes since the last
+ * 	SELECT.
+ * @data_time: Time when the last DATA message for each mode was received.
+ * @data_seq: Lets mode_data readers get raw_data and data_time of a mode from
+ * 	the same message. The writers run in preemptible context, so the lock
+ * 	keeps a reader from preempting a writer and spinning forever.
+ * @decoder: The routine used to turn raw_data of each mode into values.
+ * @values: Scaled values of each mode, updated when DATA is received.
+ * @rescale: Bitmap of modes where raw values have to be scaled to SI values.
  * @raw_min: Min/max values are sent as float data types. This holds the value
  * 	until we read the number of decimal places needed to convert this
  * 	value to an integer.
@@ -197,17 +329,55 @@ enum ev3_uart_info_flags {
  * @new_baud_rate: New baud rate that will be set with ev3_uart_change_bitrate
  * @info_flags: Flags indicating what information has already been read
  * 	from the sensor.
+ * @info_hash: Hash of all messages received since the TYPE message.
+ * @info_prefix_hash: Value of info_hash after the first FORMAT INFO message.
  * @buffer: Byte array to store received data in between receive_buf interrupts.
  * @circ_buf: Circular buffer struct that points to buffer (above).
+ * @rx_lock: Protects rx_deferred and adding data to circ_buf.
+ * @rx_deferred: Received data is being passed to rx_data_work instead of being
+ * 	parsed in receive_buf.
+ * @rx_msg: DATA message that is being received in receive_buf.
+ * @rx_msg_len: Number of bytes of rx_msg received so far.
+ * @rx_msg_size: Total size of rx_msg.
+ * @tx_buffer: Byte array to store commands until the tty can take them.
+ * @tx_circ: Circular buffer struct that points to tx_buffer (above).
+ * @tx_lock: Protects tx_circ and writing to the tty. Nothing else may be
+ * 	written to the tty while part of a command is still in tx_buffer.
  * @last_err: Message to be printed in case of an error.
  * @num_data_err: Number of bad reads when receiving DATA messages.
  * @synced: Flag indicating communications are synchronized with the sensor.
  * @info_done: Flag indicating that all mode info has been received and it is
  * 	OK to start receiving DATA messages.
- * @data_rec: Flag that indicates that good DATA message has been received
- * 	since last watchdog timeout.
  * @closing: Flag to indicate that we are closing the connection and any data
  * 	received should be ignored.
+ * @rx_bytes: Number of bytes received.
+ * @rx_msgs: Number of messages received with a good checksum.
+ * @rx_chksum_errs: Number of messages received with a bad checksum.
+ * @rx_overruns: Number of bytes dropped because the receive buffer was full.
+ * @resyncs: Number of times communication with the sensor was restarted.
+ * @last_data: Time when the last good DATA message was received.
+ * @last_tx: Time when the last message was sent to the sensor.
+ * @nacks_sent: Number of keep-alive messages sent.
+ * @nacks_skipped: Number of keep-alive messages not needed because another
+ * 	command was sent.
+ * @data_timeouts: Number of times DATA messages stopped for data_timeout_ms.
+ * @data_gap_max_us: Longest time between two good DATA messages.
+ * @tx_msgs: Number of commands queued for the sensor.
+ * @tx_full: Number of commands rejected because tx_buffer was full.
+ * @sync_time: Time when the TYPE message that started the handshake was
+ * 	received.
+ * @handshake_ms: Time from the TYPE message to sending the ACK for the last
+ * 	handshake.
+ * @max_speed: Fastest baud rate the sensor may ask for or 0 to use the
+ * 	max_speed module parameter.
+ * @ack_time: Time when the last ACK was sent.
+ * @ack_to_speed_us: Time from the last ACK until the new baud rate was set.
+ * @ack_to_data_us: Time from the last ACK until the first DATA message.
+ * @data_after_ack: Waiting for the first DATA message after an ACK.
+ * @debugfs: The debugfs directory for this port.
+ * @info_prefix_done: Flag indicating that info_prefix_hash is valid.
+ * @early_ack: Flag indicating that the mode info was taken from the cache and
+ * 	ACKed early, but no DATA has been received yet to confirm it.
  */
 struct ev3_uart_port_data {
 	char device_name[LEGO_NAME_SIZE + 1];
@@ -217,12 +387,27 @@ struct ev3_uart_port_data {
 	struct work_struct rx_data_work;
 	struct delayed_work send_ack_work;
 	struct work_struct change_bitrate_work;
+	struct delayed_work set_mode_work;
+	struct work_struct tx_work;
 	struct hrtimer keep_alive_timer;
-	struct tasklet_struct keep_alive_tasklet;
 	struct completion set_mode_completion;
 	struct lego_sensor_mode_info mode_info[EV3_UART_MODE_MAX + 1];
 	u8 type_id;
 	u8 new_mode;
+	u8 data_mode;
+	u8 set_mode_retries;
+	unsigned long queued_modes;
+	u8 mux_modes[EV3_UART_MUX_MAX];
+	unsigned mux_len;
+	unsigned mux_pos;
+	u8 mux_dwell;
+	u8 mux_count;
+	u8 mux_miss;
+	ktime_t data_time[EV3_UART_MODE_MAX + 1];
+	seqlock_t data_seq;
+	const struct ev3_uart_decoder *decoder[EV3_UART_MODE_MAX + 1];
+	long values[EV3_UART_MODE_MAX + 1][LEGO_SENSOR_RAW_DATA_SIZE];
+	unsigned long rescale;
 	u32 raw_min;
 	u32 raw_max;
 	u32 pct_min;
@@ -231,19 +416,107 @@ struct ev3_uart_port_data {
 	u32 si_max;
 	speed_t new_baud_rate;
 	long unsigned info_flags;
+	u32 info_hash;
+	u32 info_prefix_hash;
 	u8 buffer[EV3_UART_BUFFER_SIZE];
 	struct circ_buf circ_buf;
+	spinlock_t rx_lock;
+	bool rx_deferred;
+	u8 rx_msg[EV3_UART_MAX_MESSAGE_SIZE];
+	u8 rx_msg_len;
+	u8 rx_msg_size;
+	u8 tx_buffer[EV3_UART_TX_BUFFER_SIZE];
+	struct circ_buf tx_circ;
+	spinlock_t tx_lock;
 	char *last_err;
 	unsigned num_data_err;
+	u32 rx_bytes;
+	u32 rx_msgs;
+	u32 rx_chksum_errs;
+	u32 rx_overruns;
+	u32 resyncs;
+	ktime_t last_data;
+	ktime_t last_tx;
+	u32 nacks_sent;
+	u32 nacks_skipped;
+	u32 data_timeouts;
+	u32 data_gap_max_us;
+	u32 tx_msgs;
+	u32 tx_full;
+	ktime_t sync_time;
+	u32 handshake_ms;
+	speed_t max_speed;
+	ktime_t ack_time;
+	u32 ack_to_speed_us;
+	u32 ack_to_data_us;
+	bool data_after_ack;
+	struct dentry *debugfs;
 	unsigned synced:1;
 	unsigned info_done:1;
-	unsigned data_rec:1;
 	unsigned closing:1;
+	unsigned info_prefix_done:1;
+	unsigned early_ack:1;
 };
 
+/**
+ * struct ev3_uart_info_cache_entry - Mode information remembered for a sensor
+ * @type_id: The type id of the sensor or 0 if the entry is not used.
+ * @prefix_hash: Hash of the messages up to and including the first FORMAT
+ * 	INFO message.
+ * @hash: Hash of all of the messages up to and including the ACK.
+ * @baud_rate: The speed requested by the sensor.
+ * @num_modes: Number of modes.
+ * @num_view_modes: Number of modes that return a single value.
+ * @mode_info: The mode information that was parsed from the INFO messages.
+ * @last_used: Time in jiffies when the entry was last used.
+ * @early_ack_failed: The sensor did not accept an early ACK, so the entry is
+ * 	only used after all of the INFO has been received.
+ */
+struct ev3_uart_info_cache_entry {
+	u8 type_id;
+	u32 prefix_hash;
+	u32 hash;
+	speed_t baud_rate;
+	u8 num_modes;
+	u8 num_view_modes;
+	struct lego_sensor_mode_info mode_info[EV3_UART_MODE_MAX + 1];
+	unsigned long last_used;
+	unsigned early_ack_failed:1;
+};
+
+static struct ev3_uart_info_cache_entry
+ev3_uart_info_cache[EV3_UART_INFO_CACHE_SIZE];
+static DEFINE_MUTEX(ev3_uart_info_cache_mutex);
+
+/* Handles everything but DATA messages, which are parsed in receive_buf */
+static struct workqueue_struct *ev3_uart_rx_wq;
+
+/* Parent directory for the per-port debugfs directories */
+static struct dentry *ev3_uart_debugfs;
+
+static bool info_cache = true;
+module_param(info_cache, bool, 0644);
+MODULE_PARM_DESC(info_cache, "Remember sensor INFO and ACK early when a known sensor reconnects");
+
+static bool async_set_mode;
+module_param(async_set_mode, bool, 0644);
+MODULE_PARM_DESC(async_set_mode, "Do not wait for the sensor to confirm mode changes");
+
+static uint max_speed = EV3_UART_SPEED_MAX;
+module_param(max_speed, uint, 0644);
+MODULE_PARM_DESC(max_speed, "Fastest baud rate a sensor may ask for");
+
+static uint keep_alive_ms = EV3_UART_DATA_KEEP_ALIVE_TIMEOUT;
+module_param(keep_alive_ms, uint, 0644);
+MODULE_PARM_DESC(keep_alive_ms, "Time between keep-alive messages in milliseconds");
+
+static uint data_timeout_ms = EV3_UART_DATA_TIMEOUT;
+module_param(data_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(data_timeout_ms, "Time without DATA before resyncing in milliseconds");
+
 u8 ev3_uart_set_msg_hdr(u8 type, const unsigned long size, u8 cmd)
 {
-	u8 size_code = (find_last_bit(&size, sizeof(unsigned long)) & 0x7) << 3;
+	u8 size_code = (ilog2(size) & 0x7) << 3;
 
 	return (type & EV3_UART_MSG_TYPE_MASK) | size_code
 		| (cmd & EV3_UART_MSG_CMD_MASK);
@@ -256,6 +529,147 @@ static struct lego_sensor_mode_info ev3_uart_default_mode_info = {
 	.figures = 4,
 };
 
+/*
+ * The DATA of most sensor modes is only a few values of one type, so instead
+ * of working out the type and size of each value when it is read, a decoder
+ * for the data type and number of data sets is picked once per mode when its
+ * FORMAT INFO is received. The values are then decoded when the DATA arrives.
+ */
+#define EV3_UART_DECODER(_name, _type, _data_sets)			\
+static void ev3_uart_decode_##_name(struct lego_sensor_mode_info *mode_info, \
+				    long *values)			\
+{									\
+	const _type *raw = (const _type *)mode_info->raw_data;		\
+	int i;								\
+									\
+	for (i = 0; i < (_data_sets); i++)				\
+		values[i] = raw[i];					\
+}
+
+EV3_UART_DECODER(s8x1, s8, 1)
+EV3_UART_DECODER(s8x8, s8, 8)
+EV3_UART_DECODER(s16x1, s16, 1)
+EV3_UART_DECODER(s16x2, s16, 2)
+EV3_UART_DECODER(s16x3, s16, 3)
+EV3_UART_DECODER(s32x1, s32, 1)
+EV3_UART_DECODER(s8, s8, mode_info->data_sets)
+EV3_UART_DECODER(s16, s16, mode_info->data_sets)
+EV3_UART_DECODER(s32, s32, mode_info->data_sets)
+
+static void ev3_uart_decode_float(struct lego_sensor_mode_info *mode_info,
+				  long *values)
+{
+	const u32 *raw = (const u32 *)mode_info->raw_data;
+	int i;
+
+	for (i = 0; i < mode_info->data_sets; i++)
+		values[i] = lego_sensor_ftoi(raw[i], mode_info->decimals);
+}
+
+/**
+ * struct ev3_uart_decoder - Decodes the DATA of a sensor mode
+ * @data_type: The data type of the mode.
+ * @data_sets: The number of data sets of the mode or 0 for any number.
+ * @decode: Converts the raw_data of the mode to values.
+ */
+struct ev3_uart_decoder {
+	enum lego_sensor_data_type data_type;
+	u8 data_sets;
+	void (*decode)(struct lego_sensor_mode_info *mode_info, long *values);
+};
+
+/* The first match is used, so the ones for any number of data sets go last */
+static const struct ev3_uart_decoder ev3_uart_decoders[] = {
+	{ LEGO_SENSOR_DATA_S8,	 1, ev3_uart_decode_s8x1 },
+	/* e.g. IR-SEEK mode of the EV3 Infrared sensor */
+	{ LEGO_SENSOR_DATA_S8,	 8, ev3_uart_decode_s8x8 },
+	/* e.g. GYRO-ANG and GYRO-G&A modes of the EV3 Gyro sensor */
+	{ LEGO_SENSOR_DATA_S16,	 1, ev3_uart_decode_s16x1 },
+	{ LEGO_SENSOR_DATA_S16,	 2, ev3_uart_decode_s16x2 },
+	/* e.g. RGB-RAW mode of the EV3 Color sensor */
+	{ LEGO_SENSOR_DATA_S16,	 3, ev3_uart_decode_s16x3 },
+	{ LEGO_SENSOR_DATA_S32,	 1, ev3_uart_decode_s32x1 },
+	{ LEGO_SENSOR_DATA_S8,	 0, ev3_uart_decode_s8 },
+	{ LEGO_SENSOR_DATA_S16,	 0, ev3_uart_decode_s16 },
+	{ LEGO_SENSOR_DATA_S32,	 0, ev3_uart_decode_s32 },
+	{ LEGO_SENSOR_DATA_FLOAT, 0, ev3_uart_decode_float },
+};
+
+/*
+ * Updates the values of a mode from its raw_data. Must be called inside of
+ * data_seq.
+ */
+static void ev3_uart_decode(struct ev3_uart_port_data *port, u8 mode)
+{
+	struct lego_sensor_mode_info *mode_info = &port->mode_info[mode];
+	long *values = port->values[mode];
+	int i;
+
+	if (!port->decoder[mode])
+		return;
+	port->decoder[mode]->decode(mode_info, values);
+	if (!test_bit(mode, &port->rescale))
+		return;
+	for (i = 0; i < mode_info->data_sets; i++) {
+		values[i] = (values[i] - mode_info->raw_min)
+			* (mode_info->si_max - mode_info->si_min)
+			/ (mode_info->raw_max - mode_info->raw_min)
+			+ mode_info->si_min;
+	}
+}
+
+/* Returns the value that was decoded when the DATA was received */
+static int ev3_uart_scale(void *context,
+			  struct lego_sensor_mode_info *mode_info,
+			  u8 index, long int *value)
+{
+	struct tty_struct *tty = context;
+	struct ev3_uart_port_data *port = tty->disc_data;
+
+	*value = ACCESS_ONCE(port->values[mode_info - port->mode_info][index]);
+
+	return 0;
+}
+
+/*
+ * Picks the decoder for a mode. Must be called after the FORMAT INFO of the
+ * mode has been received. Modes without a decoder (including ones that claim
+ * more data than fits in raw_data) use the default scaling of the lego-sensor
+ * class.
+ */
+static void ev3_uart_select_decoder(struct ev3_uart_port_data *port, u8 mode)
+{
+	struct lego_sensor_mode_info *mode_info = &port->mode_info[mode];
+	const struct ev3_uart_decoder *decoder = NULL;
+	int size = lego_sensor_get_raw_data_size(mode_info);
+	int i;
+
+	for (i = 0; size <= LEGO_SENSOR_RAW_DATA_SIZE
+		    && i < ARRAY_SIZE(ev3_uart_decoders); i++)
+	{
+		if (ev3_uart_decoders[i].data_type != mode_info->data_type)
+			continue;
+		if (!ev3_uart_decoders[i].data_sets
+		    || ev3_uart_decoders[i].data_sets == mode_info->data_sets)
+		{
+			decoder = &ev3_uart_decoders[i];
+			break;
+		}
+	}
+	if (mode_info->raw_min != mode_info->raw_max
+	    && (mode_info->raw_min != mode_info->si_min
+		|| mode_info->raw_max != mode_info->si_max))
+		set_bit(mode, &port->rescale);
+	else
+		clear_bit(mode, &port->rescale);
+
+	write_seqlock(&port->data_seq);
+	port->decoder[mode] = decoder;
+	ev3_uart_decode(port, mode);
+	write_sequnlock(&port->data_seq);
+	mode_info->scale = decoder ? ev3_uart_scale : NULL;
+}
+
 static inline int ev3_uart_msg_size(u8 header)
 {
 	int size;
@@ -283,13 +697,98 @@ int ev3_uart_write_byte(struct tty_struct *tty, const u8 byte)
 	return ret;
 }
 
+/*
+ * Passes as much of the transmit buffer to the tty as it will take. The
+ * rest is sent from tx_work when the tty asks for more. Must be called with
+ * tx_lock held.
+ */
+static void ev3_uart_tx_flush(struct ev3_uart_port_data *port)
+{
+	struct circ_buf *cb = &port->tx_circ;
+	int count, ret;
+
+	while ((count = CIRC_CNT_TO_END(cb->head, cb->tail,
+					EV3_UART_TX_BUFFER_SIZE)))
+	{
+		ret = port->tty->ops->write(port->tty, cb->buf + cb->tail,
+					    count);
+		if (ret <= 0)
+			break;
+		cb->tail = (cb->tail + ret) & (EV3_UART_TX_BUFFER_SIZE - 1);
+	}
+	if (CIRC_CNT(cb->head, cb->tail, EV3_UART_TX_BUFFER_SIZE))
+		set_bit(TTY_DO_WRITE_WAKEUP, &port->tty->flags);
+}
+
+static void ev3_uart_tx_work(struct work_struct *work)
+{
+	struct ev3_uart_port_data *port =
+		container_of(work, struct ev3_uart_port_data, tx_work);
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->tx_lock, flags);
+	ev3_uart_tx_flush(port);
+	spin_unlock_irqrestore(&port->tx_lock, flags);
+}
+
+static inline void ev3_uart_tx_put(struct circ_buf *cb, u8 byte)
+{
+	cb->buf[cb->head] = byte;
+	cb->head = (cb->head + 1) & (EV3_UART_TX_BUFFER_SIZE - 1);
+}
+
+/*
+ * Builds a command message directly in the transmit buffer. The data is
+ * padded with zeros to the next message size. Must be called with tx_lock
+ * held. Returns -EAGAIN if there is not enough room for the whole message.
+ */
+static int ev3_uart_tx_queue(struct ev3_uart_port_data *port, u8 cmd,
+			     const u8 *data, unsigned count)
+{
+	struct circ_buf *cb = &port->tx_circ;
+	unsigned long size = count <= 2 ? count : roundup_pow_of_two(count);
+	u8 byte, chksum;
+	int i;
+
+	if (CIRC_SPACE(cb->head, cb->tail, EV3_UART_TX_BUFFER_SIZE) < size + 2) {
+		port->tx_full++;
+		return -EAGAIN;
+	}
+	byte = ev3_uart_set_msg_hdr(EV3_UART_MSG_TYPE_CMD, size, cmd);
+	chksum = 0xFF ^ byte;
+	ev3_uart_tx_put(cb, byte);
+	for (i = 0; i < size; i++) {
+		byte = i < count ? data[i] : 0;
+		chksum ^= byte;
+		ev3_uart_tx_put(cb, byte);
+	}
+	ev3_uart_tx_put(cb, chksum);
+	port->tx_msgs++;
+	port->last_tx = ktime_get();
+
+	return 0;
+}
+
+static int ev3_uart_send_select(struct tty_struct *tty, const u8 mode)
+{
+	struct ev3_uart_port_data *port = tty->disc_data;
+	unsigned long flags;
+	int err;
+
+	spin_lock_irqsave(&port->tx_lock, flags);
+	err = ev3_uart_tx_queue(port, EV3_UART_CMD_SELECT, &mode, 1);
+	if (!err)
+		ev3_uart_tx_flush(port);
+	spin_unlock_irqrestore(&port->tx_lock, flags);
+
+	return err;
+}
+
 int ev3_uart_set_mode(void *context, const u8 mode)
 {
 	struct tty_struct *tty = context;
 	struct ev3_uart_port_data *port;
-	const int data_size = 3;
-	u8 data[data_size];
-	int retries = 10;
+	int retries = EV3_UART_SET_MODE_RETRIES;
 	int ret;
 
 	if (!tty)
@@ -300,25 +799,36 @@ int ev3_uart_set_mode(void *context, const u8 mode)
 		return -ENODEV;
 	if (mode >= port->sensor.num_modes)
 		return -EINVAL;
+
+	ACCESS_ONCE(port->mux_len) = 0;
+
+	if (async_set_mode) {
+		/* a new request replaces one that is still pending */
+		port->new_mode = mode;
+		port->set_mode_retries = EV3_UART_SET_MODE_RETRIES - 1;
+		reinit_completion(&port->set_mode_completion);
+		ret = ev3_uart_send_select(tty, mode);
+		if (ret < 0) {
+			port->set_mode_completion.done++;
+			return ret;
+		}
+		mod_delayed_work(system_wq, &port->set_mode_work,
+				 msecs_to_jiffies(EV3_UART_SET_MODE_TIMEOUT));
+		return 0;
+	}
+
 	if (!completion_done(&port->set_mode_completion))
 		return -EBUSY;
 
-	data[0] = ev3_uart_set_msg_hdr(EV3_UART_MSG_TYPE_CMD,
-					   data_size - 2,
-					   EV3_UART_CMD_SELECT);
-	data[1] = mode;
-	data[2] = 0xFF ^ data[0] ^ data[1];
-
 	port->new_mode = mode;
 	reinit_completion(&port->set_mode_completion);
 	while (retries--) {
-		set_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
-		ret = tty->ops->write(tty, data, data_size);
+		ret = ev3_uart_send_select(tty, mode);
 		if (ret < 0)
 			return ret;
 
 		ret = wait_for_completion_timeout(&port->set_mode_completion,
-						  msecs_to_jiffies(50));
+				msecs_to_jiffies(EV3_UART_SET_MODE_TIMEOUT));
 		if (ret)
 			break;
 	}
@@ -329,36 +839,46 @@ int ev3_uart_set_mode(void *context, const u8 mode)
 	return 0;
 }
 
+static void ev3_uart_set_mode_work(struct work_struct *work)
+{
+	struct delayed_work *dwork = to_delayed_work(work);
+	struct ev3_uart_port_data *port =
+		container_of(dwork, struct ev3_uart_port_data, set_mode_work);
+
+	if (!completion_done(&port->set_mode_completion)) {
+		if (port->set_mode_retries) {
+			port->set_mode_retries--;
+			ev3_uart_send_select(port->tty, port->new_mode);
+			schedule_delayed_work(dwork,
+				msecs_to_jiffies(EV3_UART_SET_MODE_TIMEOUT));
+			return;
+		}
+		port->last_err = "Timed out changing mode.";
+		port->sensor.mode = port->data_mode;
+		port->set_mode_completion.done++;
+	}
+
+	if (port->sensor.context)
+		lego_sensor_notify_mode_change(&port->sensor);
+}
+
 static ssize_t ev3_uart_write_data(void *context, char *data, loff_t off,
 				   size_t count)
 {
 	struct tty_struct *tty = context;
-	char uart_data[EV3_UART_MAX_MESSAGE_SIZE];
-	int size, i, err;
+	struct ev3_uart_port_data *port = tty->disc_data;
+	unsigned long flags;
+	int err;
 
 	if (off != 0 || count > EV3_UART_MAX_DATA_SIZE)
 		return -EINVAL;
 	if (count == 0)
 		return count;
-	memset(uart_data + 1, 0, EV3_UART_MAX_DATA_SIZE);
-	memcpy(uart_data + 1, data, count);
-	if (count <= 2)
-		size = count;
-	else if (count <= 4)
-		size = 4;
-	else if (count <= 8)
-		size = 8;
-	else if (count <= 16)
-		size = 16;
-	else
-		size = 32;
-	uart_data[0] = ev3_uart_set_msg_hdr(EV3_UART_MSG_TYPE_CMD, size,
-						EV3_UART_CMD_WRITE);
-	data[size + 1] = 0xFF;
-	for (i = 0; i <= size; i++)
-		uart_data[size + 1] ^= uart_data[i];
-	set_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
-	err = tty->ops->write(tty, uart_data, size + 2);
+	spin_lock_irqsave(&port->tx_lock, flags);
+	err = ev3_uart_tx_queue(port, EV3_UART_CMD_WRITE, (u8 *)data, count);
+	if (!err)
+		ev3_uart_tx_flush(port);
+	spin_unlock_irqrestore(&port->tx_lock, flags);
 	if (err < 0)
 		return err;
 
@@ -376,14 +896,277 @@ int ev3_uart_match_input_port(struct device *dev, const void *data)
 	return !strcmp(pdev->port_alias, tty_name);
 }
 
+static ssize_t mode_schedule_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct lego_sensor_device *sensor = to_lego_sensor_device(dev);
+	struct ev3_uart_port_data *port =
+		container_of(sensor, struct ev3_uart_port_data, sensor);
+	unsigned len = ACCESS_ONCE(port->mux_len);
+	int i, count = 0;
+
+	smp_rmb();
+	for (i = 0; i < len; i++)
+		count += sprintf(buf + count, "%s ",
+				 port->mode_info[port->mux_modes[i]].name);
+	if (!count)
+		count++;
+	buf[count - 1] = '\n';
+
+	return count;
+}
+
+static ssize_t mode_schedule_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct lego_sensor_device *sensor = to_lego_sensor_device(dev);
+	struct ev3_uart_port_data *port =
+		container_of(sensor, struct ev3_uart_port_data, sensor);
+	char name[LEGO_SENSOR_MODE_NAME_SIZE + 1];
+	u8 modes[EV3_UART_MUX_MAX];
+	int i, n, len = 0;
+
+	while (sscanf(buf, "%15s%n", name, &n) == 1) {
+		buf += n;
+		for (i = 0; i < sensor->num_modes; i++) {
+			if (!strcmp(name, port->mode_info[i].name))
+				break;
+		}
+		if (i >= sensor->num_modes || len >= EV3_UART_MUX_MAX)
+			return -EINVAL;
+		modes[len++] = i;
+	}
+
+	ACCESS_ONCE(port->mux_len) = 0;
+	if (!len)
+		return count;
+	if (!port->synced || !port->info_done)
+		return -ENODEV;
+
+	memcpy(port->mux_modes, modes, len);
+	port->mux_pos = 0;
+	port->mux_count = 0;
+	port->mux_miss = 0;
+	port->new_mode = modes[0];
+	smp_wmb();
+	ACCESS_ONCE(port->mux_len) = len;
+	if (port->data_mode != modes[0])
+		ev3_uart_send_select(port->tty, modes[0]);
+
+	return count;
+}
+
+static ssize_t mode_dwell_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct lego_sensor_device *sensor = to_lego_sensor_device(dev);
+	struct ev3_uart_port_data *port =
+		container_of(sensor, struct ev3_uart_port_data, sensor);
+
+	return sprintf(buf, "%u\n", port->mux_dwell);
+}
+
+static ssize_t mode_dwell_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct lego_sensor_device *sensor = to_lego_sensor_device(dev);
+	struct ev3_uart_port_data *port =
+		container_of(sensor, struct ev3_uart_port_data, sensor);
+	u8 value;
+	int err;
+
+	err = kstrtou8(buf, 0, &value);
+	if (err)
+		return err;
+	if (!value)
+		return -EINVAL;
+	port->mux_dwell = value;
+
+	return count;
+}
+
+static ssize_t max_speed_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct lego_sensor_device *sensor = to_lego_sensor_device(dev);
+	struct ev3_uart_port_data *port =
+		container_of(sensor, struct ev3_uart_port_data, sensor);
+
+	return sprintf(buf, "%u\n", port->max_speed);
+}
+
+static ssize_t max_speed_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct lego_sensor_device *sensor = to_lego_sensor_device(dev);
+	struct ev3_uart_port_data *port =
+		container_of(sensor, struct ev3_uart_port_data, sensor);
+	unsigned value;
+	int err;
+
+	err = kstrtouint(buf, 0, &value);
+	if (err)
+		return err;
+	if (value && (value < EV3_UART_SPEED_MIN
+		      || value > EV3_UART_SPEED_LIMIT))
+		return -EINVAL;
+	port->max_speed = value;
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(mode_schedule);
+static DEVICE_ATTR_RW(mode_dwell);
+static DEVICE_ATTR_RW(max_speed);
+
+struct ev3_uart_mode_data {
+	s64 timestamp;
+	u8 raw_data[LEGO_SENSOR_RAW_DATA_SIZE];
+} __packed;
+
+static ssize_t mode_data_read(struct file *file, struct kobject *kobj,
+			      struct bin_attribute *attr,
+			      char *buf, loff_t off, size_t count)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct lego_sensor_device *sensor = to_lego_sensor_device(dev);
+	struct ev3_uart_port_data *port =
+		container_of(sensor, struct ev3_uart_port_data, sensor);
+	struct ev3_uart_mode_data data[EV3_UART_MODE_MAX + 1];
+	size_t size = sensor->num_modes * sizeof(*data);
+	unsigned seq;
+	int i;
+
+	if (off >= size || !count)
+		return 0;
+	size -= off;
+	if (count < size)
+		size = count;
+
+	do {
+		seq = read_seqbegin(&port->data_seq);
+		for (i = 0; i < sensor->num_modes; i++) {
+			data[i].timestamp = ktime_to_ns(port->data_time[i]);
+			memcpy(data[i].raw_data, port->mode_info[i].raw_data,
+			       LEGO_SENSOR_RAW_DATA_SIZE);
+		}
+	} while (read_seqretry(&port->data_seq, seq));
+	memcpy(buf, (u8 *)data + off, size);
+
+	return size;
+}
+
+static BIN_ATTR_RO(mode_data, (EV3_UART_MODE_MAX + 1)
+			      * sizeof(struct ev3_uart_mode_data));
+
+/*
+ * Each command is a command byte (SELECT or WRITE), the number of data bytes
+ * and then the data bytes. Commands are queued in order until one does not
+ * fit in the transmit buffer. The number of bytes of the commands that were
+ * queued is returned so that the caller can try the rest again later.
+ */
+static ssize_t commands_write(struct file *file, struct kobject *kobj,
+			      struct bin_attribute *attr,
+			      char *buf, loff_t off, size_t count)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct lego_sensor_device *sensor = to_lego_sensor_device(dev);
+	struct ev3_uart_port_data *port =
+		container_of(sensor, struct ev3_uart_port_data, sensor);
+	const u8 *data = (const u8 *)buf;
+	unsigned long flags;
+	size_t pos = 0;
+	u8 cmd, len;
+	int err = 0;
+
+	if (off != 0)
+		return -EINVAL;
+	if (!port->synced || !port->info_done)
+		return -ENODEV;
+
+	spin_lock_irqsave(&port->tx_lock, flags);
+	while (pos < count) {
+		if (count - pos < 2) {
+			err = -EINVAL;
+			break;
+		}
+		cmd = data[pos];
+		len = data[pos + 1];
+		if (count - pos - 2 < len) {
+			err = -EINVAL;
+			break;
+		}
+		if (cmd == EV3_UART_CMD_SELECT) {
+			if (len != 1 || data[pos + 2] >= sensor->num_modes) {
+				err = -EINVAL;
+				break;
+			}
+		} else if (cmd != EV3_UART_CMD_WRITE || !len
+			   || len > EV3_UART_MAX_DATA_SIZE)
+		{
+			err = -EINVAL;
+			break;
+		}
+		err = ev3_uart_tx_queue(port, cmd, data + pos + 2, len);
+		if (err < 0)
+			break;
+		if (cmd == EV3_UART_CMD_SELECT) {
+			ACCESS_ONCE(port->mux_len) = 0;
+			port->new_mode = data[pos + 2];
+			/* DATA may follow any of the SELECTs in the batch */
+			__set_bit(port->new_mode, &port->queued_modes);
+		}
+		pos += len + 2;
+	}
+	if (pos)
+		ev3_uart_tx_flush(port);
+	spin_unlock_irqrestore(&port->tx_lock, flags);
+
+	return pos ? pos : err;
+}
+
+static BIN_ATTR(commands, S_IWUSR, NULL, commands_write,
+		EV3_UART_TX_BUFFER_SIZE);
+
+static struct attribute *ev3_uart_sensor_attrs[] = {
+	&dev_attr_mode_schedule.attr,
+	&dev_attr_mode_dwell.attr,
+	&dev_attr_max_speed.attr,
+	NULL
+};
+
+static struct bin_attribute *ev3_uart_sensor_bin_attrs[] = {
+	&bin_attr_mode_data,
+	&bin_attr_commands,
+	NULL
+};
+
+static const struct attribute_group ev3_uart_sensor_group = {
+	.attrs		= ev3_uart_sensor_attrs,
+	.bin_attrs	= ev3_uart_sensor_bin_attrs,
+};
+
+static const struct attribute_group *ev3_uart_sensor_groups[] = {
+	&ev3_uart_sensor_group,
+	NULL
+};
+
 static void ev3_uart_send_ack(struct work_struct *work)
 {
 	struct delayed_work *dwork = to_delayed_work(work);
 	struct ev3_uart_port_data *port = container_of(dwork,
 	        struct ev3_uart_port_data, send_ack_work);
+	s64 elapsed;
 	int err;
 
 	ev3_uart_write_byte(port->tty, EV3_UART_SYS_ACK);
+	port->ack_time = ktime_get();
+	port->data_after_ack = true;
+	port->handshake_ms = ktime_to_ms(ktime_sub(port->ack_time,
+						   port->sync_time));
 	if (!port->sensor.context && port->type_id <= EV3_UART_TYPE_MAX) {
 		port->sensor.context = port->tty;
 		err = register_lego_sensor(&port->sensor, port->tty->dev);
@@ -398,12 +1181,22 @@ static void ev3_uart_send_ack(struct work_struct *work)
 				port->tty->name);
 			return;
 		}
+		err = sysfs_create_groups(&port->sensor.dev.kobj,
+					  ev3_uart_sensor_groups);
+		if (err < 0)
+			dev_warn(&port->sensor.dev,
+				 "Could not create mode schedule attributes (%d)\n",
+				 err);
 	} else {
 		dev_err(port->tty->dev, "Reconnected due to: %s\n",
 			port->last_err);
 	}
 
-	mdelay(4);
+	/* give the sensor time to handle the ACK before changing speed */
+	elapsed = ktime_us_delta(ktime_get(), port->ack_time);
+	if (elapsed < EV3_UART_SPEED_CHANGE_DELAY)
+		usleep_range(EV3_UART_SPEED_CHANGE_DELAY - elapsed,
+			     EV3_UART_SPEED_CHANGE_DELAY - elapsed + 1000);
 	schedule_work(&port->change_bitrate_work);
 }
 
@@ -413,7 +1206,15 @@ static void ev3_uart_change_bitrate(struct work_struct *work)
 		container_of(work, struct ev3_uart_port_data,
 			     change_bitrate_work);
 	struct ktermios old_termios = port->tty->termios;
-
+	unsigned long flags;
+
+	/* commands queued for a sensor that we lost sync with are dropped */
+	if (!port->synced) {
+		spin_lock_irqsave(&port->tx_lock, flags);
+		port->tx_circ.tail = port->tx_circ.head;
+		port->queued_modes = 0;
+		spin_unlock_irqrestore(&port->tx_lock, flags);
+	}
 	tty_wait_until_sent(port->tty, 0);
 	down_write(&port->tty->termios_rwsem);
 	tty_encode_baud_rate(port->tty, port->new_baud_rate, port->new_baud_rate);
@@ -421,46 +1222,338 @@ static void ev3_uart_change_bitrate(struct work_struct *work)
 		port->tty->ops->set_termios(port->tty, &old_termios);
 	up_write(&port->tty->termios_rwsem);
 	if (port->info_done) {
+		port->ack_to_speed_us = ktime_us_delta(ktime_get(),
+						       port->ack_time);
+		port->last_data = ktime_get();
+		port->last_tx = ktime_set(0, 0);
 		hrtimer_start(&port->keep_alive_timer, ktime_set(0, 1000000),
 							HRTIMER_MODE_REL);
 	}
 }
 
-static void ev3_uart_send_keep_alive(unsigned long data)
-{
-	struct tty_struct *tty = (void *)data;
-
-	/* NACK is sent as a keep-alive */
-	ev3_uart_write_byte(tty, EV3_UART_SYS_NACK);
-}
-
+/*
+ * The keep-alive timer is a deadline for two things: sending the next NACK
+ * (unless some other command was sent in the mean time) and receiving the
+ * next DATA message. It sleeps until whichever comes first.
+ */
 enum hrtimer_restart ev3_uart_keep_alive_timer_callback(struct hrtimer *timer)
 {
 	struct ev3_uart_port_data *port =
 		container_of(timer, struct ev3_uart_port_data, keep_alive_timer);
+	ktime_t keep_alive = ns_to_ktime((u64)max(keep_alive_ms, 1U)
+					 * NSEC_PER_MSEC);
+	ktime_t data_timeout = ns_to_ktime((u64)max(data_timeout_ms, 1U)
+					   * NSEC_PER_MSEC);
+	ktime_t now = ktime_get();
+	ktime_t next_tx, next_data;
 
 	if (!port->synced || !port->info_done)
 		return HRTIMER_NORESTART;
 
-	hrtimer_forward_now(timer, ktime_set(0,
-			    EV3_UART_DATA_KEEP_ALIVE_TIMEOUT * 1000000));
-	if (!port->data_rec) {
-		port->last_err = "No data since last keep-alive.";
-		port->num_data_err++;
-		if (port->num_data_err > EV3_UART_MAX_DATA_ERR) {
-			port->synced = 0;
-			port->new_baud_rate = EV3_UART_SPEED_MIN;
-			schedule_work(&port->change_bitrate_work);
-			return HRTIMER_NORESTART;
+	next_data = ktime_add(port->last_data, data_timeout);
+	if (ktime_compare(now, next_data) >= 0
+	    || port->num_data_err > EV3_UART_MAX_DATA_ERR)
+	{
+		if (ktime_compare(now, next_data) >= 0) {
+			port->last_err = "No data before timeout.";
+			port->data_timeouts++;
 		}
+		port->synced = 0;
+		port->resyncs++;
+		port->new_baud_rate = EV3_UART_SPEED_MIN;
+		schedule_work(&port->change_bitrate_work);
+		return HRTIMER_NORESTART;
+	}
+
+	spin_lock(&port->tx_lock);
+	next_tx = ktime_add(port->last_tx, keep_alive);
+	if (CIRC_CNT(port->tx_circ.head, port->tx_circ.tail,
+		     EV3_UART_TX_BUFFER_SIZE))
+	{
+		/* commands are still going out, which is just as good */
+		port->nacks_skipped++;
+		next_tx = ktime_add(now, keep_alive);
+	} else if (ktime_compare(now, next_tx) >= 0) {
+		/* NACK is sent as a keep-alive */
+		ev3_uart_write_byte(port->tty, EV3_UART_SYS_NACK);
+		port->last_tx = now;
+		port->nacks_sent++;
+		next_tx = ktime_add(now, keep_alive);
+	} else {
+		port->nacks_skipped++;
 	}
-	port->data_rec = 0;
+	spin_unlock(&port->tx_lock);
 
-	tasklet_schedule(&port->keep_alive_tasklet);
+	hrtimer_set_expires(timer, ktime_compare(next_tx, next_data) < 0
+				   ? next_tx : next_data);
 
 	return HRTIMER_RESTART;
 }
 
+static struct ev3_uart_info_cache_entry *
+ev3_uart_info_cache_find(u8 type_id, u32 prefix_hash)
+{
+	int i;
+
+	for (i = 0; i < EV3_UART_INFO_CACHE_SIZE; i++) {
+		if (ev3_uart_info_cache[i].type_id == type_id
+		    && ev3_uart_info_cache[i].prefix_hash == prefix_hash)
+			return &ev3_uart_info_cache[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Saves the mode info of a sensor after all of the INFO has been received and
+ * acknowledged by the sensor.
+ */
+static void ev3_uart_info_cache_store(struct ev3_uart_port_data *port)
+{
+	struct ev3_uart_info_cache_entry *entry;
+	int i;
+
+	if (!info_cache || !port->info_prefix_done)
+		return;
+
+	mutex_lock(&ev3_uart_info_cache_mutex);
+	entry = ev3_uart_info_cache_find(port->type_id, port->info_prefix_hash);
+	if (entry && entry->hash != port->info_hash)
+		entry->early_ack_failed = 0;
+	if (!entry) {
+		entry = &ev3_uart_info_cache[0];
+		for (i = 1; i < EV3_UART_INFO_CACHE_SIZE; i++) {
+			if (!entry->type_id)
+				break;
+			if (!ev3_uart_info_cache[i].type_id
+			    || time_before(ev3_uart_info_cache[i].last_used,
+					   entry->last_used))
+				entry = &ev3_uart_info_cache[i];
+		}
+		entry->type_id = port->type_id;
+		entry->prefix_hash = port->info_prefix_hash;
+		entry->early_ack_failed = 0;
+	}
+	entry->hash = port->info_hash;
+	entry->baud_rate = port->new_baud_rate;
+	entry->num_modes = port->sensor.num_modes;
+	entry->num_view_modes = port->sensor.num_view_modes;
+	memcpy(entry->mode_info, port->mode_info, sizeof(entry->mode_info));
+	entry->last_used = jiffies;
+	mutex_unlock(&ev3_uart_info_cache_mutex);
+}
+
+/*
+ * Looks for a sensor that has the same INFO for the first mode. If there is
+ * one, the mode info of all modes is copied from the cache so that we can
+ * ACK without waiting for the rest of the INFO.
+ */
+static bool ev3_uart_info_cache_load(struct ev3_uart_port_data *port)
+{
+	struct ev3_uart_info_cache_entry *entry;
+	bool found = false;
+	int i;
+
+	if (!info_cache)
+		return false;
+
+	mutex_lock(&ev3_uart_info_cache_mutex);
+	entry = ev3_uart_info_cache_find(port->type_id, port->info_prefix_hash);
+	/* there is nothing to gain if the sensor stays at the minimum speed */
+	if (entry && !entry->early_ack_failed
+	    && entry->baud_rate > EV3_UART_SPEED_MIN)
+	{
+		port->new_baud_rate = entry->baud_rate;
+		port->sensor.num_modes = entry->num_modes;
+		port->sensor.num_view_modes = entry->num_view_modes;
+		port->sensor.mode = 0;
+		memcpy(port->mode_info, entry->mode_info,
+		       sizeof(port->mode_info));
+		entry->last_used = jiffies;
+		found = true;
+	}
+	mutex_unlock(&ev3_uart_info_cache_mutex);
+	for (i = 0; found && i < port->sensor.num_modes; i++)
+		ev3_uart_select_decoder(port, i);
+
+	return found;
+}
+
+static void ev3_uart_info_cache_early_ack_failed(struct ev3_uart_port_data *port)
+{
+	struct ev3_uart_info_cache_entry *entry;
+
+	mutex_lock(&ev3_uart_info_cache_mutex);
+	entry = ev3_uart_info_cache_find(port->type_id, port->info_prefix_hash);
+	if (entry)
+		entry->early_ack_failed = 1;
+	mutex_unlock(&ev3_uart_info_cache_mutex);
+}
+
+/*
+ * The LEGO EV3 color sensor sends bad checksums for RGB-RAW data (mode 4).
+ * The check here could be improved if someone can find a pattern.
+ */
+static bool ev3_uart_chksum_ok(struct ev3_uart_port_data *port,
+			       const u8 *msg, int msg_size)
+{
+	u8 chksum = 0xFF;
+	int i;
+
+	for (i = 0; i < msg_size - 1; i++)
+		chksum ^= msg[i];
+	debug_pr("chksum:%d, actual:%d\n", chksum, msg[msg_size - 1]);
+
+	return chksum == msg[msg_size - 1]
+		|| port->type_id == EV3_UART_TYPE_ID_COLOR || msg[0] == 0xDC;
+}
+
+/*
+ * While a mode change is pending, the sensor may still be sending the mode
+ * from a request that was replaced by a newer one. This includes the modes of
+ * earlier SELECTs written to the commands attribute.
+ */
+static bool ev3_uart_data_mode_ok(struct ev3_uart_port_data *port, u8 mode)
+{
+	if (mode == port->data_mode || mode == port->new_mode
+	    || test_bit(mode, &port->queued_modes))
+		return true;
+
+	return mode < port->sensor.num_modes
+		&& !completion_done(&port->set_mode_completion);
+}
+
+/*
+ * Selects the next mode of mode_schedule once enough DATA messages have been
+ * received in the current one.
+ */
+static void ev3_uart_mux_next(struct ev3_uart_port_data *port, u8 mode)
+{
+	unsigned len = ACCESS_ONCE(port->mux_len);
+	u8 target;
+
+	if (!len)
+		return;
+	smp_rmb();
+
+	target = port->mux_modes[port->mux_pos % len];
+	if (mode != target) {
+		/* the sensor may not have received the SELECT */
+		if (++port->mux_miss >= EV3_UART_MUX_RESEND) {
+			port->mux_miss = 0;
+			ev3_uart_send_select(port->tty, target);
+		}
+		return;
+	}
+	port->mux_miss = 0;
+	if (++port->mux_count < port->mux_dwell)
+		return;
+
+	port->mux_count = 0;
+	port->mux_pos = (port->mux_pos + 1) % len;
+	target = port->mux_modes[port->mux_pos];
+	if (target != mode) {
+		port->new_mode = target;
+		ev3_uart_send_select(port->tty, target);
+	}
+}
+
+static void ev3_uart_publish_data(struct ev3_uart_port_data *port, u8 mode,
+				  const u8 *data, int size)
+{
+	unsigned long flags;
+	s64 gap;
+
+	write_seqlock(&port->data_seq);
+	memcpy(port->mode_info[mode].raw_data, data, size);
+	ev3_uart_decode(port, mode);
+	port->data_time[mode] = ktime_get();
+	write_sequnlock(&port->data_seq);
+	gap = ktime_us_delta(port->data_time[mode], port->last_data);
+	if (gap > port->data_gap_max_us)
+		port->data_gap_max_us = gap;
+	port->last_data = port->data_time[mode];
+	if (port->data_after_ack) {
+		port->data_after_ack = false;
+		port->ack_to_data_us = ktime_us_delta(port->last_data,
+						      port->ack_time);
+	}
+	port->data_mode = mode;
+	port->sensor.mode = mode;
+	if (port->queued_modes && mode == port->new_mode) {
+		/* the last SELECT queued took effect, so the others are done */
+		spin_lock_irqsave(&port->tx_lock, flags);
+		if (mode == port->new_mode)
+			port->queued_modes = 0;
+		spin_unlock_irqrestore(&port->tx_lock, flags);
+	}
+	if (!completion_done(&port->set_mode_completion)
+	    && mode == port->new_mode)
+	{
+		complete(&port->set_mode_completion);
+		/* this is the first value in the new mode */
+		mod_delayed_work(system_wq, &port->set_mode_work, 0);
+	}
+	ev3_uart_mux_next(port, mode);
+	port->early_ack = 0;
+	if (port->num_data_err)
+		port->num_data_err--;
+}
+
+/*
+ * Parses DATA messages as they are received. Returns the number of bytes
+ * consumed. Parsing stops at the first byte that is not the start of a DATA
+ * message for the current (or requested) mode. That byte and everything
+ * after it is handled by ev3_uart_handle_rx_data() instead.
+ */
+static int ev3_uart_receive_data_msgs(struct ev3_uart_port_data *port,
+				      const unsigned char *cp, int count)
+{
+	int i = 0;
+	int size;
+	u8 mode;
+
+	if (!port->synced || !port->info_done)
+		return 0;
+
+	while (i < count) {
+		if (!port->rx_msg_len) {
+			/* see ev3_uart_handle_rx_data() */
+			if (cp[i] == 0xFF) {
+				i++;
+				continue;
+			}
+			if ((cp[i] & EV3_UART_MSG_TYPE_MASK) != EV3_UART_MSG_TYPE_DATA)
+				break;
+			mode = cp[i] & EV3_UART_MSG_CMD_MASK;
+			if (!ev3_uart_data_mode_ok(port, mode))
+				break;
+			port->rx_msg_size = ev3_uart_msg_size(cp[i]);
+			if (port->rx_msg_size > EV3_UART_MAX_MESSAGE_SIZE)
+				break;
+		}
+		size = min(count - i, port->rx_msg_size - port->rx_msg_len);
+		memcpy(port->rx_msg + port->rx_msg_len, cp + i, size);
+		port->rx_msg_len += size;
+		i += size;
+		if (port->rx_msg_len < port->rx_msg_size)
+			break;
+
+		port->rx_msg_len = 0;
+		if (!ev3_uart_chksum_ok(port, port->rx_msg, port->rx_msg_size)) {
+			port->last_err = "Bad checksum.";
+			port->rx_chksum_errs++;
+			port->num_data_err++;
+			continue;
+		}
+		port->rx_msgs++;
+		ev3_uart_publish_data(port, port->rx_msg[0] & EV3_UART_MSG_CMD_MASK,
+				      port->rx_msg + 1, port->rx_msg_size - 2);
+	}
+
+	return i;
+}
+
 static void ev3_uart_handle_rx_data(struct work_struct *work)
 {
 	struct ev3_uart_port_data *port =
@@ -503,17 +1596,27 @@ static void ev3_uart_handle_rx_data(struct work_struct *work)
 		chksum = 0xFF ^ cmd ^ type;
 		if ((u8)cb->buf[(cb->tail + 1) % EV3_UART_BUFFER_SIZE] != chksum)
 			continue;
+		if (port->early_ack) {
+			/* the sensor did not start sending DATA after the ACK */
+			ev3_uart_info_cache_early_ack_failed(port);
+			port->early_ack = 0;
+		}
 		port->sensor.num_modes = 1;
 		port->sensor.num_view_modes = 1;
-		for (i = 0; i <= EV3_UART_MODE_MAX; i++)
+		for (i = 0; i <= EV3_UART_MODE_MAX; i++) {
 			port->mode_info[i] = ev3_uart_default_mode_info;
+			port->decoder[i] = NULL;
+		}
 		port->type_id = type;
 		snprintf(port->device_name, LEGO_SENSOR_NAME_SIZE, "ev3-uart-%u", type);
 		port->info_flags = EV3_UART_INFO_FLAG_CMD_TYPE;
 		port->synced = 1;
 		port->info_done = 0;
-		port->data_rec = 0;
 		port->num_data_err = 0;
+		port->data_mode = 0;
+		port->sync_time = ktime_get();
+		port->info_hash = jhash_3words(cmd, type, chksum, 0);
+		port->info_prefix_done = 0;
 		cb->tail = (cb->tail + 2) % EV3_UART_BUFFER_SIZE;
 		count -= 2;
 	}
@@ -535,6 +1638,10 @@ static void ev3_uart_handle_rx_data(struct work_struct *work)
 			continue;
 		}
 		msg_size = ev3_uart_msg_size((u8)cb->buf[cb->tail]);
+		if (msg_size > EV3_UART_MAX_MESSAGE_SIZE) {
+			port->last_err = "Bad message size.";
+			goto err_invalid_state;
+		}
 		if (msg_size > count)
 			break;
 		size_to_end = CIRC_CNT_TO_END(cb->head, cb->tail, EV3_UART_BUFFER_SIZE);
@@ -555,30 +1662,14 @@ static void ev3_uart_handle_rx_data(struct work_struct *work)
 			printk("0x%02x ", message[i]);
 		printk(" (%d)\n", msg_size);
 #endif
-		if (msg_size > EV3_UART_MAX_MESSAGE_SIZE) {
-			port->last_err = "Bad message size.";
-			goto err_invalid_state;
-		}
 		msg_type = message[0] & EV3_UART_MSG_TYPE_MASK;
 		cmd = message[0] & EV3_UART_MSG_CMD_MASK;
 		mode = cmd;
 		cmd2 = message[1];
 		if (msg_size > 1) {
-			chksum = 0xFF;
-			for (i = 0; i < msg_size - 1; i++)
-				chksum ^= message[i];
-			debug_pr("chksum:%d, actual:%d\n",
-			         chksum, message[msg_size - 1]);
-			/*
-			 * The LEGO EV3 color sensor sends bad checksums
-			 * for RGB-RAW data (mode 4). The check here could be
-			 * improved if someone can find a pattern.
-			 */
-			if (chksum != message[msg_size - 1]
-			    && port->type_id != EV3_UART_TYPE_ID_COLOR
-			    && message[0] != 0xDC)
-			{
+			if (!ev3_uart_chksum_ok(port, message, msg_size)) {
 				port->last_err = "Bad checksum.";
+				port->rx_chksum_errs++;
 				if (port->info_done) {
 					port->num_data_err++;
 					goto err_bad_data_msg_checksum;
@@ -586,6 +1677,23 @@ static void ev3_uart_handle_rx_data(struct work_struct *work)
 					goto err_invalid_state;
 			}
 		}
+		port->rx_msgs++;
+		if (port->early_ack && msg_type != EV3_UART_MSG_TYPE_DATA) {
+			/*
+			 * The rest of the INFO that was sent before the sensor
+			 * saw the early ACK is ignored. If it starts over with
+			 * TYPE, it did not accept the ACK.
+			 */
+			if (msg_type != EV3_UART_MSG_TYPE_CMD
+			    || cmd != EV3_UART_CMD_TYPE)
+				continue;
+			ev3_uart_info_cache_early_ack_failed(port);
+			port->early_ack = 0;
+			port->last_err = "Early ACK was not accepted.";
+			goto err_invalid_state;
+		}
+		if (!port->info_done)
+			port->info_hash = jhash(message, msg_size, port->info_hash);
 		switch (msg_type) {
 		case EV3_UART_MSG_TYPE_SYS:
 			debug_pr("SYS:%d\n", message[0] & EV3_UART_MSG_CMD_MASK);
@@ -606,6 +1714,7 @@ static void ev3_uart_handle_rx_data(struct work_struct *work)
 					port->last_err = "Did not receive all required INFO.";
 					goto err_invalid_state;
 				}
+				ev3_uart_info_cache_store(port);
 				schedule_delayed_work(&port->send_ack_work,
 						      msecs_to_jiffies(EV3_UART_SEND_ACK_DELAY));
 				port->info_done = 1;
@@ -643,7 +1752,8 @@ static void ev3_uart_handle_rx_data(struct work_struct *work)
 				}
 				speed = *(int*)(message + 1);
 				if (speed < EV3_UART_SPEED_MIN
-				    || speed > EV3_UART_SPEED_MAX)
+				    || speed > EV3_UART_SPEED_LIMIT
+				    || speed > (port->max_speed ?: max_speed))
 				{
 					port->last_err = "Speed is out of range.";
 					goto err_invalid_state;
@@ -841,6 +1951,19 @@ static void ev3_uart_handle_rx_data(struct work_struct *work)
 				debug_pr("si_min: %d, si_max: %d\n",
 					 port->mode_info[mode].si_min,
 					 port->mode_info[mode].si_max);
+				ev3_uart_select_decoder(port, mode);
+				if (port->info_prefix_done)
+					break;
+				port->info_prefix_hash = port->info_hash;
+				port->info_prefix_done = 1;
+				if (ev3_uart_info_cache_load(port)) {
+					debug_pr("using cached INFO for type %d\n",
+						 port->type_id);
+					port->early_ack = 1;
+					port->info_done = 1;
+					schedule_delayed_work(&port->send_ack_work, 0);
+					return;
+				}
 				break;
 			}
 			break;
@@ -854,30 +1977,34 @@ static void ev3_uart_handle_rx_data(struct work_struct *work)
 				port->last_err = "Invalid mode received.";
 				goto err_invalid_state;
 			}
-			if (mode != port->sensor.mode) {
-				if (mode == port->new_mode)
-					port->sensor.mode = mode;
-				else {
-					port->last_err = "Unexpected mode.";
-					goto err_invalid_state;
-				}
+			if (!ev3_uart_data_mode_ok(port, mode)) {
+				port->last_err = "Unexpected mode.";
+				goto err_invalid_state;
 			}
-			if (!completion_done(&port->set_mode_completion)
-			    && mode == port->new_mode)
-				complete(&port->set_mode_completion);
-			memcpy(port->mode_info[mode].raw_data, message + 1, msg_size - 2);
-			port->data_rec = 1;
-			if (port->num_data_err)
-				port->num_data_err--;
+			ev3_uart_publish_data(port, mode, message + 1, msg_size - 2);
 			break;
 		}
 err_bad_data_msg_checksum:
 		count = CIRC_CNT(cb->head, cb->tail, EV3_UART_BUFFER_SIZE);
 	}
+
+	/*
+	 * Once everything has been handled, the DATA messages that follow can
+	 * be parsed directly in receive_buf again.
+	 */
+	spin_lock(&port->rx_lock);
+	if (port->synced && port->info_done
+	    && !CIRC_CNT(cb->head, cb->tail, EV3_UART_BUFFER_SIZE))
+	{
+		port->rx_msg_len = 0;
+		port->rx_deferred = false;
+	}
+	spin_unlock(&port->rx_lock);
 	return;
 
 err_invalid_state:
 	port->synced = 0;
+	port->resyncs++;
 	port->new_baud_rate = EV3_UART_SPEED_MIN;
 	schedule_work(&port->change_bitrate_work);
 }
@@ -914,16 +2041,55 @@ static int ev3_uart_open(struct tty_struct *tty)
 	port->sensor.set_mode = ev3_uart_set_mode;
 	port->sensor.write_data = ev3_uart_write_data;
 	port->circ_buf.buf = port->buffer;
+	spin_lock_init(&port->rx_lock);
+	port->rx_deferred = true;
+	port->tx_circ.buf = port->tx_buffer;
+	spin_lock_init(&port->tx_lock);
+	seqlock_init(&port->data_seq);
+	port->mux_dwell = 1;
 	INIT_WORK(&port->rx_data_work, ev3_uart_handle_rx_data);
 	INIT_DELAYED_WORK(&port->send_ack_work, ev3_uart_send_ack);
 	INIT_WORK(&port->change_bitrate_work, ev3_uart_change_bitrate);
+	INIT_DELAYED_WORK(&port->set_mode_work, ev3_uart_set_mode_work);
+	INIT_WORK(&port->tx_work, ev3_uart_tx_work);
 	hrtimer_init(&port->keep_alive_timer, HRTIMER_BASE_MONOTONIC, HRTIMER_MODE_REL);
 	port->keep_alive_timer.function = ev3_uart_keep_alive_timer_callback;
-	tasklet_init(&port->keep_alive_tasklet, ev3_uart_send_keep_alive,
-		     (unsigned long)tty);
 	init_completion(&port->set_mode_completion);
 	tty->disc_data = port;
 
+	port->debugfs = debugfs_create_dir(port->sensor.port_name,
+					   ev3_uart_debugfs);
+	if (!IS_ERR_OR_NULL(port->debugfs)) {
+		debugfs_create_u32("rx_bytes", S_IRUGO, port->debugfs,
+				   &port->rx_bytes);
+		debugfs_create_u32("rx_msgs", S_IRUGO, port->debugfs,
+				   &port->rx_msgs);
+		debugfs_create_u32("rx_chksum_errs", S_IRUGO, port->debugfs,
+				   &port->rx_chksum_errs);
+		debugfs_create_u32("rx_overruns", S_IRUGO, port->debugfs,
+				   &port->rx_overruns);
+		debugfs_create_u32("resyncs", S_IRUGO, port->debugfs,
+				   &port->resyncs);
+		debugfs_create_u32("nacks_sent", S_IRUGO, port->debugfs,
+				   &port->nacks_sent);
+		debugfs_create_u32("nacks_skipped", S_IRUGO, port->debugfs,
+				   &port->nacks_skipped);
+		debugfs_create_u32("data_timeouts", S_IRUGO, port->debugfs,
+				   &port->data_timeouts);
+		debugfs_create_u32("data_gap_max_us", S_IRUGO, port->debugfs,
+				   &port->data_gap_max_us);
+		debugfs_create_u32("tx_msgs", S_IRUGO, port->debugfs,
+				   &port->tx_msgs);
+		debugfs_create_u32("tx_full", S_IRUGO, port->debugfs,
+				   &port->tx_full);
+		debugfs_create_u32("handshake_ms", S_IRUGO, port->debugfs,
+				   &port->handshake_ms);
+		debugfs_create_u32("ack_to_speed_us", S_IRUGO, port->debugfs,
+				   &port->ack_to_speed_us);
+		debugfs_create_u32("ack_to_data_us", S_IRUGO, port->debugfs,
+				   &port->ack_to_data_us);
+	}
+
 	/* set baud rate and other port settings */
 	down_write(&tty->termios_rwsem);
 	tty->termios.c_iflag &=
@@ -950,9 +2116,12 @@ static int ev3_uart_open(struct tty_struct *tty)
 
 	/* 2400 baud, 8bits, no parity, 1 stop */
 	tty->termios.c_cflag = B2400 | CS8 | CREAD | HUPCL | CLOCAL;
-	tty->ops->set_termios(tty, &old_termios);
+	if (tty->ops->set_termios)
+		tty->ops->set_termios(tty, &old_termios);
 	up_write(&tty->termios_rwsem);
-	tty->ops->tiocmset(tty, 0, ~0); /* clear all */
+	/* pseudo-terminals don't have modem control lines */
+	if (tty->ops->tiocmset)
+		tty->ops->tiocmset(tty, 0, ~0); /* clear all */
 
 	tty->receive_room = 65536;
 	tty->port->low_latency = 1; // does not do anything since kernel 3.12
@@ -975,13 +2144,17 @@ static void ev3_uart_close(struct tty_struct *tty)
 	cancel_work_sync(&port->rx_data_work);
 	cancel_delayed_work_sync(&port->send_ack_work);
 	cancel_work_sync(&port->change_bitrate_work);
+	cancel_delayed_work_sync(&port->set_mode_work);
 	hrtimer_cancel(&port->keep_alive_timer);
-	tasklet_kill(&port->keep_alive_tasklet);
+	cancel_work_sync(&port->tx_work);
 	if (port->sensor.context) {
+		sysfs_remove_groups(&port->sensor.dev.kobj,
+				    ev3_uart_sensor_groups);
 		unregister_lego_sensor(&port->sensor);
 	}
 	if (port->in_port)
 		put_device(&port->in_port->dev);
+	debugfs_remove_recursive(port->debugfs);
 	tty->disc_data = NULL;
 	kfree(port);
 }
@@ -1002,8 +2175,29 @@ static void ev3_uart_receive_buf(struct tty_struct *tty,
 	if (port->closing)
 		return;
 
-	if (count > CIRC_SPACE(cb->head, cb->tail, EV3_UART_BUFFER_SIZE))
-		return;
+	port->rx_bytes += count;
+
+	spin_lock(&port->rx_lock);
+	if (!port->rx_deferred) {
+		spin_unlock(&port->rx_lock);
+		size = ev3_uart_receive_data_msgs(port, cp, count);
+		cp += size;
+		count -= size;
+		if (!count)
+			return;
+		spin_lock(&port->rx_lock);
+		port->rx_deferred = true;
+	}
+
+	/*
+	 * If the worker has fallen behind, keep as much as fits. The message
+	 * that is cut off will fail the checksum and we will resync if needed.
+	 */
+	size = CIRC_SPACE(cb->head, cb->tail, EV3_UART_BUFFER_SIZE);
+	if (count > size) {
+		port->rx_overruns += count - size;
+		count = size;
+	}
 
 	size = CIRC_SPACE_TO_END(cb->head, cb->tail, EV3_UART_BUFFER_SIZE);
 	if (count > size) {
@@ -1014,13 +2208,23 @@ static void ev3_uart_receive_buf(struct tty_struct *tty,
 		memcpy(cb->buf + cb->head, cp, count);
 		cb->head += count;
 	}
+	spin_unlock(&port->rx_lock);
 
-	schedule_work(&port->rx_data_work);
+	queue_work(ev3_uart_rx_wq, &port->rx_data_work);
 }
 
+/*
+ * This can be called from the interrupt handler of the tty with its locks
+ * held, so the transmit buffer is not written to the tty from here.
+ */
 static void ev3_uart_write_wakeup(struct tty_struct *tty)
 {
+	struct ev3_uart_port_data *port = tty->disc_data;
+
 	debug_pr("%s\n", __func__);
+
+	if (!port->closing)
+		schedule_work(&port->tx_work);
 }
 
 static struct tty_ldisc_ops ev3_uart_ldisc = {
@@ -1038,10 +2242,20 @@ static int __init ev3_uart_init(void)
 {
 	int err;
 
+	ev3_uart_rx_wq = alloc_workqueue("ev3-uart-rx", WQ_HIGHPRI, 0);
+	if (!ev3_uart_rx_wq)
+		return -ENOMEM;
+
+	ev3_uart_debugfs = debugfs_create_dir("ev3-uart", NULL);
+	if (IS_ERR(ev3_uart_debugfs))
+		ev3_uart_debugfs = NULL;
+
 	err = tty_register_ldisc(N_LEGOEV3, &ev3_uart_ldisc);
 	if (err) {
 		pr_err("Could not register EV3 UART sensor line discipline. (%d)\n",
 			err);
+		debugfs_remove_recursive(ev3_uart_debugfs);
+		destroy_workqueue(ev3_uart_rx_wq);
 		return err;
 	}
 
@@ -1059,6 +2273,8 @@ static void __exit ev3_uart_exit(void)
 	if (err)
 		pr_err("Could not unregister EV3 UART sensor line discipline. (%d)\n",
 			err);
+	debugfs_remove_recursive(ev3_uart_debugfs);
+	destroy_workqueue(ev3_uart_rx_wq);
 }
 module_exit(ev3_uart_exit);
 
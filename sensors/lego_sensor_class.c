@@ -91,7 +91,10 @@
  * .
  * `mode` (read/write)
  * : Returns the current mode. Writing one of the values returned by `modes`
- *   sets the sensor to that mode.
+ *   sets the sensor to that mode. Drivers that change the mode in the
+ *   background (e.g. UART sensors with `async_set_mode`) notify `poll()`
+ *   on this attribute once the first value in the new mode is available or
+ *   when the change failed, in which case the old mode is returned.
  * .
  * `modes` (read-only)
  * : Returns a space separated list of the valid modes for the sensor.
@@ -652,6 +655,12 @@ void unregister_lego_sensor(struct lego_sensor_device *sensor)
 }
 EXPORT_SYMBOL_GPL(unregister_lego_sensor);
 
+void lego_sensor_notify_mode_change(struct lego_sensor_device *sensor)
+{
+	sysfs_notify(&sensor->dev.kobj, NULL, "mode");
+}
+EXPORT_SYMBOL_GPL(lego_sensor_notify_mode_change);
+
 static int lego_sensor_dev_uevent(struct device *dev,
 				  struct kobj_uevent_env *env)
 {
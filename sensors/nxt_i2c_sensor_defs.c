@@ -15,6 +15,7 @@
  */
 
 #include <linux/i2c.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
 
 #include <lego_port_class.h>
@@ -28,36 +29,96 @@
 
 /* mindsensors.com 8-channel servo motor controller implementation */
 
+#define MS_8CH_SERVO_NUM_CH		8
+#define MS_8CH_SERVO_POSITION_REG	0x42
+#define MS_8CH_SERVO_RATE_REG		0x52
+
 struct ms_8ch_servo_data {
 	int id;
 	char port_name[LEGO_PORT_NAME_SIZE + 1];
-	struct nxt_i2c_sensor_data *sensor;
+	struct ms_8ch_servo_ctrl *ctrl;
 	struct servo_motor_device servo;
 };
 
+/*
+ * The position registers of all channels are contiguous, so we keep a copy of
+ * the last values written in order to update any subset of channels with a
+ * single block write.
+ */
+struct ms_8ch_servo_ctrl {
+	struct nxt_i2c_sensor_data *sensor;
+	struct servo_motor_group group;
+	struct mutex lock;
+	u16 pulse[MS_8CH_SERVO_NUM_CH];
+	struct ms_8ch_servo_data servos[MS_8CH_SERVO_NUM_CH];
+};
+
 static int ms_8ch_servo_get_position(void* context)
 {
 	struct ms_8ch_servo_data *servo = context;
-	struct i2c_client *client = servo->sensor->client;
+	struct i2c_client *client = servo->ctrl->sensor->client;
 
-	return i2c_smbus_read_word_data(client, 0x42 + servo->id * 2);
+	return i2c_smbus_read_word_data(client,
+				MS_8CH_SERVO_POSITION_REG + servo->id * 2);
 }
 
 static int ms_8ch_servo_set_position(void* context, int value)
 {
 	struct ms_8ch_servo_data *servo = context;
-	struct i2c_client *client = servo->sensor->client;
+	struct ms_8ch_servo_ctrl *ctrl = servo->ctrl;
+	struct i2c_client *client = ctrl->sensor->client;
+	int ret;
+
+	mutex_lock(&ctrl->lock);
+	ret = i2c_smbus_write_word_data(client,
+				MS_8CH_SERVO_POSITION_REG + servo->id * 2, value);
+	if (!ret)
+		ctrl->pulse[servo->id] = value;
+	mutex_unlock(&ctrl->lock);
+
+	return ret;
+}
 
-	return i2c_smbus_write_word_data(client, 0x42 + servo->id * 2, value);
+static int ms_8ch_servo_set_positions(void *context, unsigned long mask,
+				      const int *positions)
+{
+	struct ms_8ch_servo_ctrl *ctrl = context;
+	struct i2c_client *client = ctrl->sensor->client;
+	u8 buf[MS_8CH_SERVO_NUM_CH * 2];
+	u16 pulse[MS_8CH_SERVO_NUM_CH];
+	int first, last, i, ret;
+
+	first = find_first_bit(&mask, MS_8CH_SERVO_NUM_CH);
+	if (first >= MS_8CH_SERVO_NUM_CH)
+		return 0;
+	last = find_last_bit(&mask, MS_8CH_SERVO_NUM_CH);
+
+	mutex_lock(&ctrl->lock);
+	memcpy(pulse, ctrl->pulse, sizeof(pulse));
+	for_each_set_bit(i, &mask, MS_8CH_SERVO_NUM_CH)
+		pulse[i] = positions[i];
+	for (i = first; i <= last; i++) {
+		buf[(i - first) * 2] = pulse[i] & 0xFF;
+		buf[(i - first) * 2 + 1] = pulse[i] >> 8;
+	}
+	ret = i2c_smbus_write_i2c_block_data(client,
+			MS_8CH_SERVO_POSITION_REG + first * 2,
+			(last - first + 1) * 2, buf);
+	if (!ret)
+		memcpy(ctrl->pulse, pulse, sizeof(pulse));
+	mutex_unlock(&ctrl->lock);
+
+	return ret;
 }
 
 static int ms_8ch_servo_get_rate(void* context)
 {
 	struct ms_8ch_servo_data *servo = context;
-	struct i2c_client *client = servo->sensor->client;
+	struct i2c_client *client = servo->ctrl->sensor->client;
 	int ret;
 
-	ret = i2c_smbus_read_word_data(client, 0x52 + servo->id);
+	ret = i2c_smbus_read_word_data(client,
+				       MS_8CH_SERVO_RATE_REG + servo->id);
 	if (ret < 0)
 		return ret;
 
@@ -69,7 +130,7 @@ static int ms_8ch_servo_get_rate(void* context)
 static int ms_8ch_servo_set_rate(void* context, unsigned value)
 {
 	struct ms_8ch_servo_data *servo = context;
-	struct i2c_client *client = servo->sensor->client;
+	struct i2c_client *client = servo->ctrl->sensor->client;
 	int scaled;
 
 	if (value >= 24000)
@@ -79,23 +140,40 @@ static int ms_8ch_servo_set_rate(void* context, unsigned value)
 	else
 		scaled = 24000 / value;
 
-	return i2c_smbus_write_word_data(client, 0x52 + servo->id * 2, scaled);
+	return i2c_smbus_write_word_data(client,
+				MS_8CH_SERVO_RATE_REG + servo->id * 2, scaled);
 }
 
 static int ms_8ch_servo_probe_cb(struct nxt_i2c_sensor_data *data)
 {
+	struct ms_8ch_servo_ctrl *ctrl;
 	struct ms_8ch_servo_data *servos;
+	u8 buf[MS_8CH_SERVO_NUM_CH * 2];
 	int i, err;
 
-	servos = kzalloc(sizeof(struct ms_8ch_servo_data) * 8, GFP_KERNEL);
-	if (IS_ERR(servos)) {
-		dev_err(&data->client->dev, "Error allocating servos. %ld",
-			PTR_ERR(servos));
-		return PTR_ERR(servos);
+	ctrl = kzalloc(sizeof(struct ms_8ch_servo_ctrl), GFP_KERNEL);
+	if (!ctrl) {
+		dev_err(&data->client->dev, "Error allocating servos.");
+		return -ENOMEM;
 	}
-	for (i = 0; i < 8; i++) {
+	ctrl->sensor = data;
+	mutex_init(&ctrl->lock);
+	servo_motor_group_init(&ctrl->group);
+	ctrl->group.ops.set_positions = ms_8ch_servo_set_positions;
+	ctrl->group.context = ctrl;
+	ctrl->group.num_servos = MS_8CH_SERVO_NUM_CH;
+
+	err = i2c_smbus_read_i2c_block_data(data->client,
+			MS_8CH_SERVO_POSITION_REG, sizeof(buf), buf);
+	if (err == sizeof(buf)) {
+		for (i = 0; i < MS_8CH_SERVO_NUM_CH; i++)
+			ctrl->pulse[i] = buf[i * 2] | (buf[i * 2 + 1] << 8);
+	}
+
+	servos = ctrl->servos;
+	for (i = 0; i < MS_8CH_SERVO_NUM_CH; i++) {
 		servos[i].id = i;
-		servos[i].sensor = data;
+		servos[i].ctrl = ctrl;
 		servos[i].servo.name = data->sensor.name;
 		snprintf(servos[i].port_name, SERVO_MOTOR_NAME_SIZE,
 			 "%s:sv%d", data->sensor.port_name, i + 1);
@@ -105,6 +183,11 @@ static int ms_8ch_servo_probe_cb(struct nxt_i2c_sensor_data *data)
 		servos[i].servo.ops.get_rate = ms_8ch_servo_get_rate;
 		servos[i].servo.ops.set_rate = ms_8ch_servo_set_rate;
 		servos[i].servo.context = &servos[i];
+		servos[i].servo.group = &ctrl->group;
+		servos[i].servo.group_index = i;
+		ctrl->group.servos[i] = &servos[i].servo;
+	}
+	for (i = 0; i < MS_8CH_SERVO_NUM_CH; i++) {
 		err = register_servo_motor(&servos[i].servo, &data->client->dev);
 		if (err)
 			break;
@@ -112,11 +195,11 @@ static int ms_8ch_servo_probe_cb(struct nxt_i2c_sensor_data *data)
 	if (err < 0) {
 		for (i--; i >= 0; i--)
 			unregister_servo_motor(&servos[i].servo);
-		kfree(servos);
+		kfree(ctrl);
 		dev_err(&data->client->dev, "Error registering servos. %d", err);
 		return err;
 	}
-	data->info.callback_data = servos;
+	data->info.callback_data = ctrl;
 	data->poll_ms = 1000;
 
 	return 0;
@@ -124,13 +207,13 @@ static int ms_8ch_servo_probe_cb(struct nxt_i2c_sensor_data *data)
 
 static void ms_8ch_servo_remove_cb(struct nxt_i2c_sensor_data *data)
 {
-	struct ms_8ch_servo_data *servos = data->info.callback_data;
+	struct ms_8ch_servo_ctrl *ctrl = data->info.callback_data;
 	int i;
 
-	if (servos) {
-		for (i = 0; i < 8; i++)
-			unregister_servo_motor(&servos[i].servo);
-		kfree(servos);
+	if (ctrl) {
+		for (i = 0; i < MS_8CH_SERVO_NUM_CH; i++)
+			unregister_servo_motor(&ctrl->servos[i].servo);
+		kfree(ctrl);
 	}
 }
 
@@ -0,0 +1,410 @@
+#!/usr/bin/env python3
+#
+# Test bench for the LEGO MINDSTORMS EV3 UART sensor line discipline
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed "as is" WITHOUT ANY WARRANTY of any
+# kind, whether express or implied; without even the implied warranty
+# of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+"""Measures the EV3 UART sensor line discipline using an emulated sensor.
+
+An emulated sensor (see ev3_uart_emu.py) is connected to the line discipline
+through a pseudo-terminal. The tests are:
+
+handshake  time from TYPE to the ACK of the host, the handshake_ms counter in
+           debugfs and the time until the sensor is in sysfs
+latency    time from writing a DATA message to its timestamp in mode_data and
+           until it can be read from bin_data
+rate       the most DATA messages per second that are received without loss,
+           overruns or resyncs
+resync     what happens when DATA is corrupted: whether the host resyncs and
+           how long it takes until new data is received again
+early_ack  a sensor that ignores the early ACK from the INFO cache still
+           connects and the cache does not ACK it early again
+
+This needs root, the ev3_uart_sensor_ld module and debugfs mounted at
+/sys/kernel/debug. The exit status is 1 if any test failed.
+"""
+
+import argparse
+import glob
+import os
+import statistics
+import struct
+import sys
+import time
+
+import ev3_uart_emu as emu_mod
+from ev3_uart_emu import Emulator, now_ns
+
+DEBUGFS = '/sys/kernel/debug/ev3-uart'
+SENSOR_CLASS = '/sys/class/lego-sensor'
+
+# see ev3_uart_sensor_ld.c
+MODE_DATA_RECORD = 40
+MAX_DATA_ERR = 6
+COLOR_TYPE_ID = 29
+
+TESTS = ('handshake', 'latency', 'rate', 'resync', 'early_ack')
+
+
+class Bench:
+    def __init__(self, sensor, speed, pace):
+        self.sensor = sensor
+        self.master, self.slave, self.name = emu_mod.open_pty()
+        emu_mod.set_ldisc(self.slave, emu_mod.N_LEGOEV3)
+        self.emu = Emulator(self.master, sensor, speed=speed, pace=pace)
+        self.emu.start()
+        self.failed = []
+
+    def close(self):
+        self.emu.stop()
+        emu_mod.set_ldisc(self.slave, emu_mod.N_TTY)
+        os.close(self.slave)
+        os.close(self.master)
+
+    def fail(self, msg):
+        print('FAIL: ' + msg)
+        self.failed.append(msg)
+
+    def counters(self):
+        path = os.path.join(DEBUGFS, self.name)
+        values = {}
+        for name in os.listdir(path):
+            with open(os.path.join(path, name)) as f:
+                values[name] = int(f.read())
+        return values
+
+    def sensor_dir(self, timeout=0.0):
+        """The lego-sensor class device of the emulated sensor."""
+        end = time.monotonic() + timeout
+        while True:
+            for path in glob.glob(os.path.join(SENSOR_CLASS, '*')):
+                try:
+                    with open(os.path.join(path, 'port_name')) as f:
+                        if f.read().strip() == self.name:
+                            return path
+                except OSError:
+                    pass
+            if time.monotonic() >= end:
+                return None
+            time.sleep(0.001)
+
+    def reconnect(self):
+        """Attaches the line discipline again and restarts the sensor, as if
+        it was unplugged and plugged in again."""
+        emu_mod.set_ldisc(self.slave, emu_mod.N_TTY)
+        emu_mod.set_ldisc(self.slave, emu_mod.N_LEGOEV3)
+        self.emu.restart()
+
+    def mode_data(self, fd, mode):
+        record = os.pread(fd, MODE_DATA_RECORD,
+                          mode * MODE_DATA_RECORD)
+        return struct.unpack_from('<q', record)[0], record[8:]
+
+    def wait_data(self, fd, mode, after, timeout=5.0):
+        """Waits for data in @mode received after @after. Returns its
+        timestamp or None."""
+        end = time.monotonic() + timeout
+        while time.monotonic() < end:
+            ts, _ = self.mode_data(fd, mode)
+            if ts > after:
+                return ts
+            time.sleep(0.0005)
+        return None
+
+
+def percentiles(values):
+    values = sorted(values)
+    if not values:
+        return 'no samples'
+    p99 = values[min(len(values) - 1, int(len(values) * 0.99))]
+    return 'min %.0f median %.0f p99 %.0f max %.0f' % (
+        values[0], statistics.median(values), p99, values[-1])
+
+
+def test_handshake(bench, args):
+    print('== handshake (%d times)' % args.iterations)
+    emu = bench.emu
+    for i in range(args.iterations):
+        start = now_ns()
+        bench.reconnect()
+        if not emu.wait_synced(timeout=10):
+            bench.fail('handshake %d did not finish' % i)
+            return
+        path = bench.sensor_dir(timeout=2)
+        visible = (now_ns() - start) / 1e6
+        if not path:
+            bench.fail('handshake %d: sensor did not show up in sysfs' % i)
+            return
+        # let the first DATA arrive for ack_to_data_us
+        time.sleep(0.05)
+        c = bench.counters()
+        print('%2d: TYPE to ACK %.1f ms, handshake_ms %d, in sysfs after '
+              '%.1f ms, ACK to speed %d us, ACK to DATA %d us'
+              % (i, emu.handshake_ns / 1e6, c['handshake_ms'], visible,
+                 c['ack_to_speed_us'], c['ack_to_data_us']))
+
+
+def test_latency(bench, args):
+    print('== latency (%d DATA messages)' % args.iterations)
+    emu = bench.emu
+    path = bench.sensor_dir()
+    if not path or not emu.synced:
+        bench.fail('latency: sensor is not connected')
+        return
+    mode = emu.sensor.modes[emu.mode]
+    size = mode.data_size
+    rate = emu.rate
+    emu.rate = 0
+    kernel, visible, lost = [], [], 0
+    bin_fd = os.open(os.path.join(path, 'bin_data'), os.O_RDONLY)
+    mode_fd = os.open(os.path.join(path, 'mode_data'), os.O_RDONLY)
+    try:
+        for i in range(args.iterations):
+            # values that differ from the previous one
+            value = i % 100 + 1
+            payload = mode.pack(value)
+            if os.pread(bin_fd, size, 0) == payload[:size]:
+                value += 100
+                payload = mode.pack(value)
+            sent = emu.send_data(value=value, mode=emu.mode)
+            end = time.monotonic() + 0.5
+            while os.pread(bin_fd, size, 0) != payload[:size]:
+                if time.monotonic() > end:
+                    break
+            else:
+                seen = now_ns()
+                ts, _ = bench.mode_data(mode_fd, emu.mode)
+                kernel.append((ts - sent) / 1e3)
+                visible.append((seen - sent) / 1e3)
+                time.sleep(0.002)
+                continue
+            lost += 1
+    finally:
+        os.close(bin_fd)
+        os.close(mode_fd)
+        emu.rate = rate
+    print('write to mode_data timestamp (us): ' + percentiles(kernel))
+    print('write to bin_data (us):            ' + percentiles(visible))
+    if lost:
+        bench.fail('latency: %d of %d DATA messages never showed up in '
+                   'bin_data' % (lost, args.iterations))
+
+
+def test_rate(bench, args):
+    print('== rate (%.1f s per step)' % args.duration)
+    emu = bench.emu
+    frame = len(emu.frame(value=0))
+    print('%d byte DATA messages, %d per second fit in %d baud'
+          % (frame, emu.speed // 10 // frame, emu.speed))
+    pace, rate = emu.pace, emu.rate
+    # a pseudo-terminal has no baud rate, so go as fast as we are asked to
+    emu.pace = False
+    best = 0
+    try:
+        for step in args.rates:
+            if not emu.wait_synced(timeout=10):
+                bench.fail('rate: sensor did not sync again')
+                return
+            c0, sent0 = bench.counters(), emu.frames_sent
+            start = time.monotonic()
+            emu.rate = step
+            time.sleep(args.duration)
+            emu.rate = 0
+            elapsed = time.monotonic() - start
+            time.sleep(0.05)
+            c1, sent = bench.counters(), emu.frames_sent - sent0
+            d = {k: c1[k] - c0[k] for k in c0}
+            ok = (d['rx_msgs'] == sent and not d['rx_overruns']
+                  and not d['resyncs'] and not d['rx_chksum_errs'])
+            print('%6d/s: sent %d (%.0f/s), received %d, overruns %d, '
+                  'checksum errors %d, resyncs %d, max gap %d us%s'
+                  % (step, sent, sent / elapsed, d['rx_msgs'],
+                     d['rx_overruns'], d['rx_chksum_errs'], d['resyncs'],
+                     c1['data_gap_max_us'], '' if ok else '  LOSS'))
+            if not ok:
+                break
+            best = sent / elapsed
+    finally:
+        emu.pace, emu.rate = pace, rate
+    print('max sustainable rate: %.0f DATA messages per second' % best)
+    if best < args.min_rate:
+        bench.fail('rate: %.0f/s is less than %d/s' % (best, args.min_rate))
+
+
+def _resync_case(bench, mode_fd, count, kind, expect_resync, args):
+    emu = bench.emu
+    if not emu.wait_synced(timeout=10):
+        bench.fail('resync: sensor did not sync again')
+        return
+    # a clean start for the error count in the driver
+    time.sleep(0.2)
+    c0, handshakes = bench.counters(), emu.handshakes
+    start = now_ns()
+    emu.inject(count, kind)
+    # the driver notices bad data within one keep-alive period
+    end = time.monotonic() + 1.0
+    while (bench.counters()['resyncs'] == c0['resyncs']
+           and time.monotonic() < end):
+        time.sleep(0.001)
+    end = time.monotonic() + args.recover_s
+    if bench.counters()['resyncs'] != c0['resyncs']:
+        while emu.handshakes == handshakes and time.monotonic() < end:
+            time.sleep(0.001)
+        after = emu.ack_ns if emu.handshakes != handshakes else now_ns()
+    else:
+        after = start
+    ts = bench.wait_data(mode_fd, emu.mode, after,
+                         timeout=max(end - time.monotonic(), 0))
+    c1 = bench.counters()
+    d = {k: c1[k] - c0[k] for k in c0}
+    desc = '%d x %s: resyncs %d, checksum errors %d, data timeouts %d' % (
+        count, kind, d['resyncs'], d['rx_chksum_errs'], d['data_timeouts'])
+    if ts:
+        desc += ', data again after %.1f ms' % ((ts - start) / 1e6)
+    print(desc)
+    if expect_resync is not None and bool(d['resyncs']) != expect_resync:
+        bench.fail('resync: %d x %s %s resync' % (
+            count, kind, 'did not' if expect_resync else 'caused a'))
+    if not ts:
+        bench.fail('resync: no data within %.1f s after %d x %s'
+                   % (args.recover_s, count, kind))
+
+
+def test_early_ack(bench, args):
+    print('== early ACK ignored by the sensor')
+    emu = bench.emu
+    emu.ignore_early_ack = True
+    try:
+        for i in range(2):
+            attempts, ignored = emu.attempts, emu.early_acks_ignored
+            start = now_ns()
+            bench.reconnect()
+            if not emu.wait_synced(timeout=10):
+                bench.fail('early ACK: handshake %d did not finish' % i)
+                return
+            attempts = emu.attempts - attempts
+            ignored = emu.early_acks_ignored - ignored
+            c = bench.counters()
+            print('%d: connected after %.1f ms, %d tries, %d early ACKs '
+                  'ignored, resyncs %d' % (i, (now_ns() - start) / 1e6,
+                                           attempts, ignored, c['resyncs']))
+            if i == 0 and not ignored:
+                print('(the cache entry was already marked, nothing to '
+                      'test)')
+                return
+            if i == 1 and ignored:
+                bench.fail('early ACK: sent again to a sensor that '
+                           'ignored it')
+    finally:
+        emu.ignore_early_ack = False
+
+
+def test_resync(bench, args):
+    print('== resync')
+    emu = bench.emu
+    path = bench.sensor_dir()
+    if not path:
+        bench.fail('resync: sensor is not connected')
+        return
+    mode_fd = os.open(os.path.join(path, 'mode_data'), os.O_RDONLY)
+    try:
+        if emu.sensor.type_id == COLOR_TYPE_ID:
+            print('(checksums of the color sensor are not checked)')
+        else:
+            # a few bad checksums are tolerated, more are not
+            _resync_case(bench, mode_fd, MAX_DATA_ERR // 2, 'chksum',
+                         False, args)
+            _resync_case(bench, mode_fd, MAX_DATA_ERR + 2, 'chksum',
+                         True, args)
+        _resync_case(bench, mode_fd, 1, 'header', True, args)
+        _resync_case(bench, mode_fd, 1, 'drop', None, args)
+        _resync_case(bench, mode_fd, 20, 'byte', None, args)
+
+        if not emu.wait_synced(timeout=10):
+            bench.fail('resync: sensor did not sync again')
+            return
+        c0, sent0 = bench.counters(), emu.frames_sent
+        corrupted0 = emu.frames_corrupted
+        emu.corrupt_kind, emu.corrupt_prob = 'byte', args.corrupt
+        time.sleep(args.duration)
+        emu.corrupt_prob = 0
+        c1 = bench.counters()
+        d = {k: c1[k] - c0[k] for k in c0}
+        print('%.1f%% random bit errors for %.1f s: sent %d, corrupted %d, '
+              'received %d, checksum errors %d, resyncs %d'
+              % (args.corrupt * 100, args.duration, emu.frames_sent - sent0,
+                 emu.frames_corrupted - corrupted0, d['rx_msgs'],
+                 d['rx_chksum_errs'], d['resyncs']))
+    finally:
+        os.close(mode_fd)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__.split('\n\n')[0],
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog='\n\n'.join(__doc__.split('\n\n')[1:]))
+    parser.add_argument('tests', nargs='*', metavar='TEST',
+                        help='tests to run: %s (default: all)'
+                        % ', '.join(TESTS))
+    parser.add_argument('--sensor', default='lego-ev3-uart-30',
+                        help='driver name or type id of the sensor')
+    parser.add_argument('--defs', default=emu_mod.DEFS_PATH,
+                        help='path to ev3_uart_sensor_defs.c')
+    parser.add_argument('--speed', type=int, default=57600,
+                        help='baud rate in the SPEED message')
+    parser.add_argument('--no-pace', dest='pace', action='store_false',
+                        help='do not limit writes to the baud rate')
+    parser.add_argument('--iterations', type=int, default=20,
+                        help='handshakes and latency samples')
+    parser.add_argument('--duration', type=float, default=2.0,
+                        help='seconds per rate step and random errors')
+    parser.add_argument('--rates', type=int, nargs='+',
+                        default=[100, 500, 1000, 2000, 5000, 10000, 20000,
+                                 50000, 100000],
+                        help='DATA messages per second to try')
+    parser.add_argument('--min-rate', type=int, default=1000,
+                        help='fail if the sustainable rate is lower')
+    parser.add_argument('--corrupt', type=float, default=0.01,
+                        help='probability of a bit error per DATA message')
+    parser.add_argument('--recover-s', type=float, default=5.0,
+                        help='fail if data does not resume within this time')
+    args = parser.parse_args()
+    for test in args.tests:
+        if test not in TESTS:
+            parser.error('unknown test "%s"' % test)
+    if not args.tests:
+        args.tests = TESTS
+
+    if not os.path.isdir(DEBUGFS):
+        print('%s does not exist, is ev3_uart_sensor_ld loaded and debugfs '
+              'mounted?' % DEBUGFS, file=sys.stderr)
+        return 2
+
+    sensor = emu_mod.find_sensor(emu_mod.parse_defs(args.defs), args.sensor)
+    bench = Bench(sensor, args.speed, args.pace)
+    print('%s on %s' % (sensor, bench.name))
+    try:
+        for test in TESTS:
+            if test in args.tests:
+                globals()['test_' + test](bench, args)
+    finally:
+        bench.close()
+
+    if bench.failed:
+        print('%d failed' % len(bench.failed))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,622 @@
+#!/usr/bin/env python3
+#
+# LEGO MINDSTORMS EV3 UART sensor emulator for pseudo-terminals
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed "as is" WITHOUT ANY WARRANTY of any
+# kind, whether express or implied; without even the implied warranty
+# of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+"""Emulates an EV3 UART sensor on the master side of a pseudo-terminal.
+
+The sensors are read from sensors/ev3_uart_sensor_defs.c. The emulator sends
+TYPE, MODES, SPEED and the INFO of each mode at 2400 baud until the host
+acknowledges, then streams DATA in the selected mode. It answers SELECT
+commands and starts over when the host stops sending keep-alive NACKs, the
+same as a real sensor that lost its connection.
+
+Running this file by itself attaches the N_LEGOEV3 line discipline to the
+slave side, so the sensor shows up in /sys/class/lego-sensor like a real one.
+"""
+
+import argparse
+import fcntl
+import math
+import os
+import random
+import re
+import struct
+import sys
+import termios
+import threading
+import time
+import tty
+
+N_LEGOEV3 = 29
+N_TTY = 0
+
+MSG_TYPE_SYS = 0x00
+MSG_TYPE_CMD = 0x40
+MSG_TYPE_INFO = 0x80
+MSG_TYPE_DATA = 0xC0
+MSG_TYPE_MASK = 0xC0
+MSG_CMD_MASK = 0x07
+
+SYS_SYNC = 0x0
+SYS_NACK = 0x2
+SYS_ACK = 0x4
+
+CMD_TYPE = 0x0
+CMD_MODES = 0x1
+CMD_SPEED = 0x2
+CMD_SELECT = 0x3
+CMD_WRITE = 0x4
+
+INFO_NAME = 0x00
+INFO_RAW = 0x01
+INFO_PCT = 0x02
+INFO_SI = 0x03
+INFO_UNITS = 0x04
+INFO_FORMAT = 0x80
+
+DATA_8 = 0x00
+DATA_16 = 0x01
+DATA_32 = 0x02
+DATA_FLOAT = 0x03
+
+SPEED_MIN = 2400
+MAX_DATA_SIZE = 32
+
+# how long the host waits after the ACK before it changes speed (seconds)
+SPEED_CHANGE_DELAY = 0.004
+
+# lego_sensor_data_type -> (EV3 UART data type, struct format)
+DATA_TYPES = {
+    'LEGO_SENSOR_DATA_U8': (DATA_8, 'B'),
+    'LEGO_SENSOR_DATA_S8': (DATA_8, 'b'),
+    'LEGO_SENSOR_DATA_U16': (DATA_16, 'H'),
+    'LEGO_SENSOR_DATA_S16': (DATA_16, 'h'),
+    'LEGO_SENSOR_DATA_U32': (DATA_32, 'I'),
+    'LEGO_SENSOR_DATA_S32': (DATA_32, 'i'),
+    'LEGO_SENSOR_DATA_FLOAT': (DATA_FLOAT, 'f'),
+}
+
+# ev3_uart_default_mode_info in ev3_uart_sensor_ld.c
+DEFAULT_MODE = {
+    'name': '',
+    'data_sets': 1,
+    'data_type': 'LEGO_SENSOR_DATA_U8',
+    'units': '',
+    'figures': 4,
+    'decimals': 0,
+    'raw_min': 0,
+    'raw_max': 1023,
+    'pct_min': 0,
+    'pct_max': 100,
+    'si_min': 0,
+    'si_max': 1,
+}
+
+CORRUPTIONS = ('chksum', 'byte', 'drop', 'header')
+
+DEFS_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                         '..', '..', 'sensors', 'ev3_uart_sensor_defs.c')
+
+
+def now_ns():
+    """CLOCK_MONOTONIC in nanoseconds, the clock used for mode_data."""
+    return time.clock_gettime_ns(time.CLOCK_MONOTONIC)
+
+
+class SensorMode:
+    def __init__(self, fields):
+        info = dict(DEFAULT_MODE)
+        info.update(fields)
+        # a leading space in the defs hides a mode, it is not sent
+        self.name = info['name'].strip()
+        self.data_sets = int(info['data_sets'])
+        self.type_name = info['data_type']
+        self.data_type, self.fmt = DATA_TYPES[self.type_name]
+        self.units = info['units']
+        self.figures = int(info['figures'])
+        self.decimals = int(info['decimals'])
+        self.raw = (float(info['raw_min']), float(info['raw_max']))
+        self.pct = (float(info['pct_min']), float(info['pct_max']))
+        self.si = (float(info['si_min']), float(info['si_max']))
+
+    @property
+    def data_size(self):
+        return self.data_sets * struct.calcsize('<' + self.fmt)
+
+    def pack(self, value):
+        """DATA payload with every data set set to @value."""
+        if self.fmt != 'f':
+            bits = struct.calcsize(self.fmt) * 8
+            value = int(value)
+            if self.fmt.islower():
+                value = (value + (1 << (bits - 1))) % (1 << bits) \
+                    - (1 << (bits - 1))
+            else:
+                value %= 1 << bits
+        return struct.pack('<' + self.fmt * self.data_sets, *[value]
+                           * self.data_sets)
+
+
+class SensorDef:
+    def __init__(self, name, num_modes, num_view_modes, modes):
+        self.name = name
+        self.type_id = int(name.rsplit('-', 1)[1])
+        self.num_modes = num_modes
+        self.num_view_modes = num_view_modes
+        self.modes = modes
+
+    def __repr__(self):
+        return '%s (type %d, %d modes)' % (self.name, self.type_id,
+                                           self.num_modes)
+
+
+def _c_fields(text):
+    fields = {}
+    for key, value in re.findall(r'\.(\w+)\s*=\s*("[^"]*"|[^,\n]+)', text):
+        value = value.strip()
+        if value.startswith('"'):
+            value = value[1:-1]
+        # duplicate initializers are legal C, the last one wins
+        fields[key] = value
+    return fields
+
+
+def parse_defs(path=DEFS_PATH):
+    """Returns the sensors in ev3_uart_sensor_defs.c, keyed by name."""
+    with open(path) as f:
+        text = re.sub(r'/\*.*?\*/', '', f.read(), flags=re.S)
+
+    sensors = {}
+    starts = [m for m in re.finditer(r'\[LEGO_EV3_\w+\]\s*=\s*\{', text)]
+    for i, start in enumerate(starts):
+        end = starts[i + 1].start() if i + 1 < len(starts) else len(text)
+        block = text[start.end():end]
+        head, _, body = block.partition('.mode_info')
+        fields = _c_fields(head)
+        modes = {}
+        for m in re.finditer(r'\[(\d+)\]\s*=\s*\{([^}]*)\}', body):
+            modes[int(m.group(1))] = SensorMode(_c_fields(m.group(2)))
+        num_modes = int(fields['num_modes'])
+        sensor = SensorDef(fields['name'], num_modes,
+                           int(fields.get('num_view_modes', num_modes)),
+                           [modes.get(n, SensorMode({}))
+                            for n in range(num_modes)])
+        sensors[sensor.name] = sensor
+
+    return sensors
+
+
+def find_sensor(sensors, name):
+    """Looks up a sensor by driver name or type id."""
+    if name in sensors:
+        return sensors[name]
+    for sensor in sensors.values():
+        if name == str(sensor.type_id):
+            return sensor
+    raise KeyError('unknown sensor "%s", known sensors are: %s'
+                   % (name, ', '.join(sorted(sensors))))
+
+
+def _size_code(size):
+    return int(math.log2(size)) & 0x7
+
+
+def _pad(payload):
+    size = 1 << math.ceil(math.log2(max(len(payload), 1)))
+    if size > MAX_DATA_SIZE:
+        raise ValueError('payload is too big')
+    return payload + bytes(size - len(payload))
+
+
+def message(msg_type, cmd, payload=b'', info=None):
+    """Builds a message with header, payload padded to a power of 2 and
+    checksum. INFO messages have the INFO command after the header."""
+    payload = _pad(payload)
+    msg = bytes([msg_type | _size_code(len(payload)) << 3
+                 | (cmd & MSG_CMD_MASK)])
+    if info is not None:
+        msg += bytes([info])
+    msg += payload
+    chksum = 0xFF
+    for byte in msg:
+        chksum ^= byte
+    return msg + bytes([chksum])
+
+
+def data_message(mode, payload):
+    return message(MSG_TYPE_DATA, mode, payload)
+
+
+def info_messages(sensor, speed):
+    """The messages a sensor sends before its ACK, highest mode first."""
+    msgs = [
+        message(MSG_TYPE_CMD, CMD_TYPE, bytes([sensor.type_id])),
+        message(MSG_TYPE_CMD, CMD_MODES,
+                bytes([sensor.num_modes - 1, sensor.num_view_modes - 1])),
+        message(MSG_TYPE_CMD, CMD_SPEED, struct.pack('<I', speed)),
+    ]
+    for n in reversed(range(sensor.num_modes)):
+        mode = sensor.modes[n]
+        msgs.append(message(MSG_TYPE_INFO, n, mode.name.encode(), INFO_NAME))
+        msgs.append(message(MSG_TYPE_INFO, n, struct.pack('<ff', *mode.raw),
+                            INFO_RAW))
+        msgs.append(message(MSG_TYPE_INFO, n, struct.pack('<ff', *mode.pct),
+                            INFO_PCT))
+        msgs.append(message(MSG_TYPE_INFO, n, struct.pack('<ff', *mode.si),
+                            INFO_SI))
+        if mode.units:
+            msgs.append(message(MSG_TYPE_INFO, n, mode.units.encode(),
+                                INFO_UNITS))
+        msgs.append(message(MSG_TYPE_INFO, n,
+                            bytes([mode.data_sets, mode.data_type,
+                                   mode.figures, mode.decimals]),
+                            INFO_FORMAT))
+    return msgs
+
+
+def corrupt(msg, kind, num_modes):
+    """Returns @msg damaged in the way given by @kind (see CORRUPTIONS)."""
+    msg = bytearray(msg)
+    if kind == 'chksum':
+        msg[-1] ^= 0x5A
+    elif kind == 'byte':
+        pos = random.randrange(len(msg))
+        msg[pos] ^= 1 << random.randrange(8)
+    elif kind == 'drop':
+        del msg[random.randrange(len(msg)):]
+    elif kind == 'header':
+        # valid DATA for a mode that the sensor does not have
+        if num_modes > MSG_CMD_MASK:
+            msg[0] = MSG_TYPE_CMD | CMD_TYPE
+        else:
+            msg[0] = (msg[0] & ~MSG_CMD_MASK) | num_modes
+        msg[-1] = 0xFF
+        for byte in msg[:-1]:
+            msg[-1] ^= byte
+    else:
+        raise ValueError('unknown corruption "%s"' % kind)
+    return bytes(msg)
+
+
+class Emulator:
+    """One sensor on the master side of a pseudo-terminal.
+
+    @fd is the master file descriptor. @speed is the baud rate asked for in
+    the SPEED message. When @pace is set, writes take as long as they would
+    on a real wire at the current baud rate. DATA is sent at @rate messages
+    per second (0 sends nothing until send_data() is called). When
+    @ignore_early_ack is set, an ACK that arrives before all of the INFO has
+    been sent is ignored, like a sensor that does not support early ACKs.
+    """
+
+    def __init__(self, fd, sensor, speed=57600, rate=100, pace=True,
+                 nack_timeout=0.3, ack_timeout=0.1, ignore_early_ack=False):
+        self.fd = fd
+        self.sensor = sensor
+        self.speed = speed
+        self.rate = rate
+        self.pace = pace
+        self.ignore_early_ack = ignore_early_ack
+        self.nack_timeout = nack_timeout
+        self.ack_timeout = ack_timeout
+        self.mode = 0
+        self.value = 0
+        self.corrupt_kind = 'chksum'
+        self.corrupt_prob = 0.0
+        self.corrupt_count = 0
+
+        self.baud = SPEED_MIN
+        self.synced = False
+        self.handshakes = 0
+        self.attempts = 0
+        self.early_acks_ignored = 0
+        self.handshake_start = 0
+        self.handshake_ns = 0
+        self.ack_ns = 0
+        self.last_nack = 0
+        self.nacks = 0
+        self.selects = 0
+        self.writes = []
+        self.frames_sent = 0
+        self.frames_corrupted = 0
+        self.bytes_sent = 0
+
+        self._lock = threading.Condition()
+        self._write_lock = threading.Lock()
+        self._ack = False
+        self._restart = False
+        self._stop = False
+        self._rx = bytearray()
+        self._threads = []
+
+    # host side
+
+    def _handle_rx(self, data):
+        with self._lock:
+            self._rx += data
+            while self._rx:
+                byte = self._rx[0]
+                if byte & MSG_TYPE_MASK == MSG_TYPE_SYS:
+                    del self._rx[0]
+                    if byte == SYS_ACK:
+                        self._ack = True
+                        self.ack_ns = now_ns()
+                    elif byte == SYS_NACK:
+                        self.nacks += 1
+                        self.last_nack = now_ns()
+                    continue
+                if byte & MSG_TYPE_MASK != MSG_TYPE_CMD:
+                    del self._rx[0]
+                    continue
+                size = (1 << ((byte >> 3) & 0x7)) + 2
+                if len(self._rx) < size:
+                    break
+                msg, self._rx = bytes(self._rx[:size]), self._rx[size:]
+                chksum = 0xFF
+                for b in msg[:-1]:
+                    chksum ^= b
+                if chksum != msg[-1]:
+                    continue
+                # any command counts as keep-alive, like NACK
+                self.last_nack = now_ns()
+                if byte & MSG_CMD_MASK == CMD_SELECT:
+                    if msg[1] < self.sensor.num_modes:
+                        self.mode = msg[1]
+                        self.selects += 1
+                elif byte & MSG_CMD_MASK == CMD_WRITE:
+                    self.writes.append(msg[1:-1])
+            self._lock.notify_all()
+
+    def _reader(self):
+        while not self._stop:
+            try:
+                data = os.read(self.fd, 4096)
+            except OSError:
+                # EIO while the slave side is closed
+                time.sleep(0.01)
+                continue
+            if data:
+                self._handle_rx(data)
+
+    # sensor side
+
+    def _write(self, data):
+        with self._write_lock:
+            start = time.monotonic()
+            view = memoryview(data)
+            while view:
+                n = os.write(self.fd, view)
+                view = view[n:]
+            self.bytes_sent += len(data)
+        if self.pace:
+            left = len(data) * 10 / self.baud - (time.monotonic() - start)
+            if left > 0:
+                time.sleep(left)
+
+    def _wait(self, timeout, pred):
+        with self._lock:
+            return self._lock.wait_for(
+                lambda: pred() or self._stop or self._restart, timeout)
+
+    def _handshake(self):
+        """Sends the sensor INFO until the host ACKs. Returns False when
+        stopped or restarted."""
+        msgs = info_messages(self.sensor, self.speed)
+        while True:
+            with self._lock:
+                if self._stop or self._restart:
+                    return False
+                self.baud = SPEED_MIN
+                self._ack = False
+                self.synced = False
+                self.handshake_start = now_ns()
+                self.attempts += 1
+            for msg in msgs:
+                self._write(msg)
+                if self._ack:
+                    if not self.ignore_early_ack:
+                        # the host knows this sensor and ACKed early
+                        break
+                    with self._lock:
+                        self._ack = False
+                        self.early_acks_ignored += 1
+            else:
+                if self.ignore_early_ack:
+                    with self._lock:
+                        self._ack = False
+                self._write(bytes([SYS_ACK]))
+                self._wait(self.ack_timeout, lambda: self._ack)
+            with self._lock:
+                if self._ack:
+                    self.handshake_ns = self.ack_ns - self.handshake_start
+                    self.handshakes += 1
+                    self.last_nack = now_ns()
+                    self.mode = 0
+                    break
+        time.sleep(SPEED_CHANGE_DELAY)
+        with self._lock:
+            self.baud = self.speed
+            self.synced = True
+            self._lock.notify_all()
+        return True
+
+    def frame(self, mode=None, value=None):
+        """A DATA message in @mode (default: the selected mode)."""
+        if mode is None:
+            mode = self.mode
+        if value is None:
+            self.value += 1
+            value = self.value
+        return data_message(mode, self.sensor.modes[mode].pack(value))
+
+    def send_data(self, value=None, mode=None, corruption=None):
+        """Sends one DATA message now. Returns the CLOCK_MONOTONIC time
+        before the write."""
+        msg = self.frame(mode, value)
+        if corruption:
+            msg = corrupt(msg, corruption, self.sensor.num_modes)
+            self.frames_corrupted += 1
+        t = now_ns()
+        self._write(msg)
+        self.frames_sent += 1
+        return t
+
+    def _stream(self):
+        start = time.monotonic()
+        sent = 0
+        while not self._stop and not self._restart:
+            if now_ns() - self.last_nack > self.nack_timeout * 1e9:
+                # the host lost sync with us
+                return
+            rate = self.rate
+            if not rate:
+                self._wait(0.01, lambda: False)
+                start = time.monotonic()
+                sent = 0
+                continue
+            due = int((time.monotonic() - start) * rate) - sent
+            if due <= 0:
+                time.sleep(min(1 / rate, 0.01))
+                continue
+            # fall behind instead of building up an unbounded burst
+            due = min(due, max(int(rate / 100), 1))
+            burst = bytearray()
+            for _ in range(due):
+                msg = self.frame()
+                if self.corrupt_count or (self.corrupt_prob and
+                                          random.random() < self.corrupt_prob):
+                    if self.corrupt_count:
+                        self.corrupt_count -= 1
+                    msg = corrupt(msg, self.corrupt_kind,
+                                  self.sensor.num_modes)
+                    self.frames_corrupted += 1
+                burst += msg
+            self._write(bytes(burst))
+            self.frames_sent += due
+            sent += due
+
+    def _run(self):
+        while not self._stop:
+            with self._lock:
+                self._restart = False
+            if self._handshake():
+                self._stream()
+            with self._lock:
+                self.synced = False
+
+    # control
+
+    def start(self):
+        for target in (self._reader, self._run):
+            thread = threading.Thread(target=target, daemon=True)
+            thread.start()
+            self._threads.append(thread)
+
+    def stop(self):
+        with self._lock:
+            self._stop = True
+            self._lock.notify_all()
+
+    def restart(self):
+        """Starts over with TYPE, like a sensor that was plugged in again."""
+        with self._lock:
+            self._restart = True
+            self.synced = False
+            self._lock.notify_all()
+
+    def wait_synced(self, timeout=10):
+        with self._lock:
+            return self._lock.wait_for(lambda: self.synced, timeout)
+
+    def inject(self, count, kind='chksum'):
+        """Corrupts the next @count streamed DATA messages."""
+        self.corrupt_kind = kind
+        self.corrupt_count = count
+
+
+def open_pty():
+    """Returns the master fd, the slave fd and the tty name of the slave
+    (the name used for the debugfs directory and port_name)."""
+    master, slave = os.openpty()
+    # the master side must not echo the commands back to the sensor
+    tty.setraw(master)
+    name = os.path.basename(os.ttyname(slave))
+    if os.ttyname(slave).startswith('/dev/pts/'):
+        name = 'pts' + name
+    return master, slave, name
+
+
+def set_ldisc(fd, ldisc):
+    fcntl.ioctl(fd, termios.TIOCSETD, struct.pack('i', ldisc))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('sensor', nargs='?',
+                        help='driver name or type id (default: list them)')
+    parser.add_argument('--defs', default=DEFS_PATH,
+                        help='path to ev3_uart_sensor_defs.c')
+    parser.add_argument('--speed', type=int, default=57600,
+                        help='baud rate in the SPEED message')
+    parser.add_argument('--rate', type=float, default=100,
+                        help='DATA messages per second')
+    parser.add_argument('--no-pace', dest='pace', action='store_false',
+                        help='do not limit writes to the baud rate')
+    parser.add_argument('--corrupt', type=float, default=0.0,
+                        help='probability that a DATA message is corrupted')
+    parser.add_argument('--corruption', choices=CORRUPTIONS,
+                        default='chksum', help='how messages are corrupted')
+    parser.add_argument('--ignore-early-ack', action='store_true',
+                        help='ignore ACKs that arrive before all INFO is sent')
+    parser.add_argument('--no-attach', dest='attach', action='store_false',
+                        help='do not attach the line discipline')
+    args = parser.parse_args()
+
+    sensors = parse_defs(args.defs)
+    if not args.sensor:
+        for sensor in sensors.values():
+            print(sensor)
+        return 0
+    sensor = find_sensor(sensors, args.sensor)
+
+    master, slave, name = open_pty()
+    if args.attach:
+        set_ldisc(slave, N_LEGOEV3)
+    emu = Emulator(master, sensor, speed=args.speed, rate=args.rate,
+                   pace=args.pace, ignore_early_ack=args.ignore_early_ack)
+    emu.corrupt_prob = args.corrupt
+    emu.corrupt_kind = args.corruption
+    emu.start()
+    print('%s on %s (%s)' % (sensor, os.ttyname(slave), name), flush=True)
+
+    handshakes = 0
+    try:
+        while True:
+            time.sleep(0.5)
+            if emu.handshakes != handshakes:
+                handshakes = emu.handshakes
+                print('handshake %d took %.1f ms' % (handshakes,
+                      emu.handshake_ns / 1e6), flush=True)
+    except KeyboardInterrupt:
+        pass
+    emu.stop()
+    if args.attach:
+        set_ldisc(slave, N_TTY)
+    print('%d frames sent, %d corrupted, %d NACKs, %d SELECTs'
+          % (emu.frames_sent, emu.frames_corrupted, emu.nacks, emu.selects))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())